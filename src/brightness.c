@@ -405,6 +405,14 @@ l_start:
         redis_port = REDIS_PORT;
     }
     
+    if(LOG_RECORDER_OK != log_recorder_open(FLAG_KEY, NULL)) {
+        LOG_WARNING("Failed to open flight recorder!");
+    }
+
+    if(LOG_ASYNC_OK != log_async_start()) {
+        LOG_WARNING("Failed to start async logging, fallback to sync output!");
+    }
+
     LOG_INFO("Connecting to Redis in sync mode!");
     gs_sync_context = redisConnectWithTimeout(redis_ip, redis_port, timeout);
     if(NULL == gs_sync_context) {
@@ -530,6 +538,7 @@ l_free_sync_redis:
 l_exit:
     if(!gs_exit) {    
         LOG_ERROR("Execution failed retry!");
+        log_recorder_dump();
         sleep(1);
         goto l_start;
     }
@@ -82,6 +82,7 @@
 
 #include "log.h"
 #include "to_socket.h"
+#include "stats.h"
 
 /*
  * 
@@ -108,34 +109,342 @@
 #define MAX_OUTPUT_PIN_COUNT    32
 
 /*
- * Context for redis connection and controller
- * network connection
+ * Maximum messages per second printed by each rate
+ * limited log call site on the message path
+ */
+#define CARGADOR_LOG_RATE       20
+
+/*
+ * Milli seconds a command may stay unacknowledged by
+ * the controller before the connection is dropped
+ */
+#define CARGADOR_USER_TIMEOUT   1000
+
+/*
+ * Controller command bits, the low 5 bits are the PIN
+ * index. CARGADOR_CMD_QUERY asks the PIN status without
+ * changing it.
+ */
+#define CARGADOR_CMD_OFF        0x20
+#define CARGADOR_CMD_QUERY      0x40
+
+/*
+ * Heartbeat of idle controller links: a status query of
+ * CARGADOR_HEARTBEAT_PIN every interval, the controller
+ * is considered dead after CARGADOR_HEARTBEAT_MISSES 
+ * unanswered queries in a row
+ */
+#define CARGADOR_HEARTBEAT_PIN      (MAX_OUTPUT_PIN_COUNT - 1)
+#define CARGADOR_HEARTBEAT_INTERVAL 250000
+#define CARGADOR_HEARTBEAT_MISSES   3
+
+/*
+ * Keep a second, idle connection to the controller and
+ * switch to it when the active one fails. Set to 0 when
+ * the controller has no free socket slot for it.
+ */
+#define CARGADOR_STANDBY            1
+
+/*
+ * Subscribed flag cargador/<ip>/refresh, when set to a 
+ * value other than "0" every command is sent to the 
+ * controller even when the PIN is already in the requested
+ * state
+ */
+#define REFRESH_FLAG_VALUE          "refresh"
+
+/*
+ * Default coalescing window in milli seconds, changed 
+ * with flag cargador/<ip>/coalesce. A PIN is switched at
+ * most once per window, later updates within the window
+ * only keep the latest state.
+ */
+#define COALESCE_FLAG_VALUE         "coalesce"
+#define CARGADOR_COALESCE_WINDOW    100
+
+/*
+ * Default period in seconds of the drift reconciliation,
+ * changed with flag cargador/<ip>/reconcile, 0 turns it 
+ * off. Every PIN is queried once per period.
+ */
+#define RECONCILE_FLAG_VALUE        "reconcile"
+#define CARGADOR_RECONCILE_PERIOD   60
+
+/*
+ * Subscribed flag cargador/<ip>/reload, any message 
+ * reloads the PIN configuration from hash cargador/<ip>
+ * without restarting. Keyspace notifications of the hash
+ * reload it as well when they are enabled in redis.
+ */
+#define RELOAD_FLAG_VALUE           "reload"
+
+/*
+ * Maximum count of controllers served by one process and
+ * size of the buffer keeping the address of a controller
+ */
+#define CARGADOR_MAX_CONTROLLERS    16
+#define CARGADOR_ADDR_SIZE          64
+
+/*
+ * Prefix of the first parameter naming a redis set in
+ * DB 0 instead of a list of controllers, the members of
+ * the set are the controller addresses
+ */
+#define CARGADOR_DISCOVER_PREFIX    '@'
+
+/*
+ * Seconds to wait before connecting to a failed controller
+ * again, the other controllers are not affected
+ */
+#define CARGADOR_RECONNECT_INTERVAL 1
+
+/*
+ * Return value for sending command to controller,
+ * CARGADOR_REDIS_ERROR means redis failed and not the
+ * controller
+ */
+#define CARGADOR_SND_RCV_ERROR      -1
+#define CARGADOR_SND_RCV_OK         0
+#define CARGADOR_REDIS_ERROR        -2
+
+/*
+ * Size of the outbound queue of commands not written to
+ * the controller socket yet, and of the ring of commands
+ * written but not acknowledged (a power of 2)
+ */
+#define CARGADOR_QUEUE_SIZE         256
+#define CARGADOR_INFLIGHT_SIZE      64
+
+/*
+ * One command written to controller, acked is set when
+ * it is acknowledged out of order. sample is set when no
+ * other command was in flight, so its round trip is
+ * sampled for the round trip time estimate.
+ */
+typedef struct {
+    unsigned char cmd;
+    unsigned char acked;
+    unsigned char sample;
+    uint64_t sent;
+} cargador_inflight;
+
+/*
+ * State of the heartbeat query
+ */
+#define CARGADOR_PROBE_IDLE         0
+#define CARGADOR_PROBE_SENT         1
+#define CARGADOR_PROBE_MISSED       2
+
+/*
+ * Size of the buffer keeping the names of all subscribed
+ * topics, and slot count of the hash index from topic
+ * name to route, a power of 2 larger than
+ * MAX_OUTPUT_PIN_COUNT
+ */
+#define CARGADOR_TOPIC_BUFFER_SIZE  2048
+#define CARGADOR_ROUTE_SLOTS        64
+
+/*
+ * Prefix of a topic in the PIN configuration inverting the
+ * polarity of the PIN, it is switched on when the topic
+ * is "0"
+ */
+#define CARGADOR_INVERT_PREFIX      '!'
+
+/*
+ * One subscribed topic and the mask of PINs depending on
+ * it. topic is the offset of the name in the names buffer
+ * of the table, so the table can be copied.
+ */
+typedef struct {
+    size_t topic;
+    uint32_t hash;
+    uint32_t pins;
+} cargador_route;
+
+/*
+ * Routing table from topic to PINs. Topic names are
+ * stored once in names, index maps the hash of a topic to
+ * its route and -1 marks a free slot. Bit n of inverted is
+ * set when PIN n has inverted polarity.
+ */
+typedef struct {
+    int count;
+    uint32_t inverted;
+    size_t names_used;
+    cargador_route routes[MAX_OUTPUT_PIN_COUNT];
+    signed char index[CARGADOR_ROUTE_SLOTS];
+    char names[CARGADOR_TOPIC_BUFFER_SIZE];
+} cargador_routes;
+
+#define ROUTE_TOPIC(t, i)           ((t)->names + (t)->routes[i].topic)
+
+/*
+ * One controller served by this process. Everything but
+ * the redis connections is per controller, so a failed
+ * controller is reconnected on its own.
+ *
+ * addr, port               Address of the controller
+ * config_key               PIN configuration hash
+ *                          cargador/<ip> in DB 0, also the
+ *                          prefix of the flags in DB 1
+ * stats_key                Hash the stats are published to
+ * slot_key                 Slot registry of the controller
+ * socket                   Active connection, -1 while
+ *                          reconnecting
+ * slot                     Slot held by the active
+ *                          connection, -1 until the
+ *                          controller sent it
+ * registered_slot          Slot registered in slot_key, -1
+ *                          when there is none
+ * options                  Options of new connections
+ * rtt                      Round trip time estimate of the
+ *                          link, kept across restarts. The
+ *                          ack timeout and the connect
+ *                          timeout are derived from it.
+ * queue, inflight          Commands are queued by the
+ *                          redis callbacks and written by
+ *                          the events of the non-blocking
+ *                          socket, so a slow acknowledge
+ *                          does not stall the event loop.
+ *                          Every command in flight has its
+ *                          own timeout, the timer is set
+ *                          for the oldest one.
+ * busy, pending            Latest wins coalescing per PIN.
+ *                          Bit n of busy is set while a
+ *                          command for PIN n is queued or
+ *                          in flight, then later commands
+ *                          for the PIN replace its pending
+ *                          command in pending_cmd and bit n
+ *                          of pending is set. The pending
+ *                          command is sent when the
+ *                          acknowledge arrived and
+ *                          coalesce_window nano seconds
+ *                          passed since the last command.
+ * desired                  Output state requested by the
+ *                          topics, bit n is set when PIN n
+ *                          should be on. Only the bits set
+ *                          in desired_valid are known. Bit n
+ *                          of loaded is set when the topic
+ *                          of PIN n was read, also when it
+ *                          has no value yet.
+ * reconcile_event          Drift reconciliation, queries
+ *                          the next PIN with 0x40 every
+ *                          reconcile_period /
+ *                          MAX_OUTPUT_PIN_COUNT seconds,
+ *                          only when no other command is
+ *                          queued or in flight. A PIN not
+ *                          in the desired state is
+ *                          corrected.
+ * shadow                   Output state confirmed by the
+ *                          controller, bit n is set when
+ *                          PIN n is on. Only the bits set
+ *                          in shadow_valid are known, both
+ *                          are cleared on every new
+ *                          connection. Commands matching
+ *                          the shadow are not sent unless
+ *                          force_refresh is set.
+ * dirty                    PINs whose desired state
+ *                          changed while the controller was
+ *                          not connected, or whose command
+ *                          was lost with a failed
+ *                          connection. Only these PINs are
+ *                          switched after a reconnect, the
+ *                          others are verified with 0x40.
+ * routes                   Routing table loaded from
+ *                          config_key
+ */
+typedef struct {
+    char addr[CARGADOR_ADDR_SIZE];
+    int port;
+    char config_key[STATS_KEY_SIZE];
+    char stats_key[STATS_KEY_SIZE];
+    char slot_key[TO_SLOT_KEY_SIZE];
+
+    to_socket_ctx socket;
+    int slot;
+    int registered_slot;
+    to_socket_options options;
+    to_connect_request req;
+    to_reader reader;
+    to_heartbeat heartbeat;
+    to_standby standby;
+    to_rtt rtt;
+    int rtt_initialized;
+
+    struct event* read_event;
+    struct event* write_event;
+    struct event* timeout_event;
+    struct event* coalesce_event;
+    struct event* reconcile_event;
+    struct event* reconnect_event;
+
+    unsigned char queue[CARGADOR_QUEUE_SIZE];
+    size_t queue_len;
+    cargador_inflight inflight[CARGADOR_INFLIGHT_SIZE];
+    unsigned int inflight_head;
+    unsigned int inflight_tail;
+    int probe;
+
+    uint32_t busy;
+    uint32_t pending;
+    unsigned char pending_cmd[MAX_OUTPUT_PIN_COUNT];
+    uint64_t last_sent[MAX_OUTPUT_PIN_COUNT];
+    uint64_t coalesce_window;
+
+    uint32_t desired;
+    uint32_t desired_valid;
+    uint32_t loaded;
+    uint32_t dirty;
+    int reconcile_period;
+    int reconcile_pin;
+
+    uint32_t shadow;
+    uint32_t shadow_valid;
+    int force_refresh;
+
+    unsigned long commands_sent;
+    unsigned long commands_suppressed;
+    unsigned long commands_coalesced;
+    unsigned long drift_corrected;
+    unsigned long pins_replayed;
+    stats_histogram send_recv_stats;
+
+    cargador_routes routes;
+} cargador_ctrl;
+
+/*
+ * 1 when the controller sent its slot on the active
+ * connection and commands can be queued
+ */
+#define CTRL_READY(ctrl)            (NULL != (ctrl)->read_event && 0 <= (ctrl)->slot)
+
+/*
+ * Context for redis connections, shared by all
+ * controllers. The sync connection is in DB 1.
  */
 static redisAsyncContext *gs_async_context = NULL;
-static to_socket_ctx gs_socket = -1;
+static redisContext *gs_sync_context = NULL;
+
+/*
+ * Event loop of the service, stopped when redis is
+ * disconnected so timers do not keep it running
+ */
+static struct event_base *gs_base = NULL;
 
 /*
- * Flag for micro srevice exit event, when set 
+ * Flag for micro srevice exit event, when set
  * to 1 the micro service will not restart
  * automatically, but exit
  */
 static int gs_exit = 0;
 
 /*
- * Return value for sending command to controller
+ * Controllers served by this process
  */
-#define CARGADOR_SND_RCV_ERROR      -1
-#define CARGADOR_SND_RCV_OK         0
+static cargador_ctrl gs_ctrls[CARGADOR_MAX_CONTROLLERS];
+static int gs_ctrl_count = 0;
 
-/*
- * Use this linked list format to describe PINs that depends on 
- * same redis topic
- */                                                        
-typedef struct linked_list_node {
-    unsigned char pin_id;
-    unsigned char topic_idx;
-    struct linked_list_node* pNext;
-} list_node;
 
 /*
  * exitCallback is used to process exit notification
@@ -155,17 +464,17 @@ void exitCallback(redisAsyncContext *c, void *r, void *privdata) {
 
     if (reply == NULL) {
         if (c->errstr) {
-            LOG_ERROR("errstr: %n", c->errstr);
+            LOG_ERROR("errstr: %s", c->errstr);
             redisAsyncDisconnect(c);
         }
         return;
     }
     
-    LOG_DETAILS("sub reply type: %d", reply->type);
-    LOG_DETAILS("sub reply element count: %d", reply->elements);
+    LOGM_DETAILS(LOG_MODULE_REDIS, "sub reply type: %d", reply->type);
+    LOGM_DETAILS(LOG_MODULE_REDIS, "sub reply element count: %d", reply->elements);
 
     for(size_t i = 0; i < reply->elements; i++) {
-        LOG_DETAILS("sub reply element %d: %s", i, reply->element[i]->str);
+        LOGM_DETAILS_RL(LOG_MODULE_REDIS, CARGADOR_LOG_RATE, "sub reply element %d: %s", i, reply->element[i]->str);
     }
 
     if(3 == reply->elements && reply->element[1] && reply->element[1]->str && reply->element[2] && reply->element[2]->str) {
@@ -196,17 +505,17 @@ void resetCallback(redisAsyncContext *c, void *r, void *privdata) {
 
     if (reply == NULL) {
         if (c->errstr) {
-            LOG_ERROR("errstr: %n", c->errstr);
+            LOG_ERROR("errstr: %s", c->errstr);
             redisAsyncDisconnect(c);
         }
         return;
     }
     
-    LOG_DETAILS("sub reply type: %d", reply->type);
-    LOG_DETAILS("sub reply element count: %d", reply->elements);
+    LOGM_DETAILS(LOG_MODULE_REDIS, "sub reply type: %d", reply->type);
+    LOGM_DETAILS(LOG_MODULE_REDIS, "sub reply element count: %d", reply->elements);
     
     for(size_t i = 0; i < reply->elements; i++) {
-        LOG_DETAILS("sub reply element %d: %s", i, reply->element[i]->str);
+        LOGM_DETAILS_RL(LOG_MODULE_REDIS, CARGADOR_LOG_RATE, "sub reply element %d: %s", i, reply->element[i]->str);
     }
 
     if(3 == reply->elements && reply->element[1] && reply->element[1]->str && reply->element[2] && reply->element[2]->str) {
@@ -238,17 +547,17 @@ void setLogLevelCallback(redisAsyncContext *c, void *r, void *privdata) {
     
     if (reply == NULL) {
         if (c->errstr) {
-            LOG_ERROR("errstr: %n", c->errstr);
+            LOG_ERROR("errstr: %s", c->errstr);
             redisAsyncDisconnect(c);
         }
         return;
     }
     
-    LOG_DETAILS("sub reply type: %d", reply->type);
-    LOG_DETAILS("sub reply element count: %d", reply->elements);
+    LOGM_DETAILS(LOG_MODULE_REDIS, "sub reply type: %d", reply->type);
+    LOGM_DETAILS(LOG_MODULE_REDIS, "sub reply element count: %d", reply->elements);
 
     for(size_t i = 0; i < reply->elements; i++) {
-        LOG_DETAILS("sub reply element %d: %s", i, reply->element[i]->str);
+        LOGM_DETAILS_RL(LOG_MODULE_REDIS, CARGADOR_LOG_RATE, "sub reply element %d: %s", i, reply->element[i]->str);
     }
 
     if(3 == reply->elements && reply->element[1] && reply->element[1]->str && reply->element[2] && reply->element[2]->str) { 
@@ -261,126 +570,1885 @@ void setLogLevelCallback(redisAsyncContext *c, void *r, void *privdata) {
 }
 
 /*
- * Send the command to controller and receive feedback
- * internal check the idx range to ensure no out of
- * bound message is sent to controller
+ * setRefreshCallback switches the force refresh mode,
+ * any value other than "0" sends every command even when
+ * the shadow shows the PIN in the requested state
  * 
  * Parameters:
- * long idx                 index of output PIN
- * char* v                  "0" means off other values
- *                          means on
+ * redisAsyncContext *c     Connection context to redis
+ * void *r                  Response struct for redis returned values
+ * void *privdata           Controller
  * 
- * Return value:            -1 means failed to send or
- *                          receive. 0 means OK
+ * Return value:
+ * There is no return value
+ */
+void setRefreshCallback(redisAsyncContext *c, void *r, void *privdata) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)privdata;
+    redisReply *reply = r;
+    
+    if (reply == NULL) {
+        if (c->errstr) {
+            LOG_ERROR("errstr: %s", c->errstr);
+            redisAsyncDisconnect(c);
+        }
+        return;
+    }
+    
+    if(3 == reply->elements && reply->element[1] && reply->element[1]->str && reply->element[2] && reply->element[2]->str) { 
+        ctrl->force_refresh = (0 != strcmp("0", reply->element[2]->str));
+        LOG_INFO("Force refresh of %s %s", ctrl->addr, ctrl->force_refresh ? "on" : "off");
+    }
+
+    LOG_DEBUG("Set refresh finished!\n");
+}
+
+/*
+ * Set the coalescing window
  * 
- * Note: when -1 is returned, outer program code need
- * to deal with socket close and reinitialization as
- * this usually caused by socket failure.
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * const char* v            Window in milli seconds
  * 
+ * Return value:
+ * There is no return value
  */
-int sendRecvCommand(unsigned char idx, const char* v) {
-    unsigned char status;
-    if(idx >= MAX_OUTPUT_PIN_COUNT) {
-        LOG_WARNING("Send receive warning, index %d out of bound!", idx);
-        return CARGADOR_SND_RCV_OK;
+void setCoalesceWindow(cargador_ctrl* ctrl, const char* v) {
+    char* end;
+    long window = strtol(v, &end, 10);
+    
+    if(end == v || '\0' != *end || 0 > window) {
+        LOG_WARNING("Ignore invalid coalesce window %s", v);
+        return;
     }
     
-    if(NULL == v) {
-        LOG_WARNING("Send receive warning, index %d received NULL value!", idx);
-        return CARGADOR_SND_RCV_OK;
+    ctrl->coalesce_window = (uint64_t)window * 1000000ULL;
+    LOG_INFO("Coalesce window of %s %ldms", ctrl->addr, window);
+}
+
+/*
+ * setCoalesceCallback changes the coalescing window
+ * 
+ * Parameters:
+ * redisAsyncContext *c     Connection context to redis
+ * void *r                  Response struct for redis returned values
+ * void *privdata           Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void setCoalesceCallback(redisAsyncContext *c, void *r, void *privdata) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)privdata;
+    redisReply *reply = r;
+    
+    if (reply == NULL) {
+        if (c->errstr) {
+            LOG_ERROR("errstr: %s", c->errstr);
+            redisAsyncDisconnect(c);
+        }
+        return;
     }
-        
-    status = (0 != strcmp("0", v) ? 0x00 : 0x20);
     
-    LOG_DETAILS("Send receive index: %d Value: 0x%x", idx, status);
-    status |= (idx & 31);
+    if(3 == reply->elements && reply->element[1] && reply->element[1]->str && reply->element[2] && reply->element[2]->str) { 
+        setCoalesceWindow(ctrl, reply->element[2]->str);
+    }
+
+    LOG_DEBUG("Set coalesce finished!\n");
+}
+
+/*
+ * Start the reconciliation timer with the current period,
+ * stop it when the period is 0
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void startReconcile(cargador_ctrl* ctrl) {
+    struct timeval tv;
+    uint64_t interval;
+    
+    if(NULL == ctrl->reconcile_event) {
+        return;
+    }
     
-    if(0 > to_send(gs_socket, &status, 1, 0)) {
-        LOG_ERROR("Send receive send command to controller failed! Error code: %s", strerror(errno));
-        return CARGADOR_SND_RCV_ERROR;
-    } else if(0 > to_recv(gs_socket, &status, 1, 0)) {
-        LOG_ERROR("Send receive receive result from controller failed! Error code: %s", strerror(errno));
-        return CARGADOR_SND_RCV_ERROR;
+    event_del(ctrl->reconcile_event);
+    if(0 == ctrl->reconcile_period) {
+        LOG_INFO("Drift reconciliation of %s off", ctrl->addr);
+        return;
+    }
+    
+    interval = (uint64_t)ctrl->reconcile_period * 1000000ULL / MAX_OUTPUT_PIN_COUNT;
+    tv.tv_sec = interval / 1000000ULL;
+    tv.tv_usec = interval % 1000000ULL;
+    event_add(ctrl->reconcile_event, &tv);
+    LOG_INFO("Drift reconciliation of %s every %ds", ctrl->addr, ctrl->reconcile_period);
+}
+
+/*
+ * Set the reconciliation period
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * const char* v            Period in seconds, 0 for off
+ * 
+ * Return value:
+ * There is no return value
+ */
+void setReconcilePeriod(cargador_ctrl* ctrl, const char* v) {
+    char* end;
+    long period = strtol(v, &end, 10);
+    
+    if(end == v || '\0' != *end || 0 > period || 86400 < period) {
+        LOG_WARNING("Ignore invalid reconcile period %s", v);
+        return;
+    }
+    
+    ctrl->reconcile_period = (int)period;
+    startReconcile(ctrl);
+}
+
+/*
+ * setReconcileCallback changes the reconciliation period
+ * 
+ * Parameters:
+ * redisAsyncContext *c     Connection context to redis
+ * void *r                  Response struct for redis returned values
+ * void *privdata           Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void setReconcileCallback(redisAsyncContext *c, void *r, void *privdata) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)privdata;
+    redisReply *reply = r;
+    
+    if (reply == NULL) {
+        if (c->errstr) {
+            LOG_ERROR("errstr: %s", c->errstr);
+            redisAsyncDisconnect(c);
+        }
+        return;
+    }
+    
+    if(3 == reply->elements && reply->element[1] && reply->element[1]->str && reply->element[2] && reply->element[2]->str) { 
+        setReconcilePeriod(ctrl, reply->element[2]->str);
+    }
+
+    LOG_DEBUG("Set reconcile finished!\n");
+}
+
+/*
+ * Frame decoder for to_reader, the controller answers
+ * each command with one byte
+ * 
+ * Parameters:
+ * const unsigned char* data    Buffered bytes
+ * size_t len                   Count of buffered bytes
+ * void* arg                    Not used
+ * 
+ * Return value:
+ * 1 when a byte is available, otherwise 0
+ */
+int decodeAck(const unsigned char* data, size_t len, void* arg) {
+    UNUSED(data);
+    UNUSED(arg);
+    
+    return len > 0 ? 1 : 0;
+}
+
+/*
+ * Update the shadow from an acknowledge or status byte,
+ * 0x20 set means the PIN in 0x1F is off
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * unsigned char ack        Byte received from controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void updateShadow(cargador_ctrl* ctrl, unsigned char ack) {
+    uint32_t bit = (uint32_t)1 << (ack & 0x1F);
+    
+    ctrl->shadow_valid |= bit;
+    if(ack & CARGADOR_CMD_OFF) {
+        ctrl->shadow &= ~bit;
+    } else {
+        ctrl->shadow |= bit;
+    }
+}
+
+/*
+ * Check whether the shadow shows a PIN in the state a
+ * command requests, such a command is not sent unless
+ * ctrl->force_refresh is set
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * unsigned char cmd        Command byte
+ * 
+ * Return value:
+ * TRUE when the command can be skipped, otherwise FALSE
+ */
+int shadowMatches(const cargador_ctrl* ctrl, unsigned char cmd) {
+    uint32_t bit = (uint32_t)1 << (cmd & 0x1F);
+    
+    return !ctrl->force_refresh && (ctrl->shadow_valid & bit) && (0 == (ctrl->shadow & bit)) == (0 != (cmd & CARGADOR_CMD_OFF));
+}
+
+/*
+ * Compare the status of a PIN reported by a 0x40 query
+ * with the desired state. A PIN drifted, e.g. after the
+ * controller lost power, gets a pending command that is 
+ * sent by releasePending. PINs with a command queued or
+ * in flight are left alone.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * unsigned char ack        Status byte received from 
+ *                          controller, already applied to
+ *                          the shadow
+ * 
+ * Return value:
+ * There is no return value
+ */
+void checkDrift(cargador_ctrl* ctrl, unsigned char ack) {
+    int pin = ack & 0x1F;
+    uint32_t bit = (uint32_t)1 << pin;
+    
+    if(0 == (ctrl->desired_valid & bit) || 0 != ((ctrl->busy | ctrl->pending) & bit)) {
+        return;
+    }
+    
+    if((0 != (ctrl->desired & bit)) == (0 != (ctrl->shadow & bit))) {
+        return;
+    }
+    
+    ctrl->pending_cmd[pin] = (ctrl->desired & bit) ? pin : (CARGADOR_CMD_OFF | pin);
+    ctrl->pending |= bit;
+    ctrl->drift_corrected++;
+    LOG_WARNING_RL(CARGADOR_LOG_RATE, "Pin %d of %s drifted, correcting with 0x%x", pin, ctrl->addr, ctrl->pending_cmd[pin]);
+}
+
+/*
+ * Set the timer of the oldest command not acknowledged
+ * yet, it expires one round trip timeout after the 
+ * command was written
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void armTimeout(cargador_ctrl* ctrl) {
+    cargador_inflight* head;
+    struct timeval tv;
+    uint64_t deadline, now;
+    
+    if(ctrl->inflight_head == ctrl->inflight_tail || NULL == ctrl->timeout_event) {
+        return;
     }
-    else {
-        LOG_DETAILS("Send receive received: 0x%x", status);
+    
+    head = &ctrl->inflight[ctrl->inflight_head & (CARGADOR_INFLIGHT_SIZE - 1)];
+    deadline = head->sent + ctrl->rtt.timeout * 1000;
+    now = stats_now();
+    if(deadline < now) {
+        deadline = now;
+    }
+    
+    tv.tv_sec = (deadline - now) / 1000000000ULL;
+    tv.tv_usec = ((deadline - now) % 1000000000ULL) / 1000;
+    event_add(ctrl->timeout_event, &tv);
+}
+
+/*
+ * Write queued commands to the non-blocking controller
+ * socket. Each command written is moved to the in-flight
+ * ring until its acknowledge arrives. When the socket
+ * buffer is full the write event continues later, when 
+ * the in-flight ring is full the next acknowledge does.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:            -1 means failed to send. 
+ *                          0 means OK
+ */
+int flushCommands(cargador_ctrl* ctrl) {
+    cargador_inflight* entry;
+    ssize_t sent;
+    uint64_t now;
+    size_t space;
+    
+    while(0 < ctrl->queue_len) {
+        space = CARGADOR_INFLIGHT_SIZE - (ctrl->inflight_tail - ctrl->inflight_head);
+        if(0 == space) {
+            return CARGADOR_SND_RCV_OK;
+        }
+        
+        sent = to_send(ctrl->socket, ctrl->queue, ctrl->queue_len < space ? ctrl->queue_len : space, 0);
+        if(0 > sent) {
+            if(EINTR == errno) {
+                continue;
+            }
+            
+            if(EAGAIN == errno || EWOULDBLOCK == errno) {
+                event_add(ctrl->write_event, NULL);
+                return CARGADOR_SND_RCV_OK;
+            }
+            
+            LOG_ERROR("Send command to controller %s failed! Error code: %s", ctrl->addr, strerror(errno));
+            return CARGADOR_SND_RCV_ERROR;
+        }
+        
+        now = stats_now();
+        for(ssize_t i = 0; i < sent; i++) {
+            entry = &ctrl->inflight[ctrl->inflight_tail & (CARGADOR_INFLIGHT_SIZE - 1)];
+            // acks of commands written behind others also wait 
+            // for those, only a command sent alone is sampled
+            entry->sample = (ctrl->inflight_head == ctrl->inflight_tail);
+            entry->cmd = ctrl->queue[i];
+            entry->acked = FALSE;
+            entry->sent = now;
+            ctrl->inflight_tail++;
+            
+            if(0 == (ctrl->queue[i] & CARGADOR_CMD_QUERY)) {
+                ctrl->commands_sent++;
+            }
+        }
+        
+        ctrl->queue_len -= sent;
+        memmove(ctrl->queue, ctrl->queue + sent, ctrl->queue_len);
+        
+        if(!evtimer_pending(ctrl->timeout_event, NULL)) {
+            armTimeout(ctrl);
+        }
+    }
+    
+    return CARGADOR_SND_RCV_OK;
+}
+
+/*
+ * Defined below, called when the controller connection
+ * failed or the controller sent its slot on a new 
+ * connection
+ */
+void controllerLost(cargador_ctrl* ctrl);
+int controllerReady(cargador_ctrl* ctrl, int slot);
+
+/*
+ * Append command bytes to the outbound queue and write as
+ * many of them as the socket accepts without blocking.
+ * Acknowledges are handled by readCallback.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl          Controller
+ * const unsigned char* status  Command bytes
+ * int count                    Count of commands
+ * 
+ * Return value:            -1 means the queue is full or 
+ *                          sending failed. 0 means OK
+ * 
+ * Note: when -1 is returned, outer program code need
+ * to deal with socket close and reinitialization as
+ * this usually caused by socket failure.
+ * 
+ */
+int queueCommands(cargador_ctrl* ctrl, const unsigned char* status, int count) {
+    if(0 == count) {
+        return CARGADOR_SND_RCV_OK;
+    }
+    
+    if(NULL == ctrl->read_event) {
+        LOG_ERROR("Controller %s not connected!", ctrl->addr);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    if((size_t)count > CARGADOR_QUEUE_SIZE - ctrl->queue_len) {
+        LOG_ERROR("Command queue of %s full, %zu commands waiting!", ctrl->addr, ctrl->queue_len);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    memcpy(ctrl->queue + ctrl->queue_len, status, count);
+    ctrl->queue_len += count;
+    
+    return flushCommands(ctrl);
+}
+
+/*
+ * Send the pending commands of PINs without command in
+ * flight whose coalescing window passed. The timer is set
+ * for the next window to pass. A pending command matching
+ * the shadow is dropped.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:            -1 means failed to send. 
+ *                          0 means OK
+ */
+int releasePending(cargador_ctrl* ctrl) {
+    unsigned char batch[MAX_OUTPUT_PIN_COUNT];
+    uint64_t now = stats_now();
+    uint64_t wait = 0, left;
+    struct timeval tv;
+    uint32_t bit;
+    int count = 0;
+    
+    for(int pin = 0; pin < MAX_OUTPUT_PIN_COUNT; pin++) {
+        bit = (uint32_t)1 << pin;
+        if(0 == (ctrl->pending & bit) || 0 != (ctrl->busy & bit)) {
+            continue;
+        }
+        
+        if(now - ctrl->last_sent[pin] < ctrl->coalesce_window) {
+            left = ctrl->coalesce_window - (now - ctrl->last_sent[pin]);
+            if(0 == wait || left < wait) {
+                wait = left;
+            }
+            continue;
+        }
+        
+        ctrl->pending &= ~bit;
+        if(shadowMatches(ctrl, ctrl->pending_cmd[pin])) {
+            LOGM_DETAILS_RL(LOG_MODULE_PROTOCOL, CARGADOR_LOG_RATE, "Pending index: %d already 0x%x", pin, ctrl->pending_cmd[pin] & CARGADOR_CMD_OFF);
+            ctrl->commands_suppressed++;
+            continue;
+        }
+        
+        ctrl->busy |= bit;
+        ctrl->last_sent[pin] = now;
+        batch[count++] = ctrl->pending_cmd[pin];
+    }
+    
+    if(0 < wait && NULL != ctrl->coalesce_event) {
+        tv.tv_sec = wait / 1000000000ULL;
+        tv.tv_usec = (wait % 1000000000ULL) / 1000 + 1;
+        event_add(ctrl->coalesce_event, &tv);
+    }
+    
+    return queueCommands(ctrl, batch, count);
+}
+
+/*
+ * Coalescing stage in front of the outbound queue. A 
+ * command for a PIN with a command in flight, or switched
+ * within the coalescing window, replaces the pending 
+ * command of the PIN and is sent by releasePending. Other
+ * commands are queued right away, so an isolated command
+ * is not delayed. Commands for a controller not connected
+ * are dropped, the PINs are replayed when it is connected
+ * again.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl          Controller
+ * const unsigned char* status  Command bytes, one per PIN
+ * int count                    Count of commands
+ * 
+ * Return value:            -1 means failed to send. 
+ *                          0 means OK
+ */
+int submitCommands(cargador_ctrl* ctrl, const unsigned char* status, int count) {
+    unsigned char batch[MAX_OUTPUT_PIN_COUNT];
+    uint64_t now = stats_now();
+    uint32_t bit;
+    int pin, batched = 0;
+    
+    if(!CTRL_READY(ctrl)) {
+        return CARGADOR_SND_RCV_OK;
+    }
+    
+    for(int i = 0; i < count && batched < MAX_OUTPUT_PIN_COUNT; i++) {
+        pin = status[i] & 0x1F;
+        bit = (uint32_t)1 << pin;
+        
+        if(ctrl->pending & bit) {
+            LOGM_DETAILS_RL(LOG_MODULE_PROTOCOL, CARGADOR_LOG_RATE, "Coalesced index: %d 0x%x", pin, ctrl->pending_cmd[pin]);
+            ctrl->commands_coalesced++;
+        }
+        
+        if((ctrl->busy & bit) || now - ctrl->last_sent[pin] < ctrl->coalesce_window) {
+            ctrl->pending |= bit;
+            ctrl->pending_cmd[pin] = status[i];
+            continue;
+        }
+        
+        ctrl->pending &= ~bit;
+        ctrl->busy |= bit;
+        ctrl->last_sent[pin] = now;
+        batch[batched++] = status[i];
+    }
+    
+    if(CARGADOR_SND_RCV_OK != queueCommands(ctrl, batch, batched)) {
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    // start the timer of PINs waiting for their window only
+    if(0 != (ctrl->pending & ~ctrl->busy)) {
+        return releasePending(ctrl);
+    }
+    
+    return CARGADOR_SND_RCV_OK;
+}
+
+/*
+ * Timer of the next coalescing window to pass
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void coalesceCallback(evutil_socket_t fd, short events, void *arg) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)arg;
+    
+    UNUSED(fd);
+    UNUSED(events);
+    
+    if(CARGADOR_SND_RCV_OK != releasePending(ctrl)) {
+        controllerLost(ctrl);
+    }
+}
+
+/*
+ * Reconciliation timer, queries the next PIN with a 
+ * desired state. The tick is skipped while commands are
+ * queued or in flight.
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void reconcileCallback(evutil_socket_t fd, short events, void *arg) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)arg;
+    unsigned char status;
+    uint32_t bit;
+    int pin;
+    
+    UNUSED(fd);
+    UNUSED(events);
+    
+    if(!CTRL_READY(ctrl) || 0 != ctrl->queue_len || ctrl->inflight_head != ctrl->inflight_tail) {
+        return;
+    }
+    
+    for(int i = 0; i < MAX_OUTPUT_PIN_COUNT; i++) {
+        pin = ctrl->reconcile_pin;
+        ctrl->reconcile_pin = (ctrl->reconcile_pin + 1) % MAX_OUTPUT_PIN_COUNT;
+        bit = (uint32_t)1 << pin;
+        
+        if(0 == (ctrl->desired_valid & bit) || 0 != ((ctrl->busy | ctrl->pending) & bit)) {
+            continue;
+        }
+        
+        LOGM_DETAILS_RL(LOG_MODULE_PROTOCOL, CARGADOR_LOG_RATE, "Reconcile query %s index: %d", ctrl->addr, pin);
+        status = CARGADOR_CMD_QUERY | pin;
+        if(CARGADOR_SND_RCV_OK != queueCommands(ctrl, &status, 1)) {
+            controllerLost(ctrl);
+        }
+        return;
+    }
+}
+
+/*
+ * Remove acknowledged commands from the head of the 
+ * in-flight ring
+ */
+void popAcked(cargador_ctrl* ctrl) {
+    while(ctrl->inflight_head != ctrl->inflight_tail && ctrl->inflight[ctrl->inflight_head & (CARGADOR_INFLIGHT_SIZE - 1)].acked) {
+        ctrl->inflight_head++;
+    }
+}
+
+/*
+ * Match an acknowledge to the oldest command in flight
+ * for the same PIN. The controller echoes the PIN index 
+ * in the low 5 bits, so acknowledges are matched by index
+ * and not by order.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * unsigned char ack        Byte received from controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void ackReceived(cargador_ctrl* ctrl, unsigned char ack) {
+    cargador_inflight* entry = NULL;
+    uint64_t elapsed;
+    unsigned int i;
+    
+    for(i = ctrl->inflight_head; i != ctrl->inflight_tail; i++) {
+        entry = &ctrl->inflight[i & (CARGADOR_INFLIGHT_SIZE - 1)];
+        if(!entry->acked && (entry->cmd & 0x1F) == (ack & 0x1F)) {
+            break;
+        }
+    }
+    
+    if(i == ctrl->inflight_tail) {
+        // late answer of a command that timed out before
+        LOG_WARNING_RL(CARGADOR_LOG_RATE, "Dropped unexpected ack 0x%x of %s", ack, ctrl->addr);
+        return;
+    }
+    
+    elapsed = stats_now() - entry->sent;
+    if((CARGADOR_CMD_QUERY | CARGADOR_HEARTBEAT_PIN) == entry->cmd) {
+        LOGM_DETAILS_RL(LOG_MODULE_PROTOCOL, CARGADOR_LOG_RATE, "Heartbeat received: 0x%x", ack);
+        ctrl->probe = CARGADOR_PROBE_IDLE;
+    } else {
+        LOGM_DETAILS_RL(LOG_MODULE_PROTOCOL, CARGADOR_LOG_RATE, "Received: 0x%x", ack);
+        stats_record(&ctrl->send_recv_stats, elapsed);
+        ctrl->busy &= ~((uint32_t)1 << (entry->cmd & 0x1F));
+        to_heartbeat_alive(&ctrl->heartbeat);
+    }
+    
+    if(entry->sample) {
+        to_rtt_sample(&ctrl->rtt, elapsed / 1000);
+    }
+    
+    updateShadow(ctrl, ack);
+    if(entry->cmd & CARGADOR_CMD_QUERY) {
+        checkDrift(ctrl, ack);
+    }
+    entry->acked = TRUE;
+    
+    popAcked(ctrl);
+}
+
+/*
+ * Read event of the controller socket, handles all 
+ * acknowledges received, releases the pending commands
+ * of the acknowledged PINs and writes the commands 
+ * waiting for room in the in-flight ring. The first byte
+ * of a new connection is the slot index.
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void readCallback(evutil_socket_t fd, short events, void *arg) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)arg;
+    const unsigned char* ack;
+    int ret;
+    
+    UNUSED(fd);
+    UNUSED(events);
+    
+    while(0 < (ret = to_reader_next(&ctrl->reader, &ack))) {
+        if(0 <= ctrl->slot) {
+            ackReceived(ctrl, *ack);
+            continue;
+        }
+        
+        ret = controllerReady(ctrl, *ack);
+        if(CARGADOR_REDIS_ERROR == ret) {
+            redisAsyncDisconnect(gs_async_context);
+            return;
+        }
+        
+        if(CARGADOR_SND_RCV_OK != ret) {
+            controllerLost(ctrl);
+            return;
+        }
+    }
+    
+    if(TO_SOCKET_ERROR_TIMEOUT != ret) {
+        LOG_ERROR("Receive result from controller %s failed! Error code: %d", ctrl->addr, ret);
+        controllerLost(ctrl);
+        return;
+    }
+    
+    // the slot timer is kept until the slot arrived
+    if(0 > ctrl->slot) {
+        return;
+    }
+    
+    if(CARGADOR_SND_RCV_OK != releasePending(ctrl) || CARGADOR_SND_RCV_OK != flushCommands(ctrl)) {
+        controllerLost(ctrl);
+        return;
+    }
+    
+    if(ctrl->inflight_head == ctrl->inflight_tail) {
+        evtimer_del(ctrl->timeout_event);
+    } else {
+        armTimeout(ctrl);
+    }
+}
+
+/*
+ * Write event of the controller socket, added when the
+ * socket buffer was full
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void writeCallback(evutil_socket_t fd, short events, void *arg) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)arg;
+    
+    UNUSED(fd);
+    UNUSED(events);
+    
+    if(CARGADOR_SND_RCV_OK != flushCommands(ctrl)) {
+        controllerLost(ctrl);
+    }
+}
+
+/*
+ * Timer of the oldest command in flight. A heartbeat 
+ * query not answered in time is dropped and counted as 
+ * missed by the next probe, any other command not 
+ * answered in time fails the connection. On a new 
+ * connection it is the timer of the slot index.
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void timeoutCallback(evutil_socket_t fd, short events, void *arg) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)arg;
+    cargador_inflight* head;
+    
+    UNUSED(fd);
+    UNUSED(events);
+    
+    if(0 > ctrl->slot) {
+        LOG_ERROR("Controller %s did not send its slot in %lluus!", ctrl->addr, (unsigned long long)ctrl->rtt.timeout);
+        to_rtt_backoff(&ctrl->rtt);
+        controllerLost(ctrl);
+        return;
+    }
+    
+    if(ctrl->inflight_head == ctrl->inflight_tail) {
+        return;
+    }
+    
+    head = &ctrl->inflight[ctrl->inflight_head & (CARGADOR_INFLIGHT_SIZE - 1)];
+    if(stats_now() < head->sent + ctrl->rtt.timeout * 1000) {
+        armTimeout(ctrl);
+        return;
+    }
+    
+    to_rtt_backoff(&ctrl->rtt);
+    
+    if((CARGADOR_CMD_QUERY | CARGADOR_HEARTBEAT_PIN) == head->cmd) {
+        LOG_WARNING("Heartbeat of %s not answered in %lluus", ctrl->addr, (unsigned long long)ctrl->rtt.timeout);
+        ctrl->probe = CARGADOR_PROBE_MISSED;
+        head->acked = TRUE;
+        popAcked(ctrl);
+        armTimeout(ctrl);
+        return;
+    }
+    
+    LOG_ERROR("Command 0x%x not acknowledged by controller %s!", head->cmd, ctrl->addr);
+    controllerLost(ctrl);
+}
+
+/*
+ * Remove the events of the controller socket
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void detachController(cargador_ctrl* ctrl) {
+    if(NULL != ctrl->read_event) {
+        event_free(ctrl->read_event);
+        ctrl->read_event = NULL;
+    }
+    
+    if(NULL != ctrl->write_event) {
+        event_free(ctrl->write_event);
+        ctrl->write_event = NULL;
+    }
+    
+    if(NULL != ctrl->timeout_event) {
+        event_free(ctrl->timeout_event);
+        ctrl->timeout_event = NULL;
+    }
+    
+    if(NULL != ctrl->coalesce_event) {
+        event_free(ctrl->coalesce_event);
+        ctrl->coalesce_event = NULL;
+    }
+}
+
+/*
+ * Switch the controller socket to non-blocking mode and
+ * add its read, write and timeout events to gs_base. The
+ * in-flight ring is cleared, queued commands are kept.
+ * When the slot is not known yet, the timeout event waits
+ * for it.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:            -1 means failed. 0 means OK
+ */
+int attachController(cargador_ctrl* ctrl) {
+    struct timeval tv;
+    
+    detachController(ctrl);
+    ctrl->inflight_head = ctrl->inflight_tail = 0;
+    ctrl->probe = CARGADOR_PROBE_IDLE;
+    
+    if(TO_SOCKET_OK != to_set_nonblock(ctrl->socket, 1)) {
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    to_reader_init(&ctrl->reader, ctrl->socket, decodeAck, NULL);
+    
+    ctrl->read_event = event_new(gs_base, ctrl->socket, EV_READ | EV_PERSIST, readCallback, ctrl);
+    ctrl->write_event = event_new(gs_base, ctrl->socket, EV_WRITE, writeCallback, ctrl);
+    ctrl->timeout_event = evtimer_new(gs_base, timeoutCallback, ctrl);
+    ctrl->coalesce_event = evtimer_new(gs_base, coalesceCallback, ctrl);
+    if(NULL == ctrl->read_event || NULL == ctrl->write_event || NULL == ctrl->timeout_event || NULL == ctrl->coalesce_event || 0 != event_add(ctrl->read_event, NULL)) {
+        LOG_ERROR("Failed to add events of controller %s!", ctrl->addr);
+        detachController(ctrl);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    if(0 > ctrl->slot) {
+        to_rtt_timeval(&ctrl->rtt, &tv);
+        event_add(ctrl->timeout_event, &tv);
+    }
+    
+    return CARGADOR_SND_RCV_OK;
+}
+
+/*
+ * Replace the failed active controller connection with
+ * the standby connection. Commands not acknowledged are
+ * sent again before the queued ones, setting a PIN is 
+ * idempotent.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:            -1 means no standby is ready
+ *                          or it failed. 0 means OK
+ */
+int switchToStandby(cargador_ctrl* ctrl) {
+    unsigned char retry[CARGADOR_INFLIGHT_SIZE];
+    size_t count = 0;
+    int slot = ctrl->standby.slot;
+    to_socket_ctx socket = to_standby_takeover(&ctrl->standby);
+    if(0 > socket) {
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    for(unsigned int i = ctrl->inflight_head; i != ctrl->inflight_tail; i++) {
+        cargador_inflight* entry = &ctrl->inflight[i & (CARGADOR_INFLIGHT_SIZE - 1)];
+        if(!entry->acked && 0 == (entry->cmd & CARGADOR_CMD_QUERY)) {
+            retry[count++] = entry->cmd;
+        }
+    }
+    
+    if(count > CARGADOR_QUEUE_SIZE - ctrl->queue_len) {
+        LOG_ERROR("Command queue of %s full, %zu commands waiting!", ctrl->addr, ctrl->queue_len);
+        to_close(socket);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    memmove(ctrl->queue + count, ctrl->queue, ctrl->queue_len);
+    memcpy(ctrl->queue, retry, count);
+    ctrl->queue_len += count;
+    
+    detachController(ctrl);
+    to_close(ctrl->socket);
+    ctrl->socket = socket;
+    ctrl->slot = slot;
+    
+    if(CARGADOR_SND_RCV_OK != attachController(ctrl)) {
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    LOG_WARNING("Retry %zu commands on standby connection to %s", count, ctrl->addr);
+    if(CARGADOR_SND_RCV_OK != flushCommands(ctrl)) {
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    // the coalescing timer was removed with the old events
+    return releasePending(ctrl);
+}
+
+/*
+ * FNV-1a hash of a topic name
+ */
+uint32_t hashTopic(const char* topic) {
+    uint32_t hash = 2166136261u;
+    
+    while(*topic) {
+        hash ^= (unsigned char)*topic++;
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+/*
+ * Clear a routing table
+ */
+void initRoutes(cargador_routes* t) {
+    t->count = 0;
+    t->inverted = 0;
+    t->names_used = 0;
+    memset(t->index, -1, sizeof(t->index));
+}
+
+/*
+ * Find the route of a topic
+ * 
+ * Parameters:
+ * const cargador_routes* t Routing table
+ * const char* topic        Topic name
+ * 
+ * Return value:            Index of the route, -1 when the
+ *                          topic has no route
+ */
+int findRoute(const cargador_routes* t, const char* topic) {
+    uint32_t hash = hashTopic(topic);
+    unsigned int slot;
+    int idx;
+    
+    for(slot = hash & (CARGADOR_ROUTE_SLOTS - 1); 0 <= (idx = t->index[slot]); slot = (slot + 1) & (CARGADOR_ROUTE_SLOTS - 1)) {
+        if(t->routes[idx].hash == hash && 0 == strcmp(ROUTE_TOPIC(t, idx), topic)) {
+            return idx;
+        }
+    }
+    
+    return -1;
+}
+
+/*
+ * Add a PIN to the route of a topic, the route is created
+ * for the first PIN of the topic
+ * 
+ * Parameters:
+ * cargador_routes* t       Routing table
+ * const char* topic        Topic name from PIN configuration,
+ *                          may start with CARGADOR_INVERT_PREFIX
+ * int pin                  PIN index
+ * 
+ * Return value:
+ * There is no return value
+ */
+void addRoute(cargador_routes* t, const char* topic, int pin) {
+    uint32_t bit = (uint32_t)1 << pin;
+    unsigned int slot;
+    size_t len;
+    int inverted = FALSE;
+    int idx;
+    
+    if(CARGADOR_INVERT_PREFIX == *topic) {
+        inverted = TRUE;
+        topic++;
+    }
+    
+    if('\0' == *topic) {
+        LOG_WARNING("Ignore empty topic of pin %d", pin);
+        return;
+    }
+    
+    idx = findRoute(t, topic);
+    if(0 > idx) {
+        len = strlen(topic) + 1;
+        if(len > CARGADOR_TOPIC_BUFFER_SIZE - t->names_used) {
+            LOG_WARNING("Topic buffer full, ignore pin %d %s", pin, topic);
+            return;
+        }
+        
+        idx = t->count++;
+        memcpy(t->names + t->names_used, topic, len);
+        t->routes[idx].topic = t->names_used;
+        t->routes[idx].hash = hashTopic(topic);
+        t->routes[idx].pins = 0;
+        t->names_used += len;
+        
+        for(slot = t->routes[idx].hash & (CARGADOR_ROUTE_SLOTS - 1); 0 <= t->index[slot]; slot = (slot + 1) & (CARGADOR_ROUTE_SLOTS - 1));
+        t->index[slot] = (signed char)idx;
+    }
+    
+    t->routes[idx].pins |= bit;
+    if(inverted) {
+        t->inverted |= bit;
+    }
+}
+
+/*
+ * Build a routing table from the HGETALL reply of the PIN
+ * configuration, fields are PIN indexes and values topics
+ * 
+ * Parameters:
+ * cargador_routes* t       Routing table to build
+ * const redisReply* config HGETALL reply
+ * 
+ * Return value:
+ * There is no return value
+ */
+void loadRoutes(cargador_routes* t, const redisReply* config) {
+    char* end;
+    long pin;
+    
+    initRoutes(t);
+    
+    // HGETALL returns field and value pairs
+    for(size_t i = 0; i + 1 < config->elements; i += 2) {
+        if(NULL == config->element[i]->str || NULL == config->element[i + 1]->str) {
+            continue;
+        }
+        
+        pin = strtol(config->element[i]->str, &end, 10);
+        if(end == config->element[i]->str || '\0' != *end || 0 > pin || MAX_OUTPUT_PIN_COUNT <= pin) {
+            LOG_WARNING("Ignore invalid pin %s", config->element[i]->str);
+            continue;
+        }
+        
+        LOG_DETAILS("Pin %ld: %s", pin, config->element[i + 1]->str);
+        addRoute(t, config->element[i + 1]->str, (int)pin);
+    }
+    
+    LOG_INFO("Loaded %d topics", t->count);
+}
+
+/*
+ * Append the command of every PIN in a mask to a burst.
+ * PINs already in the requested state are skipped. While
+ * the controller is not connected only the desired state
+ * is kept and the PINs are marked dirty.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * uint32_t pins            Mask of PINs
+ * char* v                  "0" means off other values
+ *                          means on, reversed for PINs with
+ *                          inverted polarity
+ * unsigned char* status    Commands of the burst, room for
+ *                          MAX_OUTPUT_PIN_COUNT commands
+ * int count                Count of commands in status
+ * 
+ * Return value:            New count of commands in status
+ */
+int addCommands(cargador_ctrl* ctrl, uint32_t pins, const char* v, unsigned char* status, int count) {
+    unsigned char off;
+    uint32_t bit;
+    int on;
+    
+    // a topic without value is loaded but has no state
+    ctrl->loaded |= pins;
+    if(NULL == v) {
+        LOG_WARNING("Send receive warning, pins 0x%x of %s received NULL value!", pins, ctrl->addr);
+        return count;
+    }
+        
+    on = (0 != strcmp("0", v));
+    
+    for(int pin = 0; pin < MAX_OUTPUT_PIN_COUNT && count < MAX_OUTPUT_PIN_COUNT; pin++) {
+        bit = (uint32_t)1 << pin;
+        if(0 == (pins & bit)) {
+            continue;
+        }
+        
+        off = ((0 != (ctrl->routes.inverted & bit)) == on) ? CARGADOR_CMD_OFF : 0x00;
+        ctrl->desired_valid |= bit;
+        if(off) {
+            ctrl->desired &= ~bit;
+        } else {
+            ctrl->desired |= bit;
+        }
+        
+        if(!CTRL_READY(ctrl)) {
+            ctrl->dirty |= bit;
+            continue;
+        }
+        
+        // the shadow is behind while a command is in flight
+        if(0 == ((ctrl->busy | ctrl->pending) & bit) && shadowMatches(ctrl, off | pin)) {
+            LOGM_DETAILS_RL(LOG_MODULE_PROTOCOL, CARGADOR_LOG_RATE, "Send receive index: %d already 0x%x", pin, off);
+            ctrl->commands_suppressed++;
+            continue;
+        }
+        
+        LOGM_DETAILS_RL(LOG_MODULE_PROTOCOL, CARGADOR_LOG_RATE, "Send receive index: %d Value: 0x%x", pin, off);
+        status[count++] = off | pin;
+    }
+    
+    return count;
+}
+
+/*
+ * Queue the command of every PIN depending on the same
+ * topic, they are written to controller in one burst
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * uint32_t pins            Mask of PINs of the topic
+ * char* v                  "0" means off other values
+ *                          means on
+ * 
+ * Return value:            -1 means failed to send. 
+ *                          0 means OK
+ */
+int queueCommand(cargador_ctrl* ctrl, uint32_t pins, const char* v) {
+    unsigned char status[MAX_OUTPUT_PIN_COUNT];
+    
+    return submitCommands(ctrl, status, addCommands(ctrl, pins, v, status, 0));
+}
+
+/*
+ * Fetch the current values of all topics of the routes
+ * of a controller with one MGET and queue the commands of
+ * all PINs to the controller in one burst
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl          Controller
+ * redisContext* sync_context   Sync redis connection in DB 1
+ * 
+ * Return value:            -2 means redis failed, -1 means
+ *                          failed to send. 0 means OK
+ */
+int syncRoutes(cargador_ctrl* ctrl, redisContext* sync_context) {
+    const char* argv[MAX_OUTPUT_PIN_COUNT + 1];
+    unsigned char status[MAX_OUTPUT_PIN_COUNT];
+    redisReply* values;
+    int count = 0;
+    
+    // PINs removed from the configuration are not reconciled
+    ctrl->desired_valid = 0;
+    ctrl->loaded = 0;
+    ctrl->dirty = 0;
+    
+    if(0 == ctrl->routes.count) {
+        return CARGADOR_SND_RCV_OK;
+    }
+    
+    argv[0] = "MGET";
+    for(int i = 0; i < ctrl->routes.count; i++) {
+        argv[i + 1] = ROUTE_TOPIC(&ctrl->routes, i);
+    }
+    
+    LOG_DETAILS("MGET %d topics of %s", ctrl->routes.count, ctrl->addr);
+    values = redisCommandArgv(sync_context, ctrl->routes.count + 1, argv, NULL);
+    if(NULL == values) {
+        LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);
+        return CARGADOR_REDIS_ERROR;
+    }
+    
+    if(REDIS_REPLY_ARRAY != values->type || (size_t)ctrl->routes.count != values->elements) {
+        LOG_ERROR("Unexpected MGET reply type %d", values->type);
+        freeReplyObject(values);
+        return CARGADOR_REDIS_ERROR;
+    }
+    
+    for(int i = 0; i < ctrl->routes.count; i++) {
+        LOG_DETAILS("GET %s: %s", ROUTE_TOPIC(&ctrl->routes, i), values->element[i]->str);
+        count = addCommands(ctrl, ctrl->routes.routes[i].pins, values->element[i]->str, status, count);
+    }
+    freeReplyObject(values);
+    
+    if(CARGADOR_SND_RCV_OK != submitCommands(ctrl, status, count)) {
+        LOG_ERROR("Error updating status of controller %s", ctrl->addr);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    return CARGADOR_SND_RCV_OK;
+}
+
+/*
+ * Mask of all PINs with a topic
+ * 
+ * Parameters:
+ * const cargador_routes* t Routing table
+ * 
+ * Return value:            Bit n is set when PIN n has a
+ *                          topic
+ */
+uint32_t routedPins(const cargador_routes* t) {
+    uint32_t pins = 0;
+    
+    for(int i = 0; i < t->count; i++) {
+        pins |= t->routes[i].pins;
+    }
+    
+    return pins;
+}
+
+/*
+ * Bring a reconnected controller up to date without 
+ * reading redis. Dirty PINs are switched to their desired
+ * state, all other PINs with a desired state are queried
+ * with 0x40 right behind them and corrected by checkDrift
+ * when they do not match, so the controller is up to date
+ * after one round trip.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:            -1 means failed to send. 
+ *                          0 means OK
+ */
+int replayDirty(cargador_ctrl* ctrl) {
+    unsigned char status[MAX_OUTPUT_PIN_COUNT];
+    unsigned char query[MAX_OUTPUT_PIN_COUNT];
+    int count = 0, queries = 0;
+    uint32_t bit;
+    
+    for(int pin = 0; pin < MAX_OUTPUT_PIN_COUNT; pin++) {
+        bit = (uint32_t)1 << pin;
+        if(0 == (ctrl->desired_valid & bit)) {
+            continue;
+        }
+        
+        if(ctrl->dirty & bit) {
+            status[count++] = (ctrl->desired & bit) ? pin : (CARGADOR_CMD_OFF | pin);
+        } else {
+            query[queries++] = CARGADOR_CMD_QUERY | pin;
+        }
+    }
+    
+    LOG_INFO("Replay %d pins of %s, verify %d pins", count, ctrl->addr, queries);
+    ctrl->dirty = 0;
+    ctrl->pins_replayed += count;
+    
+    if(CARGADOR_SND_RCV_OK != submitCommands(ctrl, status, count) || CARGADOR_SND_RCV_OK != queueCommands(ctrl, query, queries)) {
+        LOG_ERROR("Error updating status of controller %s", ctrl->addr);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    return CARGADOR_SND_RCV_OK;
+}
+
+/*
+ * Heartbeat probe, queries the status of a spare PIN. The
+ * answer is handled by readCallback, a probe still not 
+ * answered or dropped by timeoutCallback counts as missed.
+ * 
+ * Parameters:
+ * void* arg                Controller
+ * 
+ * Return value:
+ * TO_SOCKET_OK when the previous probe was answered, 
+ * TO_SOCKET_ERROR_TIMEOUT when it was not or 
+ * TO_SOCKET_ERROR_SEND
+ */
+int probeController(void* arg) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)arg;
+    unsigned char status = CARGADOR_CMD_QUERY | CARGADOR_HEARTBEAT_PIN;
+    int ret = TO_SOCKET_OK;
+    
+    if(CARGADOR_PROBE_SENT == ctrl->probe) {
+        return TO_SOCKET_ERROR_TIMEOUT;
+    }
+    
+    if(CARGADOR_PROBE_MISSED == ctrl->probe) {
+        ret = TO_SOCKET_ERROR_TIMEOUT;
+    }
+    
+    ctrl->probe = CARGADOR_PROBE_SENT;
+    if(CARGADOR_SND_RCV_OK != queueCommands(ctrl, &status, 1)) {
+        LOG_ERROR("Heartbeat send to %s failed!", ctrl->addr);
+        return TO_SOCKET_ERROR_SEND;
+    }
+    
+    return ret;
+}
+
+/*
+ * Close the failed connection of a controller. Queued 
+ * commands and commands in flight are dropped, the 
+ * desired state of the PINs is kept and PINs with a 
+ * command not acknowledged are marked dirty.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void dropController(cargador_ctrl* ctrl) {
+    detachController(ctrl);
+    to_heartbeat_stop(&ctrl->heartbeat);
+    
+    if(0 <= ctrl->socket) {
+        to_abort(ctrl->socket);
+        ctrl->socket = -1;
+    }
+    
+    ctrl->slot = -1;
+    ctrl->queue_len = 0;
+    ctrl->inflight_head = ctrl->inflight_tail = 0;
+    ctrl->probe = CARGADOR_PROBE_IDLE;
+    ctrl->dirty |= ctrl->busy | ctrl->pending;
+    ctrl->busy = 0;
+    ctrl->pending = 0;
+}
+
+/*
+ * Connect to a controller again after 
+ * CARGADOR_RECONNECT_INTERVAL. The other controllers and
+ * the redis connections are not affected, only when the
+ * timer fails the service restarts.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void scheduleReconnect(cargador_ctrl* ctrl) {
+    struct timeval tv = { CARGADOR_RECONNECT_INTERVAL, 0 };
+    
+    if(NULL == ctrl->reconnect_event || 0 != event_add(ctrl->reconnect_event, &tv)) {
+        LOG_ERROR("Failed to schedule reconnect to controller %s, restarting!", ctrl->addr);
+        redisAsyncDisconnect(gs_async_context);
+    }
+}
+
+/*
+ * Called when the controller did not answer the heartbeat,
+ * switches to the standby connection or, when there is
+ * none, reconnects to the controller
+ * 
+ * Parameters:
+ * void* arg                Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void controllerFailed(void* arg) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)arg;
+    
+    if(CARGADOR_SND_RCV_OK == switchToStandby(ctrl) && TO_SOCKET_OK == to_heartbeat_resume(&ctrl->heartbeat)) {
+        return;
+    }
+    
+    LOG_ERROR("Heartbeat of controller %s failed, reconnecting!", ctrl->addr);
+    dropController(ctrl);
+    scheduleReconnect(ctrl);
+}
+
+/*
+ * Called when a command was not acknowledged or the
+ * controller socket failed, switches to the standby 
+ * connection or, when there is none, reconnects to the
+ * controller
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void controllerLost(cargador_ctrl* ctrl) {
+    if(0 > ctrl->socket) {
+        return;
+    }
+    
+    // a connection without slot has no commands to retry
+    if(0 <= ctrl->slot && CARGADOR_SND_RCV_OK == switchToStandby(ctrl)) {
+        return;
+    }
+    
+    LOG_ERROR("Connection to controller %s failed, reconnecting!", ctrl->addr);
+    dropController(ctrl);
+    scheduleReconnect(ctrl);
+}
+
+/*
+ * After start phase, the cargador will subscribe expected 
+ * message channels to keep the controller's output PIN in
+ * the expected status with value specified in redis.
+ * 
+ * All topics are subscribed with this callback, the routes
+ * of the channel give the controllers and PINs to update. 
+ * A topic may be routed to PINs of several controllers.
+ * 
+ * Parameters:
+ * redisAsyncContext *c     Connection context to redis
+ * void *r                  Response struct for redis returned values
+ *                          3 elements, 1 is "message", second is 
+ *                          the channel, third contains the value.
+ *                          Confirmations of subscribe and 
+ *                          unsubscribe are ignored.
+ * void *privdata           Not used
+ * 
+ * Return value:
+ * There is no return value
+ * 
+ * Note: When send error occures, only the controller 
+ * failed is reconnected, the other controllers are still
+ * updated.
+ * 
+ */
+void subscribeCallback(redisAsyncContext *c, void *r, void *privdata) {
+    redisReply *reply = r;
+    cargador_ctrl* ctrl;
+    int routed = FALSE;
+    int idx;
+    
+    UNUSED(privdata);
+    
+    LOG_DEBUG("Subscribe callback!");
+    if (reply == NULL) {
+        LOG_ERROR("Error empty subscribed response!");
+        if (c->errstr) {
+            LOG_ERROR("Subscribe errstr: %s", c->errstr);
+        }
+        redisAsyncDisconnect(c);
+        return;
+    }
+    
+    LOGM_DETAILS(LOG_MODULE_REDIS, "Subscribe reply type: %d", reply->type);
+    LOGM_DETAILS(LOG_MODULE_REDIS, "Subscribe reply elements: %zd", reply->elements);
+
+    for(size_t i = 0; i < reply->elements; i++) {
+        LOGM_DETAILS_RL(LOG_MODULE_REDIS, CARGADOR_LOG_RATE, "sub reply element %d: %s", i, reply->element[i]->str);
+    }
+
+    if(3 != reply->elements) {
+        LOG_ERROR("Error: Unexpected format!");
+        redisAsyncDisconnect(c);
+        return;
+    }
+    
+    if(NULL == reply->element[0]->str || 0 != strcmp("message", reply->element[0]->str)) {
+        return;
+    }
+    
+    if(NULL == reply->element[1]->str || NULL == reply->element[2]->str) {
+        LOG_WARNING("Error: Empty content!");
+        return;
+    }
+    
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        ctrl = &gs_ctrls[i];
+        idx = findRoute(&ctrl->routes, reply->element[1]->str);
+        if(0 > idx) {
+            continue;
+        }
+        
+        routed = TRUE;
+        if(CARGADOR_SND_RCV_OK != queueCommand(ctrl, ctrl->routes.routes[idx].pins, reply->element[2]->str)) {
+            LOG_ERROR("Error: failed to update status of %s for pins 0x%x, %s", ctrl->addr, ctrl->routes.routes[idx].pins, reply->element[2]->str);
+            controllerLost(ctrl);
+        }
+    }
+    
+    // a message may still arrive for a topic just removed
+    if(!routed) {
+        LOG_WARNING_RL(CARGADOR_LOG_RATE, "No route for topic %s", reply->element[1]->str);
+    }
+
+    LOG_DEBUG("Subscribe finished!");
+}
+
+/*
+ * Check whether a topic is routed to another controller,
+ * the channel is subscribed once for all controllers
+ * 
+ * Parameters:
+ * const cargador_ctrl* ctrl    Controller to skip
+ * const char* topic            Topic name
+ * 
+ * Return value:
+ * TRUE when another controller has a route of the topic,
+ * otherwise FALSE
+ */
+int topicShared(const cargador_ctrl* ctrl, const char* topic) {
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        if(ctrl != &gs_ctrls[i] && 0 <= findRoute(&gs_ctrls[i].routes, topic)) {
+            return TRUE;
+        }
+    }
+    
+    return FALSE;
+}
+
+/*
+ * Subscribe or unsubscribe the topics of all routes of t
+ * that are not routes of other or of another controller
+ * with one command
+ * 
+ * Parameters:
+ * const char* cmd          "SUBSCRIBE" or "UNSUBSCRIBE"
+ * const cargador_ctrl* ctrl    Controller of the routes
+ * const cargador_routes* t Routes to subscribe or unsubscribe
+ * const cargador_routes* other
+ *                          Routes to leave unchanged, may be
+ *                          NULL
+ * 
+ * Return value:
+ * There is no return value
+ */
+void subscribeRoutes(const char* cmd, const cargador_ctrl* ctrl, const cargador_routes* t, const cargador_routes* other) {
+    const char* argv[MAX_OUTPUT_PIN_COUNT + 1];
+    int argc = 1;
+    
+    argv[0] = cmd;
+    for(int i = 0; i < t->count; i++) {
+        if((NULL == other || 0 > findRoute(other, ROUTE_TOPIC(t, i))) && !topicShared(ctrl, ROUTE_TOPIC(t, i))) {
+            argv[argc++] = ROUTE_TOPIC(t, i);
+        }
+    }
+    
+    if(1 < argc) {
+        LOG_INFO("%s %d topics of %s", cmd, argc - 1, ctrl->addr);
+        redisAsyncCommandArgv(gs_async_context, subscribeCallback, NULL, argc, argv, NULL);
+    }
+}
+
+/*
+ * Reload the PIN configuration of a controller, subscribe
+ * the new topics, unsubscribe the removed ones and bring
+ * all PINs into the state of their topic
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl          Controller
+ * redisContext* sync_context   Sync redis connection in DB 1
+ * 
+ * Return value:            -2 means redis failed, -1 means
+ *                          failed to send. 0 means OK
+ */
+int reloadRoutes(cargador_ctrl* ctrl, redisContext* sync_context) {
+    cargador_routes next;
+    redisReply* config = NULL;
+    redisReply* reply = NULL;
+    int ret = CARGADOR_REDIS_ERROR;
+    
+    // PIN configuration is in DB 0
+    redisAppendCommand(sync_context, "SELECT 0");
+    redisAppendCommand(sync_context, "HGETALL %s", ctrl->config_key);
+    redisAppendCommand(sync_context, "SELECT 1");
+    
+    if(REDIS_OK != redisGetReply(sync_context, (void**)&reply)) {
+        goto l_redis_failed;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+    
+    if(REDIS_OK != redisGetReply(sync_context, (void**)&config)) {
+        goto l_redis_failed;
+    }
+    
+    if(REDIS_OK != redisGetReply(sync_context, (void**)&reply)) {
+        goto l_redis_failed;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+    
+    if(REDIS_REPLY_ARRAY != config->type) {
+        LOG_ERROR("Unexpected pin configuration type %d", config->type);
+        goto l_free_config;
+    }
+    
+    loadRoutes(&next, config);
+    subscribeRoutes("UNSUBSCRIBE", ctrl, &ctrl->routes, &next);
+    subscribeRoutes("SUBSCRIBE", ctrl, &next, &ctrl->routes);
+    ctrl->routes = next;
+    
+    ret = syncRoutes(ctrl, sync_context);
+    goto l_free_config;
+    
+l_redis_failed:
+    LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);
+    
+l_free_config:
+    if(NULL != config) {
+        freeReplyObject(config);
+    }
+    
+    return ret;
+}
+
+/*
+ * reloadCallback reloads the PIN configuration when the
+ * reload flag is published or the configuration hash is
+ * changed
+ * 
+ * Parameters:
+ * redisAsyncContext *c     Connection context to redis
+ * void *r                  Response struct for redis returned values
+ * void *privdata           Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void reloadCallback(redisAsyncContext *c, void *r, void *privdata) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)privdata;
+    redisReply *reply = r;
+    int ret;
+    
+    if (reply == NULL) {
+        if (c->errstr) {
+            LOG_ERROR("errstr: %s", c->errstr);
+            redisAsyncDisconnect(c);
+        }
+        return;
+    }
+    
+    if(3 == reply->elements && reply->element[0]->str && 0 == strcmp("message", reply->element[0]->str)) {
+        LOG_INFO("Reloading pin configuration of %s!", ctrl->addr);
+        ret = reloadRoutes(ctrl, gs_sync_context);
+        if(CARGADOR_REDIS_ERROR == ret) {
+            redisAsyncDisconnect(c);
+        } else if(CARGADOR_SND_RCV_OK != ret) {
+            controllerLost(ctrl);
+        }
+    }
+
+    LOG_DEBUG("Reload finished!\n");
+}
+
+/*
+ * Register the slot of the active connection in the slot
+ * registry of the controller and remove the slot 
+ * registered before. Failures are only logged, the 
+ * registry is informational.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl          Controller
+ * redisContext* sync_context   Sync redis connection in DB 1
+ * 
+ * Return value:
+ * There is no return value
+ */
+void updateSlot(cargador_ctrl* ctrl, redisContext* sync_context) {
+    redisReply* reply;
+    
+    if(ctrl->registered_slot == ctrl->slot) {
+        return;
+    }
+    
+    if(0 <= ctrl->registered_slot) {
+        LOGM_DETAILS(LOG_MODULE_REDIS, "HDEL %s %d", ctrl->slot_key, ctrl->registered_slot);
+        reply = redisCommand(sync_context, "HDEL %s %d", ctrl->slot_key, ctrl->registered_slot);
+        if(NULL == reply) {
+            LOG_WARNING("Failed to release slot %d %s", ctrl->registered_slot, sync_context->errstr);
+        } else {
+            freeReplyObject(reply);
+        }
+        ctrl->registered_slot = -1;
+    }
+    
+    if(0 > ctrl->slot) {
+        return;
+    }
+    
+    LOGM_DETAILS(LOG_MODULE_REDIS, "HSET %s %d %s:%d", ctrl->slot_key, ctrl->slot, FLAG_KEY, (int)getpid());
+    reply = redisCommand(sync_context, "HSET %s %d %s:%d", ctrl->slot_key, ctrl->slot, FLAG_KEY, (int)getpid());
+    if(NULL == reply) {
+        LOG_WARNING("Failed to register slot %d %s", ctrl->slot, sync_context->errstr);
+        return;
+    }
+    freeReplyObject(reply);
+    ctrl->registered_slot = ctrl->slot;
+    
+    reply = redisCommand(sync_context, "HLEN %s", ctrl->slot_key);
+    if(NULL != reply) {
+        if(REDIS_REPLY_INTEGER == reply->type && TO_SLOT_COUNT <= reply->integer) {
+            LOG_WARNING("All %d slots of controller %s are registered!", TO_SLOT_COUNT, ctrl->slot_key);
+        }
+        freeReplyObject(reply);
+    }
+}
+
+/*
+ * Called when the controller sent its slot on a new 
+ * connection. The shadow is cleared as the controller may
+ * have been restarted. When the topic of every routed PIN
+ * was read before, only the dirty PINs are replayed and 
+ * the others verified, otherwise all PINs are 
+ * synchronized with their topics. Topics without value 
+ * count as read, they have no state to replay. Then the heartbeat is
+ * started.
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * int slot                 Slot index sent by controller
+ * 
+ * Return value:            -2 means redis failed, -1 means
+ *                          failed to send. 0 means OK
+ */
+int controllerReady(cargador_ctrl* ctrl, int slot) {
+    struct timeval heartbeat_interval = { 0, CARGADOR_HEARTBEAT_INTERVAL };
+    int ret;
+    
+    to_rtt_stop(&ctrl->rtt);
+    evtimer_del(ctrl->timeout_event);
+    ctrl->slot = slot;
+    ctrl->shadow = 0;
+    ctrl->shadow_valid = 0;
+    
+    LOG_INFO("Connected to controller %s, remote socket: %d, timeout: %lluus", ctrl->addr, ctrl->slot, (unsigned long long)ctrl->rtt.timeout);
+    
+    if(0 != (routedPins(&ctrl->routes) & ~ctrl->loaded)) {
+        ret = syncRoutes(ctrl, gs_sync_context);
+    } else {
+        ret = replayDirty(ctrl);
+    }
+    
+    if(CARGADOR_SND_RCV_OK != ret) {
+        return ret;
+    }
+    
+    updateSlot(ctrl, gs_sync_context);
+    
+    if(CARGADOR_STANDBY && NULL == ctrl->standby.base) {
+        LOG_INFO("Building standby connection to controller %s!", ctrl->addr);
+        to_standby_start(&ctrl->standby, gs_base, ctrl->addr, ctrl->port, &ctrl->options);
+    }
+    
+    if(TO_SOCKET_OK != to_heartbeat_start(&ctrl->heartbeat, gs_base, &heartbeat_interval, CARGADOR_HEARTBEAT_MISSES, probeController, controllerFailed, ctrl)) {
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    return CARGADOR_SND_RCV_OK;
+}
+
+/*
+ * Called when the async connect to a controller finished,
+ * the connection is ready when the slot index arrived
+ * 
+ * Parameters:
+ * to_socket_ctx socket     Connected socket or error code
+ * void* arg                Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void connectedCallback(to_socket_ctx socket, void* arg) {
+    cargador_ctrl* ctrl = (cargador_ctrl*)arg;
+    
+    if(0 > socket) {
+        LOG_ERROR("Error connecting to controller %s:%d!", ctrl->addr, ctrl->port);
+        if(TO_SOCKET_ERROR_CONNECT_TIMEOUT == socket) {
+            to_rtt_backoff(&ctrl->rtt);
+        }
+        scheduleReconnect(ctrl);
+        return;
     }
     
-    return CARGADOR_SND_RCV_OK;
+    // the slot index is the first round trip sample of
+    // the link
+    ctrl->socket = socket;
+    ctrl->slot = -1;
+    to_rtt_start(&ctrl->rtt);
+    if(CARGADOR_SND_RCV_OK != attachController(ctrl)) {
+        controllerLost(ctrl);
+    }
 }
 
 /*
- * After start phase, the cargador will subscribe expected 
- * message channels to keep the controller's output PIN in
- * the expected status with value specified in redis.
- * 
- * This callback function will be called when there is new
- * expected value.
+ * Start connecting to a controller in the background, the
+ * timeouts are derived from the round trip time estimate
  * 
  * Parameters:
- * redisAsyncContext *c     Connection context to redis
- * void *r                  Response struct for redis returned values
- *                          Because when the service is started, the 
- *                          service use psubscribe to subscribe chagnes
- *                          from redis, so the reply item usually has
- *                          4 elements 1 is "pmessage", second is 
- *                          subscribe pattern, third is actual channel, 
- *                          fourth will contains the value.
- * void *privdata           The PIN index is passed in as a long integer
- *                          although this seems to be a pointer but will
- *                          force convert it to a long integer
+ * cargador_ctrl* ctrl      Controller
  * 
  * Return value:
  * There is no return value
- * 
- * Note: When send/receive error occures, this service will terminate
- * itself and restart, so when send/recv error occur, it will disconnect
- * from redis and main function will restart trying to reconnect.
- * 
  */
-void subscribeCallback(redisAsyncContext *c, void *r, void *privdata) {
-    redisReply *reply = r;
-    list_node* node = (list_node*)privdata;
+void connectController(cargador_ctrl* ctrl) {
+    LOG_INFO("Connecting to controller %s:%d!", ctrl->addr, ctrl->port);
+    to_rtt_options(&ctrl->rtt, &ctrl->options);
     
-    LOG_DEBUG("Subscribe callback!");
-    if (reply == NULL) {
-        LOG_ERROR("Error empty subscribed response!");
-        if (c->errstr) {
-            LOG_ERROR("Subscribe errstr: %s", c->errstr);
-        }
-        redisAsyncDisconnect(c);
-        return;
+    if(TO_SOCKET_OK != to_connect_async(&ctrl->req, gs_base, ctrl->addr, ctrl->port, &ctrl->options, connectedCallback, ctrl)) {
+        LOG_ERROR("Error creating socket to controller %s!", ctrl->addr);
+        scheduleReconnect(ctrl);
     }
+}
+
+/*
+ * Reconnect timer of a failed controller
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void reconnectCallback(evutil_socket_t fd, short events, void *arg) {
+    UNUSED(fd);
+    UNUSED(events);
     
-    LOG_DETAILS("Subscribe reply type: %d", reply->type);
-    LOG_DETAILS("Subscribe reply elements: %zd", reply->elements);
-    LOG_DETAILS("Subscribe parameters: %d", node->pin_id);
+    connectController((cargador_ctrl*)arg);
+}
 
-    for(size_t i = 0; i < reply->elements; i++) {
-        LOG_DETAILS("sub reply element %d: %s", i, reply->element[i]->str);
-    }
+/*
+ * Timer callback publishing latency percentiles of the
+ * last interval to redis hash stats/cargador/<ip> of every
+ * controller, all of them in one round trip
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Sync redis connection
+ * 
+ * Return value:
+ * There is no return value
+ */
+void publishStatsCallback(evutil_socket_t fd, short events, void *arg) {
+    UNUSED(fd);
+    UNUSED(events);
 
-    if(3 != reply->elements) {
-        LOG_ERROR("Error: Unexpected format!");
-        redisAsyncDisconnect(c);
-        return;
-    }
+    redisContext* sync_context = (redisContext*)arg;
+    char text[STATS_TEXT_SIZE];
+    redisReply* reply;
+    cargador_ctrl* ctrl;
+    int count = 0;
     
-    if(NULL == reply->element[2] || NULL == reply->element[2]->str) {
-        LOG_WARNING("Error: Empty content!");
-        return;
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        ctrl = &gs_ctrls[i];
+        if(0 > stats_format(&ctrl->send_recv_stats, text, sizeof(text))) {
+            LOG_WARNING("Failed to format %s stats of %s!", ctrl->send_recv_stats.name, ctrl->addr);
+            continue;
+        }
+        
+        LOGM_DETAILS(LOG_MODULE_REDIS, "HSET %s %s %s commands_sent %lu commands_suppressed %lu commands_coalesced %lu drift_corrected %lu pins_replayed %lu", ctrl->stats_key, ctrl->send_recv_stats.name, text, ctrl->commands_sent, ctrl->commands_suppressed, ctrl->commands_coalesced, ctrl->drift_corrected, ctrl->pins_replayed);
+        redisAppendCommand(sync_context, "HSET %s %s %s commands_sent %lu commands_suppressed %lu commands_coalesced %lu drift_corrected %lu pins_replayed %lu", ctrl->stats_key, ctrl->send_recv_stats.name, text, ctrl->commands_sent, ctrl->commands_suppressed, ctrl->commands_coalesced, ctrl->drift_corrected, ctrl->pins_replayed);
+        count++;
     }
     
-    while(node) {
-        if(CARGADOR_SND_RCV_OK != sendRecvCommand(node->pin_id, reply->element[2]->str)) {
-            LOG_ERROR("Error: failed to update status for PIN %d, %s", node->pin_id, reply->element[2]->str);
-            redisAsyncDisconnect(c);
+    for(int i = 0; i < count; i++) {
+        if(REDIS_OK != redisGetReply(sync_context, (void**)&reply)) {
+            LOG_ERROR("Failed to publish stats %s", sync_context->errstr);
+            redisAsyncDisconnect(gs_async_context);
+            return;
         }
+        freeReplyObject(reply);
+    }
+    
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        stats_reset(&gs_ctrls[i].send_recv_stats);
         
-        node = node->pNext;
+        // the slot changes when the standby took over or
+        // the controller is reconnecting
+        updateSlot(&gs_ctrls[i], sync_context);
     }
-
-    LOG_DEBUG("Subscribe finished!");
 }
 
 /*
@@ -422,6 +2490,11 @@ void connectCallback(const redisAsyncContext *c, int status) {
  * 
  */
 void disconnectCallback(const redisAsyncContext *c, int status) {
+    // timers would keep the event loop running
+    if(NULL != gs_base) {
+        event_base_loopbreak(gs_base);
+    }
+    
     if (status != REDIS_OK) {
         LOG_ERROR("Error: %s", c->errstr);
         return;
@@ -429,6 +2502,309 @@ void disconnectCallback(const redisAsyncContext *c, int status) {
     LOG_INFO("Disconnected from redis...");
 }
 
+/*
+ * Add a controller served by this process. The round 
+ * trip time estimate and the counters are kept when the
+ * same controller is added at the same position after a
+ * restart.
+ * 
+ * Parameters:
+ * const char* addr         Address of the controller
+ * int port                 Port number of the controller
+ * 
+ * Return value:            -1 means failed. 0 means OK
+ */
+int addController(const char* addr, int port) {
+    cargador_ctrl* ctrl;
+    int ret;
+    
+    if('\0' == *addr || CARGADOR_ADDR_SIZE <= strlen(addr)) {
+        LOG_WARNING("Ignore invalid controller address %s", addr);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        if(0 == strcmp(gs_ctrls[i].addr, addr)) {
+            LOG_WARNING("Ignore duplicated controller %s", addr);
+            return CARGADOR_SND_RCV_ERROR;
+        }
+    }
+    
+    if(CARGADOR_MAX_CONTROLLERS <= gs_ctrl_count) {
+        LOG_WARNING("Ignore controller %s, at most %d controllers are served", addr, CARGADOR_MAX_CONTROLLERS);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    ctrl = &gs_ctrls[gs_ctrl_count];
+    if(0 != strcmp(ctrl->addr, addr) || port != ctrl->port) {
+        memset(ctrl, 0, sizeof(cargador_ctrl));
+        strcpy(ctrl->addr, addr);
+        ctrl->port = port;
+    }
+    
+    if(STATS_OK != stats_key(ctrl->stats_key, sizeof(ctrl->stats_key), FLAG_KEY, addr)) {
+        LOG_ERROR("Controller address too long %s!", addr);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+
+    if(TO_SOCKET_OK != to_slot_key(ctrl->slot_key, sizeof(ctrl->slot_key), addr, port)) {
+        LOG_ERROR("Controller address too long %s!", addr);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+
+    ret = snprintf(ctrl->config_key, sizeof(ctrl->config_key), "%s/%s", FLAG_KEY, addr);
+    if(0 > ret || sizeof(ctrl->config_key) <= (size_t)ret) {
+        LOG_ERROR("Controller address too long %s!", addr);
+        return CARGADOR_SND_RCV_ERROR;
+    }
+    
+    // 1 byte commands need to be sent immediately
+    to_socket_default_options(&ctrl->options);
+    ctrl->options.nodelay = 1;
+    ctrl->options.user_timeout = CARGADOR_USER_TIMEOUT;
+    if(!ctrl->rtt_initialized) {
+        to_rtt_init(&ctrl->rtt, &ctrl->options);
+        ctrl->rtt_initialized = TRUE;
+    }
+    
+    ctrl->socket = -1;
+    ctrl->slot = -1;
+    ctrl->registered_slot = -1;
+    ctrl->req.ev = NULL;
+    ctrl->req.socket = -1;
+    ctrl->queue_len = 0;
+    ctrl->inflight_head = ctrl->inflight_tail = 0;
+    ctrl->probe = CARGADOR_PROBE_IDLE;
+    ctrl->busy = 0;
+    ctrl->pending = 0;
+    ctrl->coalesce_window = CARGADOR_COALESCE_WINDOW * 1000000ULL;
+    ctrl->desired_valid = 0;
+    ctrl->loaded = 0;
+    ctrl->dirty = 0;
+    ctrl->reconcile_period = CARGADOR_RECONCILE_PERIOD;
+    ctrl->reconcile_pin = 0;
+    ctrl->shadow_valid = 0;
+    ctrl->force_refresh = FALSE;
+    ctrl->send_recv_stats.name = "send_recv";
+    stats_reset(&ctrl->send_recv_stats);
+    initRoutes(&ctrl->routes);
+    
+    gs_ctrl_count++;
+    return CARGADOR_SND_RCV_OK;
+}
+
+/*
+ * Add the controllers of a comma separated address list
+ * 
+ * Parameters:
+ * const char* list         Controller addresses, e.g. 
+ *                          "192.168.100.100,192.168.100.101"
+ * int port                 Port number of the controllers
+ * 
+ * Return value:            Count of controllers added
+ */
+int parseControllers(const char* list, int port) {
+    char addr[CARGADOR_ADDR_SIZE];
+    size_t len;
+    
+    while('\0' != *list) {
+        len = strcspn(list, ",");
+        if(len < sizeof(addr)) {
+            memcpy(addr, list, len);
+            addr[len] = '\0';
+            addController(addr, port);
+        } else {
+            LOG_WARNING("Ignore controller address too long in %s", list);
+        }
+        
+        list += len;
+        if(',' == *list) {
+            list++;
+        }
+    }
+    
+    return gs_ctrl_count;
+}
+
+/*
+ * Add the controllers of a redis set, the members are the
+ * controller addresses
+ * 
+ * Parameters:
+ * redisContext* sync_context   Sync redis connection in DB 0
+ * const char* key              Key of the set
+ * int port                     Port number of the controllers
+ * 
+ * Return value:            -2 means redis failed, otherwise
+ *                          count of controllers added
+ */
+int discoverControllers(redisContext* sync_context, const char* key, int port) {
+    redisReply* reply;
+    
+    LOGM_DETAILS(LOG_MODULE_REDIS, "SMEMBERS %s", key);
+    reply = redisCommand(sync_context, "SMEMBERS %s", key);
+    if(NULL == reply) {
+        LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);
+        return CARGADOR_REDIS_ERROR;
+    }
+    
+    if(REDIS_REPLY_ARRAY != reply->type) {
+        LOG_ERROR("Unexpected controller set type %d", reply->type);
+        freeReplyObject(reply);
+        return CARGADOR_REDIS_ERROR;
+    }
+    
+    for(size_t i = 0; i < reply->elements; i++) {
+        if(NULL != reply->element[i]->str) {
+            addController(reply->element[i]->str, port);
+        }
+    }
+    freeReplyObject(reply);
+    
+    return gs_ctrl_count;
+}
+
+/*
+ * Load the PIN configuration and the flags of all 
+ * controllers and subscribe their topics. PIN 
+ * configurations are in DB 0 and flags are in DB 1, all 
+ * of them are loaded in one round trip.
+ * 
+ * Parameters:
+ * redisContext* sync_context   Sync redis connection in DB 0,
+ *                              it is in DB 1 afterwards
+ * 
+ * Return value:            -2 means redis failed. 0 means OK
+ */
+int loadControllers(redisContext* sync_context) {
+    redisReply* reply = NULL;
+    cargador_ctrl* ctrl;
+    
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        LOG_DETAILS("HGETALL %s", gs_ctrls[i].config_key);
+        redisAppendCommand(sync_context, "HGETALL %s", gs_ctrls[i].config_key);
+    }
+    redisAppendCommand(sync_context, "SELECT 1");
+    redisAppendCommand(sync_context, "GET %s/%s", gs_ctrls[0].config_key, LOG_LEVEL_FLAG_VALUE);
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        redisAppendCommand(sync_context, "GET %s/%s", gs_ctrls[i].config_key, REFRESH_FLAG_VALUE);
+        redisAppendCommand(sync_context, "GET %s/%s", gs_ctrls[i].config_key, COALESCE_FLAG_VALUE);
+        redisAppendCommand(sync_context, "GET %s/%s", gs_ctrls[i].config_key, RECONCILE_FLAG_VALUE);
+    }
+    
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        ctrl = &gs_ctrls[i];
+        if(REDIS_OK != redisGetReply(sync_context, (void**)&reply)) {
+            goto l_redis_failed;
+        }
+        
+        if(REDIS_REPLY_ARRAY != reply->type) {
+            LOG_ERROR("Unexpected pin configuration type %d of %s", reply->type, ctrl->addr);
+            goto l_free_reply;
+        }
+        
+        loadRoutes(&ctrl->routes, reply);
+        subscribeRoutes("SUBSCRIBE", ctrl, &ctrl->routes, NULL);
+        freeReplyObject(reply);
+        reply = NULL;
+    }
+    
+    if(REDIS_OK != redisGetReply(sync_context, (void**)&reply)) {
+        goto l_redis_failed;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+    
+    if(REDIS_OK != redisGetReply(sync_context, (void**)&reply)) {
+        goto l_redis_failed;
+    }
+    
+    if(NULL != reply->str) {
+        if(LOG_SET_LEVEL_OK != log_set_level(reply->str)) {
+            LOG_WARNING("Failed to set log level %s", reply->str);
+        }
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+    
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        ctrl = &gs_ctrls[i];
+        if(REDIS_OK != redisGetReply(sync_context, (void**)&reply)) {
+            goto l_redis_failed;
+        }
+        
+        ctrl->force_refresh = (NULL != reply->str && 0 != strcmp("0", reply->str));
+        freeReplyObject(reply);
+        reply = NULL;
+        
+        if(REDIS_OK != redisGetReply(sync_context, (void**)&reply)) {
+            goto l_redis_failed;
+        }
+        
+        if(NULL != reply->str) {
+            setCoalesceWindow(ctrl, reply->str);
+        }
+        freeReplyObject(reply);
+        reply = NULL;
+        
+        if(REDIS_OK != redisGetReply(sync_context, (void**)&reply)) {
+            goto l_redis_failed;
+        }
+        
+        if(NULL != reply->str) {
+            setReconcilePeriod(ctrl, reply->str);
+        }
+        freeReplyObject(reply);
+        reply = NULL;
+    }
+    
+    return CARGADOR_SND_RCV_OK;
+    
+l_redis_failed:
+    LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);
+    
+l_free_reply:
+    if(NULL != reply) {
+        freeReplyObject(reply);
+    }
+    
+    return CARGADOR_REDIS_ERROR;
+}
+
+/*
+ * Close the connections of a controller and free its 
+ * timers
+ * 
+ * Parameters:
+ * cargador_ctrl* ctrl      Controller
+ * 
+ * Return value:
+ * There is no return value
+ */
+void stopController(cargador_ctrl* ctrl) {
+    to_connect_cancel(&ctrl->req);
+    to_heartbeat_stop(&ctrl->heartbeat);
+    to_standby_stop(&ctrl->standby);
+    detachController(ctrl);
+    
+    if(NULL != ctrl->reconcile_event) {
+        event_free(ctrl->reconcile_event);
+        ctrl->reconcile_event = NULL;
+    }
+    
+    if(NULL != ctrl->reconnect_event) {
+        event_free(ctrl->reconnect_event);
+        ctrl->reconnect_event = NULL;
+    }
+    
+    LOG_INFO("Close network connection of controller %s!", ctrl->addr);
+    if(0 <= ctrl->socket) {
+        to_close(ctrl->socket);
+        ctrl->socket = -1;
+    }
+    ctrl->slot = -1;
+}
+
 /*
  * When user input incorrect data, this service will
  * exit immediately. And with this function, it can
@@ -455,31 +2831,33 @@ void print_usage(int argc, char **argv) {
     
     printf("Invalid input parameters!\r\n");
     printf("Usage: (<optional parameters>)\r\n");
-    printf("%s controller_ip controller_port <log_level> <redis_ip> <redis_port>\r\n", argv[0]);
+    printf("%s controller_ip[,controller_ip...] controller_port <log_level> <redis_ip> <redis_port>\r\n", argv[0]);
+    printf("%s @controller_set controller_port <log_level> <redis_ip> <redis_port>\r\n", argv[0]);
     log_print_level_info();
     printf("E.g.:\r\n");
     printf("%s 192.168.100.100 5000\r\n", argv[0]);
     printf("%s 192.168.100.100 5000 debug\r\n", argv[0]);
     printf("%s 192.168.100.100 5000 127.0.0.1 6379\r\n", argv[0]);
     printf("%s 192.168.100.100 5000 debug 127.0.0.1 6379\r\n", argv[0]);
+    printf("%s 192.168.100.100,192.168.100.101 5000\r\n", argv[0]);
+    printf("%s @cargador/controllers 5000 debug\r\n", argv[0]);
 }
 
 /*
  * Main entry of the service. It will first connect
- * to the controller, and setup send/recv timeout
- * to ensure the network traffic is not blocking
- * and can fail fast.
+ * to redis and get the controllers to serve, from the
+ * parameters or from a redis set.
  * 
- * Then it will connect to redis and get expected
- * status for each controller's output PIN and 
- * send the command to controller through 
- * getCallback.
+ * Then it will load the PIN configuration of every 
+ * controller and subscribe the topics, all controllers
+ * share the redis connections and the event loop.
  * 
- * And then the redis connection will use psubscribe
- * to subscribe the expected status and if there
- * is any update of expected status, the 
- * subscribeCallback will process the update message
- * and send command to controller
+ * The controllers are connected in the background, 
+ * when a controller sent its slot the expected status
+ * of its output PINs is sent. A failed controller is
+ * reconnected on its own. If there is any update of
+ * expected status, the subscribeCallback will process
+ * the update message and send command to controller
  * 
  * Parameters:
  * int argc                 Number of input parameters, same function 
@@ -505,22 +2883,19 @@ l_start:
     struct timeval timeout = { 0, 100000 }; 
 
     int ret;
-    unsigned char temp = 0;
     
     const char* serv_ip;
     const char* redis_ip;
+    const char* name;
     int serv_port, redis_port;
+    char instance[CARGADOR_ADDR_SIZE];
     
     redisContext *sync_context = NULL;
+    struct event *stats_event = NULL;
+    struct timeval stats_interval = { STATS_PUBLISH_INTERVAL, 0 };
+    cargador_ctrl* ctrl;
     
-    redisReply* reply[MAX_OUTPUT_PIN_COUNT];
-    list_node*  nodes[MAX_OUTPUT_PIN_COUNT];
-    
-    // Initialize reply object
-    for(int i = 0; i < MAX_OUTPUT_PIN_COUNT; i++) {
-        reply[i] = NULL;
-        nodes[i] = NULL;
-    }
+    redisReply* tempReply = NULL;
     
     LOG_INFO("=================== Service start! ===================");
     LOG_INFO("Parsing parameters!");
@@ -562,27 +2937,33 @@ l_start:
             return -1;
     }
     
-    LOG_INFO("Connecting to controller!");
-    gs_socket = to_connect(serv_ip, serv_port);
-    if(0 > gs_socket) {
-        LOG_ERROR("Error creating socket!");
-        goto l_exit;
-    }
-  
-    // Receive initial byte to activate keep alive of the remote device
-    ret = to_recv(gs_socket, &temp, 1, 0);
-    if(0 > ret) {
-        LOG_ERROR("Error receiving initial data! Error code: %s", strerror(errno));
-        goto l_socket_cleanup;
+    // log files are named after the first controller or 
+    // the discovery set
+    name = serv_ip + (CARGADOR_DISCOVER_PREFIX == *serv_ip ? 1 : 0);
+    snprintf(instance, sizeof(instance), "%.*s", (int)strcspn(name, ","), name);
+    for(char* p = instance; '\0' != *p; p++) {
+        if('/' == *p) {
+            *p = '_';
+        }
     }
     
-    LOG_INFO("Connected to controller, remote socket: %d", temp);
-    
+    if(LOG_RECORDER_OK != log_recorder_open(FLAG_KEY, instance)) {
+        LOG_WARNING("Failed to open flight recorder!");
+    }
+
+    if(LOG_BINARY_ERROR == log_open_binary(FLAG_KEY, instance)) {
+        LOG_WARNING("Failed to open binary log, fallback to text output!");
+    }
+
+    if(LOG_ASYNC_OK != log_async_start()) {
+        LOG_WARNING("Failed to start async logging, fallback to sync output!");
+    }
+
     LOG_INFO("Connecting to Redis in sync mode!");
     sync_context = redisConnectWithTimeout(redis_ip, redis_port, timeout);
     if(NULL == sync_context) {
         LOG_ERROR("Connection error: can't allocate sync redis context");
-        goto l_socket_cleanup;
+        goto l_exit;
     }
     
     if(sync_context->err) {
@@ -590,19 +2971,35 @@ l_start:
         goto l_free_sync_redis;
     }
 
-    reply[0] = redisCommand(sync_context,"PING");
-    if(NULL == reply[0]) {
+    tempReply = redisCommand(sync_context,"PING");
+    if(NULL == tempReply) {
         LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);
         goto l_free_sync_redis;
     }
-    LOG_DEBUG("PING: %s", reply[0]->str);
-    freeReplyObject(reply[0]);
-    reply[0] = NULL;
+    LOG_DEBUG("PING: %s", tempReply->str);
+    freeReplyObject(tempReply);
+    tempReply = NULL;
 
     LOG_INFO("Connected to Redis in sync mode");
+    gs_sync_context = sync_context;
+    
+    gs_ctrl_count = 0;
+    if(CARGADOR_DISCOVER_PREFIX == *serv_ip) {
+        LOG_INFO("Discovering controllers in set %s!", serv_ip + 1);
+        ret = discoverControllers(sync_context, serv_ip + 1, serv_port);
+    } else {
+        ret = parseControllers(serv_ip, serv_port);
+    }
+    
+    if(0 >= ret) {
+        LOG_ERROR("No controller to serve in %s!", serv_ip);
+        goto l_free_sync_redis;
+    }
+    LOG_INFO("Serving %d controllers", gs_ctrl_count);
     
     LOG_INFO("Connecting to Redis in async mode!");
     base = event_base_new();
+    gs_base = base;
     redisOptions options = {0};
     REDIS_OPTIONS_SET_TCP(&options, redis_ip, redis_port);
     options.connect_timeout = &timeout;
@@ -628,176 +3025,80 @@ l_start:
     redisAsyncSetConnectCallback(gs_async_context,connectCallback);
     redisAsyncSetDisconnectCallback(gs_async_context,disconnectCallback);
 
-    LOG_INFO("Subscribe exit, reset, log_level configuration changes!")
-    redisAsyncCommand(gs_async_context, exitCallback, NULL, "SUBSCRIBE %s/%s/%s", FLAG_KEY, serv_ip, EXIT_FLAG_VALUE);
-    redisAsyncCommand(gs_async_context, resetCallback, NULL, "SUBSCRIBE %s/%s/%s", FLAG_KEY, serv_ip, RESET_FLAG_VALUE);
-    redisAsyncCommand(gs_async_context, setLogLevelCallback, NULL, "SUBSCRIBE %s/%s/%s", FLAG_KEY, serv_ip, LOG_LEVEL_FLAG_VALUE);
-    
-    // load topics from redis hashset
-    LOG_INFO("Loading controller pin configuration!");
-    for(int i = 0; i < MAX_OUTPUT_PIN_COUNT; i++ ) {
-        LOG_DETAILS("HGET %s/%s %d", FLAG_KEY, serv_ip, i);
-        reply[i] = redisCommand(sync_context,"HGET %s/%s %d", FLAG_KEY, serv_ip, i);
-        if(NULL == reply[i]) {
-            LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);
-            goto l_free_sync_redis_reply;
-        }
-        
-        LOG_DETAILS("HGET Result: %s", reply[i]->str);
-    }
-    
-    // seek duplicate subscribe topics and convert to linked list
-    LOG_INFO("Process topics!");
-    int topic_cnt = 0;
-    for(int i = 0; i < MAX_OUTPUT_PIN_COUNT; i++) {
-        int j = 0;
-        
-        if(NULL == reply[i]->str)
-            continue;
-            
-        while(j < topic_cnt) {
-            if(0 == strcmp(reply[i]->str, reply[nodes[j]->topic_idx]->str)) {
-                break;
-            }
-            
-            j++;
+    // exit, reset and log_level of any controller apply to
+    // the whole service, the other flags to the controller
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        ctrl = &gs_ctrls[i];
+        ctrl->reconcile_event = event_new(base, -1, EV_PERSIST, reconcileCallback, ctrl);
+        ctrl->reconnect_event = evtimer_new(base, reconnectCallback, ctrl);
+        if(NULL == ctrl->reconcile_event || NULL == ctrl->reconnect_event) {
+            LOG_ERROR("Failed to create timers of controller %s!", ctrl->addr);
+            goto l_free_async_redis;
         }
         
-        if(j < topic_cnt) { 
-            // found duplicate topic
-            list_node* temp = nodes[j];
-            // search for tail node
-            while(temp->pNext) {
-                temp = temp->pNext;
-            }
-            
-            temp->pNext = (list_node*)malloc(sizeof(list_node));
-            temp = temp->pNext;
-            temp->topic_idx = nodes[j]->topic_idx;
-            temp->pin_id = i;
-            temp->pNext = NULL;
-        } else {
-            // new topic
-            nodes[topic_cnt] = (list_node*)malloc(sizeof(list_node));
-            nodes[topic_cnt]->topic_idx = i;
-            nodes[topic_cnt]->pin_id = i;
-            nodes[topic_cnt]->pNext = NULL;
-            topic_cnt++;
-        }
+        LOG_INFO("Subscribe exit, reset, log_level, refresh, coalesce, reconcile, reload configuration changes of %s!", ctrl->addr);
+        redisAsyncCommand(gs_async_context, exitCallback, NULL, "SUBSCRIBE %s/%s", ctrl->config_key, EXIT_FLAG_VALUE);
+        redisAsyncCommand(gs_async_context, resetCallback, NULL, "SUBSCRIBE %s/%s", ctrl->config_key, RESET_FLAG_VALUE);
+        redisAsyncCommand(gs_async_context, setLogLevelCallback, NULL, "SUBSCRIBE %s/%s", ctrl->config_key, LOG_LEVEL_FLAG_VALUE);
+        redisAsyncCommand(gs_async_context, setRefreshCallback, ctrl, "SUBSCRIBE %s/%s", ctrl->config_key, REFRESH_FLAG_VALUE);
+        redisAsyncCommand(gs_async_context, setCoalesceCallback, ctrl, "SUBSCRIBE %s/%s", ctrl->config_key, COALESCE_FLAG_VALUE);
+        redisAsyncCommand(gs_async_context, setReconcileCallback, ctrl, "SUBSCRIBE %s/%s", ctrl->config_key, RECONCILE_FLAG_VALUE);
+        redisAsyncCommand(gs_async_context, reloadCallback, ctrl, "SUBSCRIBE %s/%s __keyspace@0__:%s", ctrl->config_key, RELOAD_FLAG_VALUE, ctrl->config_key);
     }
     
-    // Switch to DB 1 for current status
-    LOG_INFO("Switch to Redis DB 1 to load status");
-    LOG_DETAILS("SELECT 1");
-    redisReply* tempReply = redisCommand(sync_context,"SELECT 1");
-
-    if(NULL == tempReply) {
-        LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);
+    // load topics from redis hashsets
+    LOG_INFO("Loading controller pin configuration and flags!");
+    if(CARGADOR_SND_RCV_OK != loadControllers(sync_context)) {
         goto l_free_async_redis;
     }
 
-    freeReplyObject(tempReply);
-    tempReply = NULL;
-
-    LOG_INFO("Loading log_level configuration!");
-    LOG_DETAILS("GET %s/%s/%s", FLAG_KEY, serv_ip, LOG_LEVEL_FLAG_VALUE);
-    tempReply = redisCommand(sync_context,"GET %s/%s/%s", FLAG_KEY, serv_ip, LOG_LEVEL_FLAG_VALUE);
-
-    if(NULL == tempReply) {
-        LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);
+    // sync connection is kept for publishing stats
+    LOG_INFO("Start publishing stats every %d seconds", STATS_PUBLISH_INTERVAL);
+    stats_event = event_new(base, -1, EV_PERSIST, publishStatsCallback, sync_context);
+    if(NULL == stats_event || 0 != event_add(stats_event, &stats_interval)) {
+        LOG_ERROR("Failed to start stats timer!");
         goto l_free_async_redis;
     }
     
-    if(NULL != tempReply->str) {
-        if(LOG_SET_LEVEL_OK != log_set_level(tempReply->str)) {
-            LOG_WARNING("Failed to set log level %s", tempReply->str);
-        }
-    }
-
-    freeReplyObject(tempReply);
-    tempReply = NULL;
-
-    for(int i = 0; i < topic_cnt; i++) {
-        tempReply = redisCommand(sync_context,"GET %s", reply[nodes[i]->topic_idx]->str);
-        if(NULL == tempReply) {
-            LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);
-            goto l_free_linked_list;
-        }
-        
-        LOG_DETAILS("GET %s", tempReply->str);
-        
-        list_node* tempNode = nodes[i];
-        while(tempNode) {
-            if(CARGADOR_SND_RCV_OK != sendRecvCommand(tempNode->pin_id, tempReply->str)) {
-                LOG_ERROR("Error updating controller status");
-                freeReplyObject(tempReply);
-                goto l_free_linked_list;
-            }
-            tempNode = tempNode->pNext;
-        }
-        freeReplyObject(tempReply);
-        tempReply = NULL;
-        
-        LOG_DETAILS("SUBSCRIBE %s", reply[nodes[i]->topic_idx]->str);
-        redisAsyncCommand(gs_async_context, subscribeCallback, (void*)nodes[i], "SUBSCRIBE %s", reply[nodes[i]->topic_idx]->str);
-    }
-
-    LOG_INFO("Free cargador configuraiton items");
-    for(int i = 0; i < MAX_OUTPUT_PIN_COUNT; i++) {
-        if(reply[i]) {
-            freeReplyObject(reply[i]);
-            reply[i] = NULL;
-        }
+    // controllers are connected in the background, so a
+    // controller not reachable does not delay the others,
+    // the PINs are synchronized when the slot arrived
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        startReconcile(&gs_ctrls[i]);
+        connectController(&gs_ctrls[i]);
     }
-
-    LOG_INFO("Free sync Redis connection");
-    redisFree(sync_context);
-    sync_context = NULL;
     
     event_base_dispatch(base);
     
-l_free_linked_list:
-    LOG_INFO("Free linked list!");
-    for(int i = 0; i < MAX_OUTPUT_PIN_COUNT; i++) {
-        while(nodes[i]) {
-            list_node* temp = nodes[i];
-            nodes[i] = temp->pNext;
-            free(temp);
-        }
-        nodes[i] = NULL;
-    }
-
-
-l_free_sync_redis_reply:
-    LOG_INFO("Free cargador configuraiotn items!");
-    for(int i = 0; i < MAX_OUTPUT_PIN_COUNT; i++) {
-        if(reply[i]) {
-            freeReplyObject(reply[i]);
-            reply[i] = NULL;
-        }
-    }
-
-    
 l_free_async_redis:
     LOG_INFO("Free async Redis connection!");
+    if(NULL != stats_event) {
+        event_free(stats_event);
+        stats_event = NULL;
+    }
+    for(int i = 0; i < gs_ctrl_count; i++) {
+        stopController(&gs_ctrls[i]);
+    }
     redisAsyncFree(gs_async_context);
+    gs_base = NULL;
     event_base_free(base);
     
 l_free_sync_redis:
     LOG_INFO("Free sync Redis connection!");
     if(NULL != sync_context) {
+        for(int i = 0; i < gs_ctrl_count; i++) {
+            gs_ctrls[i].slot = -1;
+            updateSlot(&gs_ctrls[i], sync_context);
+        }
+        gs_sync_context = NULL;
         redisFree(sync_context);
         sync_context = NULL;
     }
-    
-l_socket_cleanup:
-    LOG_INFO("Close controller network connection!");
-    to_close(gs_socket);
-    gs_socket = -1;
 
 l_exit:
     if(!gs_exit) {    
         LOG_ERROR("Execution failed retry!");
+        log_recorder_dump();
         sleep(1);
         goto l_start;
     }
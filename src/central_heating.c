@@ -662,6 +662,14 @@ int main (int argc, char **argv) {
         redis_port = REDIS_PORT;
     }
 
+    if(LOG_RECORDER_OK != log_recorder_open(FLAG_KEY, NULL)) {
+        LOG_WARNING("Failed to open flight recorder!");
+    }
+
+    if(LOG_ASYNC_OK != log_async_start()) {
+        LOG_WARNING("Failed to start async logging, fallback to sync output!");
+    }
+
 l_start:
     LOG_INFO("Connecting to Redis in sync mode!");
     gs_sync_context = redisConnectWithTimeout(redis_ip, redis_port, timeout);
@@ -811,7 +819,7 @@ l_start:
             goto l_free_reply;
         }
         
-        LOG_INFO(reply->str);
+        LOG_INFO("%s", reply->str);
 
         freeReplyObject(reply);
 
@@ -825,7 +833,7 @@ l_start:
             goto l_free_reply;
         }
         
-        LOG_INFO(reply->str);
+        LOG_INFO("%s", reply->str);
 
         if(reply->str) {
             cur_node->last_status = atoi(reply->str);
@@ -843,7 +851,7 @@ l_start:
             goto l_free_reply;
         }
         
-        LOG_INFO(reply->str);
+        LOG_INFO("%s", reply->str);
 
         if(reply->str) {
             cur_node->cur_temp = atoi(reply->str);
@@ -863,7 +871,7 @@ l_start:
             goto l_free_reply;
         }
         
-        LOG_INFO(reply->str);
+        LOG_INFO("%s", reply->str);
 
         if(reply->str) {
             cur_node->target_temp = atoi(reply->str);
@@ -881,7 +889,7 @@ l_start:
             goto l_free_reply;
         }
 
-        LOG_INFO(reply->str);
+        LOG_INFO("%s", reply->str);
 
         freeReplyObject(reply);
 
@@ -979,6 +987,7 @@ l_free_sync_redis:
 l_exit:
     if(!gs_exit) {    
         LOG_ERROR("central heating_keeper execution failed retry!");
+        log_recorder_dump();
         sleep(1);
         goto l_start;
     }
@@ -20,6 +20,7 @@
 #include <adapters/libevent.h>
 
 #include "log.h"
+#include "stats.h"
 
 #define REDIS_IP                "127.0.0.1"
 #define REDIS_PORT              6379
@@ -29,12 +30,20 @@
 #define EXIT_FLAG_KEY           "godown_keeper/exit"
 #define EXIT_FLAG_VALUE         "exit"
 #define LOG_LEVEL_FLAG_KEY      "godown_keeper/log_level"
+#define SERVICE_NAME            "godown_keeper"
 
 static redisContext *gs_sync_context = NULL;
 static redisAsyncContext *gs_async_context = NULL;
 
 static int gs_exit = 0;
 
+/*
+ * Latency of SET commands storing published values and
+ * redis key the percentiles are published to
+ */
+static stats_histogram gs_set_stats = STATS_HISTOGRAM_INIT("set");
+static char gs_stats_key[STATS_KEY_SIZE];
+
 /*
  * After start phase, the godown_keeper will subscribe all 
  * message channels to keep the data stored in redis kv 
@@ -97,11 +106,13 @@ void subscribeCallback(redisAsyncContext *c, void *r, void *privdata) {
                         }
                         
                         if(NULL != reply->element[3] && NULL != reply->element[3]->str) {
+                            uint64_t start = stats_now();
                             redisReply* sync_reply = redisCommand(gs_sync_context,"SET %s %s", reply->element[2]->str, reply->element[3]->str);
                             if(NULL == sync_reply) {
                                 LOG_ERROR("Failed to set item in redis %s", gs_sync_context->errstr);
                                 redisAsyncDisconnect(c);
                             } else {
+                                stats_record_since(&gs_set_stats, start);
                                 LOG_DETAILS("Set item in redis %s", sync_reply->str);
                                 freeReplyObject(sync_reply);
                             }
@@ -127,6 +138,42 @@ void subscribeCallback(redisAsyncContext *c, void *r, void *privdata) {
     LOG_DEBUG("subscribe finished!");
 }
 
+/*
+ * Timer callback publishing latency percentiles of the
+ * last interval to redis hash stats/godown_keeper
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Not used
+ * 
+ * Return value:
+ * There is no return value
+ */
+void publishStatsCallback(evutil_socket_t fd, short events, void *arg) {
+    UNUSED(fd);
+    UNUSED(events);
+    UNUSED(arg);
+
+    char text[STATS_TEXT_SIZE];
+    
+    if(0 > stats_format(&gs_set_stats, text, sizeof(text))) {
+        LOG_WARNING("Failed to format %s stats!", gs_set_stats.name);
+        return;
+    }
+    
+    LOG_DETAILS("HSET %s %s %s", gs_stats_key, gs_set_stats.name, text);
+    redisReply* reply = redisCommand(gs_sync_context, "HSET %s %s %s", gs_stats_key, gs_set_stats.name, text);
+    if(NULL == reply) {
+        LOG_ERROR("Failed to publish stats %s", gs_sync_context->errstr);
+        redisAsyncDisconnect(gs_async_context);
+        return;
+    }
+    
+    freeReplyObject(reply);
+    stats_reset(&gs_set_stats);
+}
+
 /*
  * When successfully connected to redis or failed to connect to redis,
  * this function will be called to update the status
@@ -240,6 +287,8 @@ l_start:
     // 100ms
     struct timeval timeout = { 0, 100000 }; 
     struct event_base *base = NULL;
+    struct event *stats_event = NULL;
+    struct timeval stats_interval = { STATS_PUBLISH_INTERVAL, 0 };
 
     const char* redis_ip;
     int redis_port;
@@ -264,6 +313,19 @@ l_start:
         redis_port = REDIS_PORT;
     }
 
+    if(STATS_OK != stats_key(gs_stats_key, sizeof(gs_stats_key), SERVICE_NAME, NULL)) {
+        LOG_ERROR("Service name too long %s!", SERVICE_NAME);
+        return -4;
+    }
+
+    if(LOG_RECORDER_OK != log_recorder_open(SERVICE_NAME, NULL)) {
+        LOG_WARNING("Failed to open flight recorder!");
+    }
+
+    if(LOG_ASYNC_OK != log_async_start()) {
+        LOG_WARNING("Failed to start async logging, fallback to sync output!");
+    }
+
     LOG_INFO("Connecting to Redis in sync mode!");
     gs_sync_context = redisConnectWithTimeout(redis_ip, redis_port, timeout);
     if(NULL == gs_sync_context) {
@@ -340,9 +402,20 @@ l_start:
     freeReplyObject(tempReply);
     tempReply = NULL;
 
+    stats_reset(&gs_set_stats);
+    stats_event = event_new(base, -1, EV_PERSIST, publishStatsCallback, NULL);
+    if(NULL == stats_event || 0 != event_add(stats_event, &stats_interval)) {
+        LOG_ERROR("Failed to start stats timer!");
+        goto l_free_async_redis;
+    }
+
     event_base_dispatch(base);
     
 l_free_async_redis:
+    if(NULL != stats_event) {
+        event_free(stats_event);
+        stats_event = NULL;
+    }
     redisAsyncFree(gs_async_context);
     event_base_free(base);
  
@@ -352,6 +425,7 @@ l_free_sync_redis:
 l_exit:
     if(!gs_exit) {    
         LOG_ERROR("Godown_keeper execution failed retry!");
+        log_recorder_dump();
         sleep(1);
         goto l_start;
     }
@@ -21,6 +21,7 @@
 
 #include "log.h"
 #include "to_socket.h"
+#include "stats.h"
 
 /*
  * Default address and port for redis 
@@ -423,7 +424,7 @@
 /*
  * Macro for query redis and log info
  */
-#define EXEC_REDIS_CMD(reply, goto_label, cmd, ...)		LOG_DEBUG(cmd, ##__VA_ARGS__);\
+#define EXEC_REDIS_CMD(reply, goto_label, cmd, ...)		LOGM_DEBUG(LOG_MODULE_REDIS, cmd, ##__VA_ARGS__);\
                                                         reply = redisCommand(sync_context, cmd, ##__VA_ARGS__);\
                                                         if(NULL == reply) {\
                                                             LOG_ERROR("Failed to sync query redis %s", sync_context->errstr);\
@@ -434,7 +435,7 @@
 /*
  * Macro for subscribe redis and log info
  */
-#define ASYNC_REDIS_CMD(callback, parameter, cmd, ...)  LOG_DEBUG(cmd, ##__VA_ARGS__);\
+#define ASYNC_REDIS_CMD(callback, parameter, cmd, ...)  LOGM_DEBUG(LOG_MODULE_REDIS, cmd, ##__VA_ARGS__);\
                                                         redisAsyncCommand(async_context, callback, parameter, cmd, ##__VA_ARGS__);
 
 /*
@@ -480,6 +481,105 @@ static iconv_t conv = NULL;
  */
 static int gs_exit = 0;
 
+/*
+ * Commands drawn by callbacks are collected in gs_writer
+ * and sent by gs_flush_event once the current event loop
+ * iteration is done, so a widget update or the whole 
+ * initial screen goes out with one send
+ */
+static to_writer gs_writer;
+static struct event *gs_flush_event = NULL;
+
+/*
+ * Heartbeat of the LCD controller link. The probe redraws
+ * a grid line that is already on screen, a send failing
+ * after LCD_USER_TIMEOUT milli seconds without ack from 
+ * the controller counts as missed.
+ */
+#define LCD_USER_TIMEOUT                750
+#define LCD_HEARTBEAT_INTERVAL          250000
+#define LCD_HEARTBEAT_MISSES            3
+
+static to_heartbeat gs_heartbeat;
+
+/*
+ * Latency of gs_writer flushes, published through the
+ * sync redis connection to key gs_stats_key
+ */
+static stats_histogram gs_flush_stats = STATS_HISTOGRAM_INIT("flush");
+static char gs_stats_key[STATS_KEY_SIZE];
+static redisContext *gs_stats_context = NULL;
+
+/*
+ * Controller slot held by gs_socket, registered in redis
+ * hash gs_slot_key while the service is running
+ */
+static int gs_slot = -1;
+static int gs_slot_registered = 0;
+static char gs_slot_key[TO_SLOT_KEY_SIZE];
+
+/*
+ * flushCallback sends all commands collected in gs_writer.
+ * When sending failed the event loop is stopped so the
+ * service reconnects.
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Event base of the service
+ * 
+ * Return value:
+ * There is no return value
+ */
+void flushCallback(evutil_socket_t fd, short events, void *arg) {
+    UNUSED(fd);
+    UNUSED(events);
+
+    struct event_base *base = (struct event_base*)arg;
+    size_t len = to_writer_pending(&gs_writer);
+    uint64_t start = stats_now();
+    
+    int ret = to_writer_flush(&gs_writer);
+    LOGM_DETAILS(LOG_MODULE_RENDER, "Flush %d bytes result: %d", (int)len, ret);
+    if(0 > ret) {
+        LOG_ERROR("Flush failed! %s", strerror(errno));
+        event_base_loopbreak(base);
+        return;
+    }
+    
+    stats_record_since(&gs_flush_stats, start);
+    to_heartbeat_alive(&gs_heartbeat);
+}
+
+/*
+ * Queue one command for the LCD controller. The command 
+ * is sent by flushCallback together with all other 
+ * commands queued in the same event loop iteration.
+ * 
+ * Parameters:
+ * const void* data         Command bytes
+ * size_t len               Length of command
+ * 
+ * Return value:
+ * less than 0 if failed, otherwise len
+ */
+int lcd_send(const void* data, size_t len) {
+    int ret = to_writer_write(&gs_writer, data, len);
+    if(0 > ret) {
+        return ret;
+    }
+    
+    if(!evtimer_pending(gs_flush_event, NULL)) {
+        struct timeval now = { 0, 0 };
+        if(0 != evtimer_add(gs_flush_event, &now)) {
+            LOG_ERROR("Failed to schedule flush!");
+            return -1;
+        }
+    }
+    
+    return ret;
+}
+
 /*
  * convert_encoding is used to convert default utf-8
  * encoding to a LCD accept GB2312 encoding when
@@ -569,11 +669,11 @@ int draw_string(unsigned int x_start, unsigned int y_start, unsigned int x_end,
     int converted_cnt = 0;
     va_list ap;
     va_start(ap, fmt);
-    LOG_DETAILS("draw_string %d %d %d %d", x_start, y_start, x_end, y_end);
+    LOGM_DETAILS(LOG_MODULE_RENDER, "draw_string %d %d %d %d", x_start, y_start, x_end, y_end);
     ret = vsprintf(input_buffer, fmt, ap);
     va_end(ap);
     
-    LOG_DETAILS("Convert %s", input_buffer);
+    LOGM_DETAILS(LOG_MODULE_RENDER, "Convert %s", input_buffer);
     converted_cnt = convert_encoding();
 
     y_start += (y_end - y_start - font_size)/2;
@@ -594,7 +694,7 @@ int draw_string(unsigned int x_start, unsigned int y_start, unsigned int x_end,
         }
     }
     
-    LOG_DETAILS("used_len: %d font size: %d x_start: %d x_end: %d", used_len, font_size, x_start, x_end);
+    LOGM_DETAILS(LOG_MODULE_RENDER, "used_len: %d font size: %d x_start: %d x_end: %d", used_len, font_size, x_start, x_end);
     if(used_len * font_size / 16 < x_end - x_start + 1) {
         x_start += (x_end - x_start + 1 - used_len * font_size / 16)/2;
     }
@@ -615,10 +715,10 @@ int draw_string(unsigned int x_start, unsigned int y_start, unsigned int x_end,
     memcpy(input_buffer+12, output_buffer, converted_cnt);
 
     input_buffer[converted_cnt + 11] = '\0';
-    LOG_DETAILS("send %d bytes: %s", converted_cnt, input_buffer+12);
+    LOGM_DETAILS(LOG_MODULE_RENDER, "send %d bytes: %s", converted_cnt, input_buffer+12);
     
-    ret = to_send(gs_socket, input_buffer, converted_cnt + 12, 0);
-    LOG_DETAILS("Send result: %d", ret);
+    ret = lcd_send(input_buffer, converted_cnt + 12);
+    LOGM_DETAILS(LOG_MODULE_RENDER, "Send result: %d", ret);
 
     if(0 > ret) {
         LOG_ERROR("Drawstring send error: %s", strerror(errno));
@@ -666,9 +766,9 @@ int draw_string(unsigned int x_start, unsigned int y_start, unsigned int x_end,
     bytes[9] = ((color >> 8) & 0xFF);
     bytes[10] = (color & 0xFF);
     
-    LOG_DEBUG("Draw rectangle send!");
-    ret = to_send(gs_socket, bytes, 11, 0);
-    LOG_DETAILS("Send result: %d", ret);
+    LOGM_DEBUG(LOG_MODULE_RENDER, "Draw rectangle send!");
+    ret = lcd_send(bytes, 11);
+    LOGM_DETAILS(LOG_MODULE_RENDER, "Send result: %d", ret);
     if(0 > ret) {
         LOG_ERROR("Draw rectangle failed send!");
     }
@@ -714,9 +814,9 @@ int draw_line(unsigned int x_start, unsigned int y_start, unsigned int x_end, un
     bytes[9] = ((color >> 8) & 0xFF);
     bytes[10] = (color & 0xFF);
     
-    LOG_DEBUG("Draw line send!");
-    ret = to_send(gs_socket, bytes, 11, 0);
-    LOG_DETAILS("Send result: %d", ret);
+    LOGM_DEBUG(LOG_MODULE_RENDER, "Draw line send!");
+    ret = lcd_send(bytes, 11);
+    LOGM_DETAILS(LOG_MODULE_RENDER, "Send result: %d", ret);
     if(0 > ret) {
         LOG_ERROR("Draw line failed send! %s", strerror(errno));
     }
@@ -1495,8 +1595,8 @@ int set_brightness(unsigned char brightness) {
     bytes[0] = 0x65;
     bytes[1] = brightness;
 
-    ret = to_send(gs_socket, bytes, 2, 0);
-    LOG_DETAILS("Send result: %d", ret);
+    ret = lcd_send(bytes, 2);
+    LOGM_DETAILS(LOG_MODULE_RENDER, "Send result: %d", ret);
     if(0 > ret) {
         LOG_ERROR("Error setBrightnessCallback send failed! %s", strerror(errno));
     }
@@ -1504,6 +1604,45 @@ int set_brightness(unsigned char brightness) {
     return ret;
 }
 
+/*
+ * Heartbeat probe, redraws the separator line between
+ * function area and data area which does not change the
+ * screen. It is sent immediately so a dead controller is
+ * reported by the send of the next probes.
+ * 
+ * Parameters:
+ * void* arg                Not used
+ * 
+ * Return value:
+ * Equal or greater than 0 means successful
+ * Less than 0 means failed
+ */
+int probeLcd(void* arg) {
+    UNUSED(arg);
+    
+    if(0 > draw_line(LCD_FUNCTION_SEP_LINE_X_START, LCD_FUNCTION_SEP_LINE_Y_START, LCD_FUNCTION_SEP_LINE_X_END, LCD_FUNCTION_SEP_LINE_Y_END, FG_COLOR)) {
+        return -1;
+    }
+    
+    return to_writer_flush(&gs_writer);
+}
+
+/*
+ * Called when the LCD controller missed too many 
+ * heartbeats, stops the event loop so the service 
+ * reconnects
+ * 
+ * Parameters:
+ * void* arg                Event base of the service
+ * 
+ * Return value:
+ * There is no return value
+ */
+void lcdFailed(void* arg) {
+    LOG_ERROR("LCD heartbeat failed, restarting!");
+    event_base_loopbreak((struct event_base*)arg);
+}
+
 /*
  * setBrightnessCallback is used to set the brightness
  * of LCD display. valid data range is 0-255
@@ -1660,6 +1799,97 @@ void setLogLevelCallback(redisAsyncContext *c, void *r, void *privdata) {
     LOG_DETAILS("setLogLevelCallback finished!");
 }
 
+/*
+ * Timer callback publishing latency percentiles of the
+ * last interval to redis hash stats/lcd/<ip>. When the
+ * sync redis connection fails, the event loop is stopped
+ * so the service restarts.
+ * 
+ * Parameters:
+ * evutil_socket_t fd       Not used
+ * short events             Not used
+ * void *arg                Event base of the service
+ * 
+ * Return value:
+ * There is no return value
+ */
+void publishStatsCallback(evutil_socket_t fd, short events, void *arg) {
+    UNUSED(fd);
+    UNUSED(events);
+
+    struct event_base *base = (struct event_base*)arg;
+    char text[STATS_TEXT_SIZE];
+    
+    if(0 > stats_format(&gs_flush_stats, text, sizeof(text))) {
+        LOG_WARNING("Failed to format %s stats!", gs_flush_stats.name);
+        return;
+    }
+    
+    LOGM_DETAILS(LOG_MODULE_REDIS, "HSET %s %s %s", gs_stats_key, gs_flush_stats.name, text);
+    redisReply* reply = redisCommand(gs_stats_context, "HSET %s %s %s", gs_stats_key, gs_flush_stats.name, text);
+    if(NULL == reply) {
+        LOG_ERROR("Failed to publish stats %s", gs_stats_context->errstr);
+        event_base_loopbreak(base);
+        return;
+    }
+    
+    freeReplyObject(reply);
+    stats_reset(&gs_flush_stats);
+}
+
+/*
+ * Register gs_slot in the slot registry of the controller,
+ * warns when all slots of the controller are registered
+ * 
+ * Parameters:
+ * redisContext* sync_context   Sync redis connection in DB 1
+ * 
+ * Return value:
+ * There is no return value
+ */
+void register_slot(redisContext* sync_context) {
+    LOGM_DETAILS(LOG_MODULE_REDIS, "HSET %s %d %s:%d", gs_slot_key, gs_slot, FLAG_KEY, (int)getpid());
+    redisReply* reply = redisCommand(sync_context, "HSET %s %d %s:%d", gs_slot_key, gs_slot, FLAG_KEY, (int)getpid());
+    if(NULL == reply) {
+        LOG_WARNING("Failed to register slot %d %s", gs_slot, sync_context->errstr);
+        return;
+    }
+    freeReplyObject(reply);
+    gs_slot_registered = 1;
+    
+    reply = redisCommand(sync_context, "HLEN %s", gs_slot_key);
+    if(NULL != reply) {
+        if(REDIS_REPLY_INTEGER == reply->type && TO_SLOT_COUNT <= reply->integer) {
+            LOG_WARNING("All %d slots of controller %s are registered!", TO_SLOT_COUNT, gs_slot_key);
+        }
+        freeReplyObject(reply);
+    }
+}
+
+/*
+ * Remove gs_slot from the slot registry of the controller
+ * 
+ * Parameters:
+ * redisContext* sync_context   Sync redis connection in DB 1
+ * 
+ * Return value:
+ * There is no return value
+ */
+void release_slot(redisContext* sync_context) {
+    if(!gs_slot_registered) {
+        return;
+    }
+    gs_slot_registered = 0;
+    
+    LOGM_DETAILS(LOG_MODULE_REDIS, "HDEL %s %d", gs_slot_key, gs_slot);
+    redisReply* reply = redisCommand(sync_context, "HDEL %s %d", gs_slot_key, gs_slot);
+    if(NULL == reply) {
+        LOG_WARNING("Failed to release slot %d %s", gs_slot, sync_context->errstr);
+        return;
+    }
+    freeReplyObject(reply);
+}
+
 /*
  * When successfully connected to redis or failed to connect to redis,
  * this function will be called to update the status
@@ -1973,10 +2203,16 @@ int main (int argc, char **argv) {
     const char* redis_ip;
     int serv_port, redis_port;
     
-    unsigned char temp;
-    
     redisAsyncContext *async_context = NULL;
     redisContext *sync_context = NULL;
+    struct event *stats_event = NULL;
+    struct timeval stats_interval = { STATS_PUBLISH_INTERVAL, 0 };
+    struct timeval heartbeat_interval = { 0, LCD_HEARTBEAT_INTERVAL };
+    
+    // round trip estimate of the controller link, kept
+    // across restarts to derive the timeouts
+    to_socket_options socket_options;
+    to_rtt rtt;
     
     redisReply *sw_topics[MAX_SW_CNT];
     for(size_t i = 0; i < MAX_SW_CNT; i++) {
@@ -2020,21 +2256,60 @@ int main (int argc, char **argv) {
             return -1;
     }
         
+    if(LOG_RECORDER_OK != log_recorder_open(FLAG_KEY, serv_ip)) {
+        LOG_WARNING("Failed to open flight recorder!");
+    }
+
+    if(LOG_BINARY_ERROR == log_open_binary(FLAG_KEY, serv_ip)) {
+        LOG_WARNING("Failed to open binary log, fallback to text output!");
+    }
+
+    if(LOG_ASYNC_OK != log_async_start()) {
+        LOG_WARNING("Failed to start async logging, fallback to sync output!");
+    }
+
+    if(STATS_OK != stats_key(gs_stats_key, sizeof(gs_stats_key), FLAG_KEY, serv_ip)) {
+        LOG_ERROR("Controller address too long %s!", serv_ip);
+        return -4;
+    }
+
+    if(TO_SOCKET_OK != to_slot_key(gs_slot_key, sizeof(gs_slot_key), serv_ip, serv_port)) {
+        LOG_ERROR("Controller address too long %s!", serv_ip);
+        return -4;
+    }
+
+    to_socket_default_options(&socket_options);
+    socket_options.user_timeout = LCD_USER_TIMEOUT;
+    to_rtt_init(&rtt, &socket_options);
+
 l_start:
     // Connect to LCD controller
-    gs_socket = to_connect(serv_ip, serv_port);
+    to_rtt_options(&rtt, &socket_options);
+    gs_socket = to_connect(serv_ip, serv_port, &socket_options);
     if(0 > gs_socket) {
         LOG_ERROR("Error creating socket!");
+        if(TO_SOCKET_ERROR_CONNECT_TIMEOUT == gs_socket) {
+            to_rtt_backoff(&rtt);
+        }
         goto l_socket_cleanup;
     }
     
-    // Receive initial byte to activate keep alive of remote device
-    if(0 > to_recv(gs_socket, &temp, 1, 0)) {
-        LOG_ERROR("Error receiving initial data! %s", strerror(errno));
+    // Receive slot index to activate keep alive of remote device,
+    // it is sent right after accept so it measures the round trip
+    to_rtt_start(&rtt);
+    gs_slot = to_recv_slot(gs_socket);
+    if(0 > gs_slot) {
+        if(TO_SOCKET_ERROR_TIMEOUT == gs_slot) {
+            to_rtt_backoff(&rtt);
+        }
         goto l_socket_cleanup;
     }
+    to_rtt_stop(&rtt);
     
-    LOG_INFO("Connected to LCD controller, remote socket: %d", temp);
+    LOG_INFO("Connected to LCD controller, remote socket: %d, timeout: %lluus", gs_slot, (unsigned long long)rtt.timeout);
+    if(TO_SOCKET_OK != to_rtt_apply(&rtt, gs_socket)) {
+        goto l_socket_cleanup;
+    }
     
     LOG_INFO("Connecting to Redis...");
     sync_context = redisConnectWithTimeout(redis_ip, redis_port, timeout);
@@ -2090,6 +2365,18 @@ l_start:
 
     // prepare async calls
     base = event_base_new();
+    if(NULL == base) {
+        LOG_ERROR("Error: cannot allocate event base!");
+        goto l_free_async_redis;
+    }
+    
+    to_writer_init(&gs_writer, gs_socket);
+    gs_flush_event = evtimer_new(base, flushCallback, base);
+    if(NULL == gs_flush_event) {
+        LOG_ERROR("Error: cannot allocate flush event!");
+        goto l_free_async_redis;
+    }
+    
     if(REDIS_OK != redisLibeventAttach(async_context,base)) {
         LOG_ERROR("Error: error redis libevent attach!");
         goto l_free_async_redis;
@@ -2104,6 +2391,8 @@ l_start:
     freeReplyObject(reply);
     reply = NULL;
     
+    register_slot(sync_context);
+    
     // Subscribe changes for log_level, exit, reset
     LOG_INFO("Subscribe exit, reset, log_level, time events!");
     ASYNC_REDIS_CMD(exitCallback, NULL, "SUBSCRIBE %s/%s/%s", FLAG_KEY, serv_ip, EXIT_FLAG_VALUE);
@@ -2387,6 +2676,18 @@ l_start:
 
     }
     
+    gs_stats_context = sync_context;
+    stats_reset(&gs_flush_stats);
+    stats_event = event_new(base, -1, EV_PERSIST, publishStatsCallback, base);
+    if(NULL == stats_event || 0 != event_add(stats_event, &stats_interval)) {
+        LOG_ERROR("Failed to start stats timer!");
+        goto l_free_redis_reply;
+    }
+
+    if(TO_SOCKET_OK != to_heartbeat_start(&gs_heartbeat, base, &heartbeat_interval, LCD_HEARTBEAT_MISSES, probeLcd, lcdFailed, base)) {
+        goto l_free_redis_reply;
+    }
+
     LOG_DETAILS("Started running!");
     event_base_dispatch(base);
 
@@ -2411,6 +2712,15 @@ l_free_sw_config:
     }
         
 l_free_async_redis:
+    to_heartbeat_stop(&gs_heartbeat);
+    if(NULL != gs_flush_event) {
+        event_free(gs_flush_event);
+        gs_flush_event = NULL;
+    }
+    if(NULL != stats_event) {
+        event_free(stats_event);
+        stats_event = NULL;
+    }
     if(NULL != async_context) {
         redisAsyncFree(async_context);
         async_context = NULL;
@@ -2423,8 +2733,10 @@ l_free_async_redis:
     
 l_free_sync_redis:
     if(NULL != sync_context) {
+        release_slot(sync_context);
         redisFree(sync_context);
         sync_context = NULL;
+        gs_stats_context = NULL;
     }
     
 l_socket_cleanup:
@@ -2434,6 +2746,7 @@ l_socket_cleanup:
 l_exit:
     if(!gs_exit) {    
         LOG_ERROR("Execution failed retry!");
+        log_recorder_dump();
         sleep(1);
         goto l_start;
     }
@@ -6,37 +6,199 @@
  * 
  */
 
+#define _GNU_SOURCE
+
 #include <stdarg.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 #include "log.h"
+#include "log_record.h"
+
+/*
+ * Global variable to save current log level of each 
+ * module, exported for the inline level check in LOG_*
+ * macros
+ */
+int gs_log_levels[LOG_MODULE_COUNT] = {
+    LOG_LEVEL_ERROR, LOG_LEVEL_ERROR, LOG_LEVEL_ERROR, LOG_LEVEL_ERROR, LOG_LEVEL_ERROR
+};
+
+/*
+ * Module names in the order of LOG_MODULE_* values
+ */
+static const char* gs_log_module_names[LOG_MODULE_COUNT] = {
+    LOG_MODULE_GENERAL_NAME, 
+    LOG_MODULE_SOCKET_NAME, 
+    LOG_MODULE_REDIS_NAME, 
+    LOG_MODULE_PROTOCOL_NAME, 
+    LOG_MODULE_RENDER_NAME
+};
+
+/*
+ * One preallocated message slot of the async ring. seq
+ * follows the bounded MPMC queue scheme: seq == position
+ * means the slot is free for the producer claiming that
+ * position, seq == position + 1 means the message is
+ * ready for the writer thread.
+ */
+typedef struct {
+    unsigned long seq;
+    int len;
+    char text[LOG_ASYNC_SLOT_SIZE];
+} log_slot;
+
+/*
+ * Async ring state. Producers only touch gs_log_head and
+ * the slot they claimed, the writer thread only touches
+ * gs_log_tail, so no lock is taken on the logging path.
+ */
+static log_slot gs_log_ring[LOG_ASYNC_SLOT_COUNT];
+static unsigned long gs_log_head = 0;
+static unsigned long gs_log_tail = 0;
+static unsigned long gs_log_dropped = 0;
+
+/*
+ * Writer thread state. gs_log_async is 1 while the writer
+ * thread accepts messages. gs_log_producers counts the
+ * threads enqueueing a message right now, log_async_stop
+ * waits for them before the last drain. gs_log_stopping 
+ * is 1 until that drain finished, synchronous messages
+ * wait for it so they are not printed between queued
+ * messages.
+ */
+static pthread_t gs_log_writer;
+static int gs_log_async = 0;
+static int gs_log_running = 0;
+static int gs_log_producers = 0;
+static int gs_log_stopping = 0;
+
+/*
+ * Binary log file, when opened messages are stored as
+ * binary records instead of being printed
+ */
+static log_record_file gs_log_binary;
+static int gs_log_binary_on = 0;
+
+/*
+ * Flight recorder, keeps the latest messages up to 
+ * gs_log_recorder_threshold in a memory mapped file.
+ * gs_log_recorder_level is the threshold while the file
+ * is open and exported for the inline check in LOG_* 
+ * macros.
+ */
+static log_record_file gs_log_recorder_file;
+static uint64_t gs_log_recorder_dumped = 0;
+static int gs_log_recorder = 0;
+static int gs_log_recorder_threshold = LOG_RECORDER_DEFAULT_LEVEL;
+int gs_log_recorder_level = -1;
+
+static void log_enqueue(const char* fmt, va_list ap);
+static void log_write(const int module, const int level, int* site, const char* fmt, va_list args);
 
 /*
- * Global static variable to save current log level
+ * Convert a level name to its numberical value
+ *
+ * Return value:
+ * Level value, or LOG_SET_LEVEL_INVALID when the name
+ * is not valid
  */
-static int gs_log_level = LOG_LEVEL_ERROR;
+static int log_parse_level(const char* level, size_t len) {
+    if(strlen(LOG_LEVEL_ERROR_NAME) == len && 0 == strncmp(LOG_LEVEL_ERROR_NAME, level, len))
+	return LOG_LEVEL_ERROR;
+    else if(strlen(LOG_LEVEL_WARNING_NAME) == len && 0 == strncmp(LOG_LEVEL_WARNING_NAME, level, len))
+	return LOG_LEVEL_WARNING;
+    else if(strlen(LOG_LEVEL_INFO_NAME) == len && 0 == strncmp(LOG_LEVEL_INFO_NAME, level, len))
+	return LOG_LEVEL_INFO;
+    else if(strlen(LOG_LEVEL_DEBUG_NAME) == len && 0 == strncmp(LOG_LEVEL_DEBUG_NAME, level, len))
+	return LOG_LEVEL_DEBUG;
+    else if(strlen(LOG_LEVEL_DETAILS_NAME) == len && 0 == strncmp(LOG_LEVEL_DETAILS_NAME, level, len))
+	return LOG_LEVEL_DETAILES;
+	
+    return LOG_SET_LEVEL_INVALID;
+}
 
 /*
  * Parse the input string and convert it to an internal
- * numberical value and store it as current log level
+ * numberical value and store it as current log level.
+ * Either a single level name for all modules or a comma
+ * separated list of module=level pairs.
  */
 int log_set_level(const char* level) {
-    if(0 == strcmp(LOG_LEVEL_ERROR_NAME, level))
-	gs_log_level = LOG_LEVEL_ERROR;
-    else if(0 == strcmp(LOG_LEVEL_WARNING_NAME, level))
-	gs_log_level = LOG_LEVEL_WARNING;
-    else if(0 == strcmp(LOG_LEVEL_INFO_NAME, level))
-	gs_log_level = LOG_LEVEL_INFO;
-    else if(0 == strcmp(LOG_LEVEL_DEBUG_NAME, level))
-	gs_log_level = LOG_LEVEL_DEBUG;
-    else if(0 == strcmp(LOG_LEVEL_DETAILS_NAME, level))
-	gs_log_level = LOG_LEVEL_DETAILES;
-    else {
-	printf("Invalid log level %s\r\n", level);
-	return LOG_SET_LEVEL_INVALID;
-    }
+    int levels[LOG_MODULE_COUNT];
+    int recorder = gs_log_recorder_threshold;
+    const char* item = level;
+    const char* end;
+    const char* assign;
+    int value, i;
+    
+    memcpy(levels, gs_log_levels, sizeof(levels));
+    
+    while(1) {
+	end = strchr(item, LOG_MODULE_SEPARATOR[0]);
+	if(NULL == end) {
+	    end = item + strlen(item);
+	}
+	
+	assign = memchr(item, LOG_MODULE_ASSIGN, end - item);
+	if(NULL == assign) {
+	    // level only, apply to all modules
+	    value = log_parse_level(item, end - item);
+	    if(LOG_SET_LEVEL_INVALID == value) {
+		goto l_invalid;
+	    }
+	    
+	    for(i = 0; i < LOG_MODULE_COUNT; i++) {
+		levels[i] = value;
+	    }
+	} else {
+	    value = log_parse_level(assign + 1, end - assign - 1);
+	    if(LOG_SET_LEVEL_INVALID == value) {
+		goto l_invalid;
+	    }
+	    
+	    if(strlen(LOG_RECORDER_NAME) == (size_t)(assign - item) && 0 == strncmp(LOG_RECORDER_NAME, item, assign - item)) {
+		recorder = value;
+		goto l_next;
+	    }
+	    
+	    for(i = 0; i < LOG_MODULE_COUNT; i++) {
+		if(strlen(gs_log_module_names[i]) == (size_t)(assign - item) && 0 == strncmp(gs_log_module_names[i], item, assign - item)) {
+		    levels[i] = value;
+		    break;
+		}
+	    }
+	    
+	    if(LOG_MODULE_COUNT == i) {
+		goto l_invalid;
+	    }
+	}
 	
-    printf("Log level set to %s value %d\r\n", level, gs_log_level);
+l_next:
+	if('\0' == *end) {
+	    break;
+	}
+	item = end + 1;
+    }
+    
+    memcpy(gs_log_levels, levels, sizeof(levels));
+    gs_log_recorder_threshold = recorder;
+    if(gs_log_recorder) {
+	gs_log_recorder_level = recorder;
+    }
+    printf("Log level set to %s value", level);
+    for(i = 0; i < LOG_MODULE_COUNT; i++) {
+	printf(" %s=%d", gs_log_module_names[i], gs_log_levels[i]);
+    }
+    printf(" %s=%d\r\n", LOG_RECORDER_NAME, gs_log_recorder_threshold);
     return LOG_SET_LEVEL_OK;
+    
+l_invalid:
+    printf("Invalid log level %s\r\n", level);
+    return LOG_SET_LEVEL_INVALID;
 }
 
 /*
@@ -52,6 +214,12 @@ void log_print_level_info(void) {
     printf("%s\tShow information, warning and error. \r\n", LOG_LEVEL_INFO_NAME);
     printf("%s\tShow debug, information, warning and error. \r\n", LOG_LEVEL_DEBUG_NAME);
     printf("%s\tShow all messages. \r\n", LOG_LEVEL_DETAILS_NAME);
+    printf("Levels can be set per module with a comma separated list \r\n");
+    printf("of module=level, e.g. %s=%s%s%s=%s \r\n", 
+	    LOG_MODULE_REDIS_NAME, LOG_LEVEL_DETAILS_NAME, LOG_MODULE_SEPARATOR, LOG_MODULE_SOCKET_NAME, LOG_LEVEL_DEBUG_NAME);
+    printf("Valid modules are: %s %s %s %s %s \r\n", 
+	    LOG_MODULE_GENERAL_NAME, LOG_MODULE_SOCKET_NAME, LOG_MODULE_REDIS_NAME, LOG_MODULE_PROTOCOL_NAME, LOG_MODULE_RENDER_NAME);
+    printf("Use %s=level to set the level of the flight recorder \r\n", LOG_RECORDER_NAME);
 }
 
 /*
@@ -62,10 +230,466 @@ void log_print_level_info(void) {
 void log_with_level(const int level, const char* fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
+    log_write(LOG_MODULE_GENERAL, level, NULL, fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * Same as log_with_level but the level is checked 
+ * against the level of given module
+ */
+void log_module_with_level(const int module, const int level, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_write(module, level, NULL, fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * Same as log_module_with_level, the flight recorder 
+ * keeps the format id of the call site in site
+ */
+void log_site_with_level(int* site, const int module, const int level, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_write(module, level, site, fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * Check whether a rate limited call site can print one
+ * more message in the current second. A coarse clock is
+ * enough here and much cheaper to read.
+ */
+int log_rate_check(log_rate_limit* rl, unsigned int max, int module, int level, const char* file, int line) {
+    struct timespec now;
+    unsigned long suppressed;
+    
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if(rl->window != now.tv_sec) {
+	suppressed = rl->suppressed;
+	rl->window = now.tv_sec;
+	rl->count = 0;
+	rl->suppressed = 0;
+	
+	if(0 < suppressed) {
+	    log_module_with_level(module, level, "%s:%d suppressed %lu messages", file, line, suppressed);
+	}
+    }
+    
+    if(rl->count < max) {
+	rl->count++;
+	return 1;
+    }
+    
+    rl->suppressed++;
+    return 0;
+}
+
+/*
+ * Register the calling thread as producer when the writer
+ * thread accepts messages. The counter is raised before 
+ * gs_log_async is checked, so log_async_stop either sees
+ * the producer or the producer sees the writer stopping.
+ * 
+ * Return value:
+ * 1 when the message can be enqueued, release with 
+ * gs_log_producers afterwards, otherwise 0
+ */
+static int log_async_enter(void) {
+    if(!__atomic_load_n(&gs_log_async, __ATOMIC_ACQUIRE)) {
+	return 0;
+    }
+
+    __atomic_add_fetch(&gs_log_producers, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&gs_log_async, __ATOMIC_SEQ_CST)) {
+	return 1;
+    }
+
+    __atomic_sub_fetch(&gs_log_producers, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Wait until log_async_stop wrote the messages still 
+ * queued, so synchronous output keeps the order
+ */
+static void log_stop_wait(void) {
+    struct timespec idle = { 0, LOG_ASYNC_IDLE_US * 1000 };
+
+    while(__atomic_load_n(&gs_log_stopping, __ATOMIC_ACQUIRE)) {
+	nanosleep(&idle, NULL);
+    }
+}
+
+/*
+ * Write one message to the flight recorder when its 
+ * level allows it and, when level of the module allows 
+ * it, to the binary log or standard output. site is the
+ * format id of the call site in the recorder, or NULL.
+ * Messages without format are ignored.
+ */
+static void log_write(const int module, const int level, int* site, const char* fmt, va_list args) {
+    va_list ap;
+
+    if(NULL == fmt) {
+	return;
+    }
+
+    va_copy(ap, args);
+
+    if(level <= gs_log_recorder_level) {
+	log_record_write_site(&gs_log_recorder_file, site, level, fmt, ap);
+	va_end(ap);
+	va_copy(ap, args);
+    }
 	    
-    if(level <= gs_log_level) {
-	vprintf(fmt, ap);
-	printf("\r\n");
+    if(level <= gs_log_levels[module]) {
+	if(gs_log_binary_on) {
+	    log_record_write(&gs_log_binary, level, fmt, ap);
+	    if(level > LOG_LEVEL_ERROR) {
+		va_end(ap);
+		return;
+	    }
+	    // info and error messages are still printed
+	    va_end(ap);
+	    va_copy(ap, args);
+	}
+
+	if(log_async_enter()) {
+	    log_enqueue(fmt, ap);
+	    __atomic_sub_fetch(&gs_log_producers, 1, __ATOMIC_RELEASE);
+	} else {
+	    log_stop_wait();
+	    flockfile(stdout);
+	    vprintf(fmt, ap);
+	    printf("\r\n");
+	    funlockfile(stdout);
+	}
     }
     va_end(ap);
 }
+
+/*
+ * Format the message directly into the next free ring
+ * slot. When the ring is full the message is dropped and
+ * counted instead of waiting for the writer thread.
+ */
+static void log_enqueue(const char* fmt, va_list ap) {
+    unsigned long pos = __atomic_load_n(&gs_log_head, __ATOMIC_RELAXED);
+    log_slot* slot;
+    int len;
+
+    for(;;) {
+	slot = &gs_log_ring[pos & (LOG_ASYNC_SLOT_COUNT - 1)];
+	long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+	if(0 == diff) {
+	    if(__atomic_compare_exchange_n(&gs_log_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		break;
+	    }
+	} else if(0 > diff) {
+	    __atomic_add_fetch(&gs_log_dropped, 1, __ATOMIC_RELAXED);
+	    return;
+	} else {
+	    pos = __atomic_load_n(&gs_log_head, __ATOMIC_RELAXED);
+	}
+    }
+
+    len = vsnprintf(slot->text, LOG_ASYNC_SLOT_SIZE - 2, fmt, ap);
+    if(0 > len) {
+	len = 0;
+    } else if(LOG_ASYNC_SLOT_SIZE - 3 < len) {
+	len = LOG_ASYNC_SLOT_SIZE - 3;
+    }
+    slot->text[len++] = '\r';
+    slot->text[len++] = '\n';
+    slot->len = len;
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write all ready messages to standard output. Only called
+ * from the writer thread, or after it has been joined.
+ * 
+ * Return value:
+ * Number of messages written
+ */
+static int log_drain(void) {
+    static unsigned long reported = 0;
+    int cnt = 0;
+    unsigned long dropped;
+
+    for(;;) {
+	log_slot* slot = &gs_log_ring[gs_log_tail & (LOG_ASYNC_SLOT_COUNT - 1)];
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != gs_log_tail + 1) {
+	    break;
+	}
+
+	fwrite(slot->text, 1, slot->len, stdout);
+	__atomic_store_n(&slot->seq, gs_log_tail + LOG_ASYNC_SLOT_COUNT, __ATOMIC_RELEASE);
+	gs_log_tail++;
+	cnt++;
+    }
+
+    dropped = __atomic_load_n(&gs_log_dropped, __ATOMIC_RELAXED);
+    if(dropped != reported) {
+	printf("Log ring full, dropped %lu messages\r\n", dropped - reported);
+	reported = dropped;
+	cnt++;
+    }
+
+    if(cnt) {
+	fflush(stdout);
+    }
+
+    return cnt;
+}
+
+/*
+ * Background writer thread. Drains the ring and sleeps
+ * for LOG_ASYNC_IDLE_US when there is nothing to write.
+ */
+static void* log_writer(void* arg) {
+    struct timespec idle = { 0, LOG_ASYNC_IDLE_US * 1000 };
+    UNUSED(arg);
+
+    while(__atomic_load_n(&gs_log_running, __ATOMIC_ACQUIRE)) {
+	if(0 == log_drain()) {
+	    nanosleep(&idle, NULL);
+	}
+    }
+
+    log_drain();
+    return NULL;
+}
+
+/*
+ * Start the background writer thread. After this call
+ * log_with_level only formats into the ring buffer and
+ * never writes to standard output on the calling thread.
+ * Calling it again while running does nothing.
+ */
+int log_async_start(void) {
+    static int registered = 0;
+
+    if(gs_log_running) {
+	return LOG_ASYNC_OK;
+    }
+
+    for(unsigned long i = 0; i < LOG_ASYNC_SLOT_COUNT; i++) {
+	gs_log_ring[i].seq = gs_log_tail + i;
+    }
+    gs_log_head = gs_log_tail;
+
+    __atomic_store_n(&gs_log_running, 1, __ATOMIC_RELEASE);
+    if(0 != pthread_create(&gs_log_writer, NULL, log_writer, NULL)) {
+	gs_log_running = 0;
+	printf("Failed to start log writer thread!\r\n");
+	return LOG_ASYNC_ERROR;
+    }
+
+    if(!registered) {
+	atexit(log_async_stop);
+	registered = 1;
+    }
+
+    __atomic_store_n(&gs_log_async, 1, __ATOMIC_RELEASE);
+    return LOG_ASYNC_OK;
+}
+
+/*
+ * Wait until every message queued before this call has
+ * been written by the writer thread.
+ */
+void log_flush(void) {
+    struct timespec idle = { 0, LOG_ASYNC_IDLE_US * 1000 };
+    unsigned long head = __atomic_load_n(&gs_log_head, __ATOMIC_ACQUIRE);
+
+    while(__atomic_load_n(&gs_log_running, __ATOMIC_ACQUIRE)
+	&& (long)(head - __atomic_load_n(&gs_log_tail, __ATOMIC_ACQUIRE)) > 0) {
+	nanosleep(&idle, NULL);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Stop the writer thread after draining the ring and
+ * switch back to synchronous output. New messages are
+ * refused first and producers still enqueueing are 
+ * waited for, so no message is lost. Registered with
+ * atexit by log_async_start.
+ */
+void log_async_stop(void) {
+    struct timespec idle = { 0, LOG_ASYNC_IDLE_US * 1000 };
+
+    if(!gs_log_running) {
+	return;
+    }
+
+    __atomic_store_n(&gs_log_stopping, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&gs_log_async, 0, __ATOMIC_SEQ_CST);
+    while(0 < __atomic_load_n(&gs_log_producers, __ATOMIC_SEQ_CST)) {
+	nanosleep(&idle, NULL);
+    }
+
+    __atomic_store_n(&gs_log_running, 0, __ATOMIC_RELEASE);
+    pthread_join(gs_log_writer, NULL);
+
+    // pick up messages queued while the writer was exiting
+    log_drain();
+    __atomic_store_n(&gs_log_stopping, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Total number of messages dropped because the ring was
+ * full since the process started.
+ */
+unsigned long log_dropped_count(void) {
+    return __atomic_load_n(&gs_log_dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Switch to binary log mode when the LOG_BINARY_DIR_ENV
+ * environment variable names a directory. Messages are
+ * then stored into <dir>/<service>_<instance>.ilog which
+ * can be decoded with ihome-logcat. Only info and error 
+ * messages are still printed to standard output.
+ */
+int log_open_binary(const char* service, const char* instance) {
+    char path[512];
+    const char* dir = getenv(LOG_BINARY_DIR_ENV);
+
+    if(NULL == dir || '\0' == *dir) {
+	return LOG_BINARY_DISABLED;
+    }
+
+    if(gs_log_binary_on) {
+	return LOG_BINARY_OK;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s_%s%s", dir, service, instance, LOG_BINARY_SUFFIX);
+    if(LOG_RECORD_OK != log_record_open(&gs_log_binary, path, LOG_BINARY_RECORD_COUNT, 0)) {
+	printf("Failed to open binary log %s\r\n", path);
+	return LOG_BINARY_ERROR;
+    }
+
+    gs_log_binary_on = 1;
+    printf("Binary log enabled: %s\r\n", path);
+    return LOG_BINARY_OK;
+}
+
+/*
+ * Print messages stored in the flight recorder since 
+ * the last dump to standard error.
+ */
+void log_recorder_dump(void) {
+    if(!gs_log_recorder) {
+	return;
+    }
+
+    log_flush();
+    fprintf(stderr, "========== Flight recorder begin ==========\r\n");
+    gs_log_recorder_dumped = log_record_dump(&gs_log_recorder_file, gs_log_recorder_dumped, stderr);
+    fprintf(stderr, "========== Flight recorder end ==========\r\n");
+    fflush(stderr);
+}
+
+/*
+ * Mark the recorder file as cleanly closed so the next
+ * instance does not dump it at start. Registered with
+ * atexit by log_recorder_open.
+ */
+static void log_recorder_exit(void) {
+    if(gs_log_recorder) {
+	__atomic_or_fetch(&gs_log_recorder_file.header->flags, LOG_RECORD_FLAG_CLEAN, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Dump the recorder on fatal signals, then let the
+ * default action terminate the process. The writer 
+ * thread is not waited for, it may be the thread that
+ * crashed. Only write(2) is used and the records stay in
+ * the file for the next instance if the dump fails.
+ */
+static void log_recorder_signal(int sig) {
+    static const char begin[] = "========== Flight recorder begin ==========\r\n";
+    static const char end[] = "========== Flight recorder end ==========\r\n";
+    static const char head[] = "Fatal signal ";
+    static const char tail[] = " received!\r\n";
+    char text[64];
+    char digits[16];
+    int value = sig;
+    int len = 0;
+    int n = 0;
+
+    signal(sig, SIG_DFL);
+
+    // snprintf is not async signal safe, signal numbers are positive
+    do {
+	digits[n++] = '0' + value % 10;
+	value /= 10;
+    } while(0 < value);
+    memcpy(text, head, sizeof(head) - 1);
+    len = sizeof(head) - 1;
+    while(0 < n) {
+	text[len++] = digits[--n];
+    }
+    memcpy(text + len, tail, sizeof(tail) - 1);
+    len += sizeof(tail) - 1;
+
+    // the dump is skipped when standard error is gone
+    if(0 < len && 0 < write(STDERR_FILENO, text, len) && gs_log_recorder
+	&& 0 < write(STDERR_FILENO, begin, sizeof(begin) - 1)) {
+	log_record_dump_fd(&gs_log_recorder_file, gs_log_recorder_dumped, STDERR_FILENO);
+	len = write(STDERR_FILENO, end, sizeof(end) - 1);
+    }
+
+    raise(sig);
+}
+
+/*
+ * Open the flight recorder of a service instance. It 
+ * keeps the latest LOG_RECORDER_RECORD_COUNT messages up
+ * to the recorder level in LOG_RECORDER_DIR, regardless
+ * of the level of the modules. When the previous 
+ * instance did not exit normally, its messages are 
+ * dumped first.
+ */
+int log_recorder_open(const char* service, const char* instance) {
+    static const int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    char path[512];
+
+    if(gs_log_recorder) {
+	return LOG_RECORDER_OK;
+    }
+
+    if(NULL == instance) {
+	snprintf(path, sizeof(path), "%s/%s%s", LOG_RECORDER_DIR, service, LOG_RECORDER_SUFFIX);
+    } else {
+	snprintf(path, sizeof(path), "%s/%s_%s%s", LOG_RECORDER_DIR, service, instance, LOG_RECORDER_SUFFIX);
+    }
+
+    if(LOG_RECORD_OK != log_record_open(&gs_log_recorder_file, path, LOG_RECORDER_RECORD_COUNT, 0)) {
+	printf("Failed to open flight recorder %s\r\n", path);
+	return LOG_RECORDER_ERROR;
+    }
+
+    gs_log_recorder = 1;
+    gs_log_recorder_level = gs_log_recorder_threshold;
+    if(gs_log_recorder_file.header->flags & LOG_RECORD_FLAG_CLEAN) {
+	gs_log_recorder_dumped = gs_log_recorder_file.header->next_seq;
+    } else if(0 < gs_log_recorder_file.header->next_seq) {
+	fprintf(stderr, "Previous instance did not exit normally!\r\n");
+	log_recorder_dump();
+    }
+    gs_log_recorder_file.header->flags &= ~LOG_RECORD_FLAG_CLEAN;
+
+    for(size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+	signal(signals[i], log_recorder_signal);
+    }
+    atexit(log_recorder_exit);
+
+    return LOG_RECORDER_OK;
+}
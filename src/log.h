@@ -31,6 +31,97 @@
 #define LOG_LEVEL_DEBUG_NAME		"debug"
 #define LOG_LEVEL_DETAILS_NAME		"details"
 
+/*
+ * Log modules, each module has its own runtime log level
+ * so one subsystem can be debugged without flooding the
+ * output with messages of the others. Source files set
+ * LOG_DEFAULT_MODULE before including log.h to change
+ * the module used by LOG_* macros, single messages can
+ * use LOGM_* macros with an explicit module.
+ * 
+ * A log level value of "details" sets all modules, a 
+ * comma separated list like "redis=details,socket=debug"
+ * sets the listed modules only. "recorder=<level>" sets
+ * the level of the flight recorder, which is not changed
+ * by a single level name.
+ */
+#define LOG_MODULE_GENERAL			0
+#define LOG_MODULE_SOCKET			1
+#define LOG_MODULE_REDIS			2
+#define LOG_MODULE_PROTOCOL			3
+#define LOG_MODULE_RENDER			4
+#define LOG_MODULE_COUNT			5
+
+#define LOG_MODULE_GENERAL_NAME		"general"
+#define LOG_MODULE_SOCKET_NAME		"socket"
+#define LOG_MODULE_REDIS_NAME		"redis"
+#define LOG_MODULE_PROTOCOL_NAME	"protocol"
+#define LOG_MODULE_RENDER_NAME		"render"
+
+#define LOG_MODULE_SEPARATOR		","
+#define LOG_MODULE_ASSIGN			'='
+
+/*
+ * Return value for log_async_start
+ */
+#define LOG_ASYNC_OK				0
+#define LOG_ASYNC_ERROR				-1
+
+/*
+ * Async ring configuration. The slot count must be a
+ * power of 2. Messages longer than the slot size are
+ * truncated. The writer thread sleeps LOG_ASYNC_IDLE_US
+ * micro seconds when the ring is empty.
+ */
+#define LOG_ASYNC_SLOT_COUNT		1024
+#define LOG_ASYNC_SLOT_SIZE			256
+#define LOG_ASYNC_IDLE_US			5000
+
+/*
+ * Return value for log_open_binary
+ */
+#define LOG_BINARY_OK				0
+#define LOG_BINARY_DISABLED			1
+#define LOG_BINARY_ERROR			-1
+
+/*
+ * Binary log mode is enabled when this environment 
+ * variable is set to a directory. Each file keeps the
+ * latest LOG_BINARY_RECORD_COUNT messages.
+ */
+#define LOG_BINARY_DIR_ENV			"IHOME_LOG_BINARY_DIR"
+#define LOG_BINARY_SUFFIX			".ilog"
+#define LOG_BINARY_RECORD_COUNT		131072
+
+/*
+ * Return value for log_recorder_open
+ */
+#define LOG_RECORDER_OK				0
+#define LOG_RECORDER_ERROR			-1
+
+/*
+ * Flight recorder files are kept in shared memory so 
+ * they survive process restarts but cost no disk I/O.
+ */
+#define LOG_RECORDER_DIR			"/dev/shm"
+#define LOG_RECORDER_SUFFIX			".ihome_rec"
+#define LOG_RECORDER_RECORD_COUNT	4096
+
+/*
+ * Name used in log level values to set the level of the
+ * flight recorder and its level when nothing is set. 
+ * Details are not recorded by default as they are 
+ * logged from the hot paths.
+ */
+#define LOG_RECORDER_NAME			"recorder"
+#define LOG_RECORDER_DEFAULT_LEVEL	LOG_LEVEL_DEBUG
+
+/*
+ * Initial value of the format id kept by each LOG_* call
+ * site, the id is looked up on the first recorded call
+ */
+#define LOG_SITE_UNKNOWN			-1
+
 /*
  * Numberical values for different log values. lower value
  * means higher priority.
@@ -82,7 +173,10 @@
 
 /*
  * Parse the input string and convert it to an internal
- * numberical value and store it as current log level
+ * numberical value and store it as current log level.
+ * Either a single level name for all modules or a comma
+ * separated list of module=level pairs. Nothing is 
+ * changed when any part of the input is invalid.
  */
 int log_set_level(const char* level);
 
@@ -101,15 +195,238 @@ void log_print_level_info(void);
  */
 void log_with_level(const int level, const char* fmt, ...);
 
+/*
+ * Same as log_with_level but the level is checked 
+ * against the level of given module
+ */
+void log_module_with_level(const int module, const int level, const char* fmt, ...);
+
+/*
+ * Same as log_module_with_level, used by the LOG_* 
+ * macros. site points to the static format id of the 
+ * call site, so the flight recorder looks up the format
+ * only once. fmt must be a string literal.
+ */
+void log_site_with_level(int* site, const int module, const int level, const char* fmt, ...);
+
+/*
+ * State of one rate limited log call site, defined as a
+ * static variable by the LOG_*_RL macros
+ */
+typedef struct {
+    long window;
+    unsigned int count;
+    unsigned long suppressed;
+} log_rate_limit;
+
+/*
+ * Check whether a rate limited call site can print one
+ * more message in the current second. When a new second
+ * starts and messages were suppressed in the previous
+ * ones, a summary with the suppressed count is printed
+ * first.
+ * 
+ * Parameters:
+ * log_rate_limit* rl       State of the call site
+ * unsigned int max         Maximum messages per second
+ * int module               Module of the call site
+ * int level                Level of the call site
+ * const char* file         Source file of the call site
+ * int line                 Source line of the call site
+ * 
+ * Return value:
+ * 1 when the message can be printed, otherwise 0
+ */
+int log_rate_check(log_rate_limit* rl, unsigned int max, int module, int level, const char* file, int line);
+
+/*
+ * Start a background writer thread, after that messages
+ * are formatted into a preallocated lock free ring and 
+ * written to standard output by the writer thread. When
+ * the ring is full new messages are dropped and counted
+ * so logging never blocks the caller. 
+ * 
+ * The ring is flushed automatically on normal exit.
+ */
+int log_async_start(void);
+
+/*
+ * Stop the writer thread after all queued messages are
+ * written and switch back to synchronous output.
+ */
+void log_async_stop(void);
+
+/*
+ * Block until all messages queued so far are written.
+ */
+void log_flush(void);
+
+/*
+ * Total count of messages dropped because the ring was
+ * full.
+ */
+unsigned long log_dropped_count(void);
+
+/*
+ * Store messages as binary records (format string id, 
+ * timestamp and raw argument values) into a memory 
+ * mapped file instead of formatting them. This is 
+ * enabled only when LOG_BINARY_DIR_ENV is set. The file
+ * can be decoded with ihome-logcat.
+ * 
+ * Parameters:
+ * const char* service      Name of the micro service
+ * const char* instance     Instance name, e.g. controller
+ *                          IP address
+ * 
+ * Return value:
+ * LOG_BINARY_OK when enabled, LOG_BINARY_DISABLED when
+ * the environment variable is not set, LOG_BINARY_ERROR 
+ * when the file can not be opened
+ */
+int log_open_binary(const char* service, const char* instance);
+
+/*
+ * Open the always on flight recorder. It keeps the last
+ * LOG_RECORDER_RECORD_COUNT messages up to its own level
+ * (LOG_RECORDER_DEFAULT_LEVEL unless set with 
+ * "recorder=<level>"), including those filtered by the 
+ * level of the module, in a memory mapped ring per 
+ * service instance. Recording a message only copies the
+ * raw arguments.
+ * 
+ * When the previous instance crashed, its messages are
+ * printed to standard error first. The recorder is also
+ * dumped on fatal signals.
+ * 
+ * Parameters:
+ * const char* service      Name of the micro service
+ * const char* instance     Instance name, e.g. controller
+ *                          IP address, NULL when there is
+ *                          only one instance
+ * 
+ * Return value:
+ * LOG_RECORDER_OK when successful, otherwise
+ * LOG_RECORDER_ERROR
+ */
+int log_recorder_open(const char* service, const char* instance);
+
+/*
+ * Print messages recorded since the last dump to 
+ * standard error. Used when a micro service restarts
+ * after a failure.
+ */
+void log_recorder_dump(void);
+
+/*
+ * Current level of the flight recorder, -1 while it is
+ * closed. It is exported only for the inline check in 
+ * LOG_* macros, use log_set_level to change it.
+ */
+extern int gs_log_recorder_level;
+
+/*
+ * Current runtime log level of each module, set by 
+ * log_set_level. It is exported only so the LOG_* macros
+ * can check the level inline, use log_set_level to 
+ * change it.
+ */
+extern int gs_log_levels[LOG_MODULE_COUNT];
+
+/*
+ * Compile time minimum log level. Messages with a level
+ * value greater than LOG_MIN_LEVEL are removed by the 
+ * compiler together with their arguments. Default keeps
+ * all levels, production builds can pass e.g.
+ * -DLOG_MIN_LEVEL=LOG_LEVEL_WARNING through the Makefile.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL				LOG_LEVEL_DETAILES
+#endif
+
+/*
+ * Module used by LOG_* macros in current source file
+ */
+#ifndef LOG_DEFAULT_MODULE
+#define LOG_DEFAULT_MODULE			LOG_MODULE_GENERAL
+#endif
+
+/*
+ * Check whether a message of given level will be printed.
+ * Can be used to skip code that only prepares log output.
+ */
+#define LOGM_ENABLED(module, level)	((level) <= LOG_MIN_LEVEL && (level) <= gs_log_levels[module])
+#define LOG_ENABLED(level)			LOGM_ENABLED(LOG_DEFAULT_MODULE, level)
+
+/*
+ * The level is checked before any argument is evaluated
+ * so filtered messages cost a compare and a branch only.
+ * Messages above the level of the module but within the
+ * level of the flight recorder are only recorded. Each
+ * call site keeps the format id for the recorder in a 
+ * static variable, so the format must be a literal.
+ */
+#define LOGM_WITH_LEVEL(module, level, fmt, ...)	do {\
+											if((level) <= LOG_MIN_LEVEL && ((level) <= gs_log_levels[module] || (level) <= gs_log_recorder_level)) {\
+												static int log_fmt_site = LOG_SITE_UNKNOWN;\
+												log_site_with_level(&log_fmt_site, module, level, "" fmt, ##__VA_ARGS__);\
+											}\
+										} while(0)
+
+/*
+ * Rate limited version, at most max messages per second
+ * are passed on from one call site. Suppressed messages 
+ * are only counted, the count is logged once the next
+ * second starts. The limit applies to the flight 
+ * recorder as well, whether the level is enabled or not:
+ * suppressed messages are neither printed nor recorded,
+ * only their count is, so a hot call site cannot flush
+ * the recorder ring.
+ */
+#define LOGM_WITH_LEVEL_RL(module, level, max, fmt, ...)	do {\
+											if((level) <= LOG_MIN_LEVEL && ((level) <= gs_log_levels[module] || (level) <= gs_log_recorder_level)) {\
+												static log_rate_limit log_rl_site;\
+												static int log_fmt_site = LOG_SITE_UNKNOWN;\
+												if(log_rate_check(&log_rl_site, max, module, level, __FILE__, __LINE__)) {\
+													log_site_with_level(&log_fmt_site, module, level, "" fmt, ##__VA_ARGS__);\
+												}\
+											}\
+										} while(0)
+
 /*
  * Below is used in app code to provider better readability
  * The usage is similiar with printf except it automatically
  * filter messages according to log level
  */
-#define LOG_ERROR(fmt, ...)		log_with_level(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__);
-#define LOG_WARNING(fmt, ...)	log_with_level(LOG_LEVEL_WARNING, fmt, ##__VA_ARGS__);
-#define LOG_INFO(fmt, ...)		log_with_level(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__);
-#define LOG_DEBUG(fmt, ...)		log_with_level(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__);
-#define LOG_DETAILS(fmt, ...)	log_with_level(LOG_LEVEL_DETAILES, fmt, ##__VA_ARGS__);
+#define LOG_ERROR(fmt, ...)		LOGM_WITH_LEVEL(LOG_DEFAULT_MODULE, LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__);
+#define LOG_WARNING(fmt, ...)	LOGM_WITH_LEVEL(LOG_DEFAULT_MODULE, LOG_LEVEL_WARNING, fmt, ##__VA_ARGS__);
+#define LOG_INFO(fmt, ...)		LOGM_WITH_LEVEL(LOG_DEFAULT_MODULE, LOG_LEVEL_INFO, fmt, ##__VA_ARGS__);
+#define LOG_DEBUG(fmt, ...)		LOGM_WITH_LEVEL(LOG_DEFAULT_MODULE, LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__);
+#define LOG_DETAILS(fmt, ...)	LOGM_WITH_LEVEL(LOG_DEFAULT_MODULE, LOG_LEVEL_DETAILES, fmt, ##__VA_ARGS__);
+
+/*
+ * Same as above with an explicit module
+ */
+#define LOGM_ERROR(module, fmt, ...)	LOGM_WITH_LEVEL(module, LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__);
+#define LOGM_WARNING(module, fmt, ...)	LOGM_WITH_LEVEL(module, LOG_LEVEL_WARNING, fmt, ##__VA_ARGS__);
+#define LOGM_INFO(module, fmt, ...)		LOGM_WITH_LEVEL(module, LOG_LEVEL_INFO, fmt, ##__VA_ARGS__);
+#define LOGM_DEBUG(module, fmt, ...)	LOGM_WITH_LEVEL(module, LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__);
+#define LOGM_DETAILS(module, fmt, ...)	LOGM_WITH_LEVEL(module, LOG_LEVEL_DETAILES, fmt, ##__VA_ARGS__);
+
+/*
+ * Rate limited versions, print at most max messages per
+ * second from one call site
+ */
+#define LOG_ERROR_RL(max, fmt, ...)		LOGM_WITH_LEVEL_RL(LOG_DEFAULT_MODULE, LOG_LEVEL_ERROR, max, fmt, ##__VA_ARGS__);
+#define LOG_WARNING_RL(max, fmt, ...)	LOGM_WITH_LEVEL_RL(LOG_DEFAULT_MODULE, LOG_LEVEL_WARNING, max, fmt, ##__VA_ARGS__);
+#define LOG_INFO_RL(max, fmt, ...)		LOGM_WITH_LEVEL_RL(LOG_DEFAULT_MODULE, LOG_LEVEL_INFO, max, fmt, ##__VA_ARGS__);
+#define LOG_DEBUG_RL(max, fmt, ...)		LOGM_WITH_LEVEL_RL(LOG_DEFAULT_MODULE, LOG_LEVEL_DEBUG, max, fmt, ##__VA_ARGS__);
+#define LOG_DETAILS_RL(max, fmt, ...)	LOGM_WITH_LEVEL_RL(LOG_DEFAULT_MODULE, LOG_LEVEL_DETAILES, max, fmt, ##__VA_ARGS__);
+
+#define LOGM_ERROR_RL(module, max, fmt, ...)	LOGM_WITH_LEVEL_RL(module, LOG_LEVEL_ERROR, max, fmt, ##__VA_ARGS__);
+#define LOGM_WARNING_RL(module, max, fmt, ...)	LOGM_WITH_LEVEL_RL(module, LOG_LEVEL_WARNING, max, fmt, ##__VA_ARGS__);
+#define LOGM_INFO_RL(module, max, fmt, ...)		LOGM_WITH_LEVEL_RL(module, LOG_LEVEL_INFO, max, fmt, ##__VA_ARGS__);
+#define LOGM_DEBUG_RL(module, max, fmt, ...)	LOGM_WITH_LEVEL_RL(module, LOG_LEVEL_DEBUG, max, fmt, ##__VA_ARGS__);
+#define LOGM_DETAILS_RL(module, max, fmt, ...)	LOGM_WITH_LEVEL_RL(module, LOG_LEVEL_DETAILES, max, fmt, ##__VA_ARGS__);
 
 #endif
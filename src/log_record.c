@@ -0,0 +1,1242 @@
+/*
+ * Copyright lzh88998 and distributed under Apache 2.0 license
+ *
+ * log_record stores log messages in binary format into a
+ * memory mapped file. Instead of formatting the message,
+ * only the format string id, a timestamp and the raw
+ * argument values are copied.
+ *
+ * Note: log_record must not call LOG_* macros as it is
+ * called from log_with_level.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "log_record.h"
+
+/*
+ * Buffer sizes of the signal safe formatter, digits of a
+ * 64 bit value in octal and the text of one conversion
+ */
+#define LOG_SAFE_DIGITS				24
+#define LOG_SAFE_BODY_SIZE			64
+
+/*
+ * printf length modifiers, used to fetch arguments with
+ * the correct type from va_list
+ */
+#define LOG_SPEC_LEN_NONE			0
+#define LOG_SPEC_LEN_HH				1
+#define LOG_SPEC_LEN_H				2
+#define LOG_SPEC_LEN_L				3
+#define LOG_SPEC_LEN_LL				4
+#define LOG_SPEC_LEN_Z				5
+#define LOG_SPEC_LEN_J				6
+#define LOG_SPEC_LEN_T				7
+#define LOG_SPEC_LEN_LD				8
+
+/*
+ * One parsed printf conversion specification
+ */
+typedef struct {
+    const char* flags;
+    int flags_len;
+    const char* width;
+    int width_len;
+    int width_star;
+    int has_precision;
+    const char* precision;
+    int precision_len;
+    int precision_star;
+    int length;
+    char conversion;
+} log_spec;
+
+/*
+ * Parse one conversion specification. p points to the
+ * character after '%'.
+ *
+ * Return value:
+ * Pointer to the character after the conversion
+ */
+static const char* log_spec_parse(const char* p, log_spec* s) {
+    memset(s, 0, sizeof(log_spec));
+
+    s->flags = p;
+    while('-' == *p || '+' == *p || ' ' == *p || '#' == *p || '0' == *p) {
+        p++;
+    }
+    s->flags_len = p - s->flags;
+
+    s->width = p;
+    if('*' == *p) {
+        s->width_star = 1;
+        p++;
+    } else {
+        while('0' <= *p && *p <= '9') {
+            p++;
+        }
+    }
+    s->width_len = p - s->width;
+
+    if('.' == *p) {
+        p++;
+        s->has_precision = 1;
+        s->precision = p;
+        if('*' == *p) {
+            s->precision_star = 1;
+            p++;
+        } else {
+            while('0' <= *p && *p <= '9') {
+                p++;
+            }
+        }
+        s->precision_len = p - s->precision;
+    }
+
+    switch(*p) {
+        case 'h':
+            p++;
+            s->length = LOG_SPEC_LEN_H;
+            if('h' == *p) {
+                p++;
+                s->length = LOG_SPEC_LEN_HH;
+            }
+            break;
+        case 'l':
+            p++;
+            s->length = LOG_SPEC_LEN_L;
+            if('l' == *p) {
+                p++;
+                s->length = LOG_SPEC_LEN_LL;
+            }
+            break;
+        case 'z':
+            p++;
+            s->length = LOG_SPEC_LEN_Z;
+            break;
+        case 'j':
+            p++;
+            s->length = LOG_SPEC_LEN_J;
+            break;
+        case 't':
+            p++;
+            s->length = LOG_SPEC_LEN_T;
+            break;
+        case 'L':
+            p++;
+            s->length = LOG_SPEC_LEN_LD;
+            break;
+    }
+
+    s->conversion = *p;
+    if('\0' != *p) {
+        p++;
+    }
+
+    return p;
+}
+
+/*
+ * Append raw bytes to the payload
+ *
+ * Return value:
+ * 0 when successful, -1 when there is no space left
+ */
+static int log_payload_put(log_record* r, const void* v, size_t len) {
+    if(r->len + len > LOG_RECORD_PAYLOAD_SIZE) {
+        return -1;
+    }
+
+    memcpy(r->payload + r->len, v, len);
+    r->len += len;
+    return 0;
+}
+
+/*
+ * Read raw bytes from the payload
+ *
+ * Return value:
+ * 0 when successful, -1 when the payload is exhausted
+ */
+static int log_payload_get(const log_record* r, size_t* pos, void* v, size_t len) {
+    if(*pos + len > r->len) {
+        return -1;
+    }
+
+    memcpy(v, r->payload + *pos, len);
+    *pos += len;
+    return 0;
+}
+
+/*
+ * Copy the argument values of fmt into the payload of r
+ *
+ * Return value:
+ * 0 when all arguments are copied, -1 when truncated
+ */
+static int log_payload_encode(log_record* r, const char* fmt, va_list ap) {
+    const char* p = fmt;
+    log_spec s;
+
+    while(*p) {
+        if('%' != *p++) {
+            continue;
+        }
+
+        if('%' == *p) {
+            p++;
+            continue;
+        }
+
+        p = log_spec_parse(p, &s);
+
+        if(s.width_star) {
+            int v = va_arg(ap, int);
+            if(0 > log_payload_put(r, &v, sizeof(v)))
+                return -1;
+        }
+
+        if(s.precision_star) {
+            int v = va_arg(ap, int);
+            if(0 > log_payload_put(r, &v, sizeof(v)))
+                return -1;
+        }
+
+        switch(s.conversion) {
+            case 'd':
+            case 'i': {
+                long long v;
+                switch(s.length) {
+                    case LOG_SPEC_LEN_L:    v = va_arg(ap, long); break;
+                    case LOG_SPEC_LEN_LL:   v = va_arg(ap, long long); break;
+                    case LOG_SPEC_LEN_Z:    v = va_arg(ap, ssize_t); break;
+                    case LOG_SPEC_LEN_J:    v = va_arg(ap, intmax_t); break;
+                    case LOG_SPEC_LEN_T:    v = va_arg(ap, ptrdiff_t); break;
+                    case LOG_SPEC_LEN_HH:   v = (signed char)va_arg(ap, int); break;
+                    case LOG_SPEC_LEN_H:    v = (short)va_arg(ap, int); break;
+                    default:                v = va_arg(ap, int); break;
+                }
+                if(0 > log_payload_put(r, &v, sizeof(v)))
+                    return -1;
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X': {
+                unsigned long long v;
+                switch(s.length) {
+                    case LOG_SPEC_LEN_L:    v = va_arg(ap, unsigned long); break;
+                    case LOG_SPEC_LEN_LL:   v = va_arg(ap, unsigned long long); break;
+                    case LOG_SPEC_LEN_Z:    v = va_arg(ap, size_t); break;
+                    case LOG_SPEC_LEN_J:    v = va_arg(ap, uintmax_t); break;
+                    case LOG_SPEC_LEN_T:    v = va_arg(ap, ptrdiff_t); break;
+                    case LOG_SPEC_LEN_HH:   v = (unsigned char)va_arg(ap, unsigned int); break;
+                    case LOG_SPEC_LEN_H:    v = (unsigned short)va_arg(ap, unsigned int); break;
+                    default:                v = va_arg(ap, unsigned int); break;
+                }
+                if(0 > log_payload_put(r, &v, sizeof(v)))
+                    return -1;
+                break;
+            }
+            case 'c': {
+                int v = va_arg(ap, int);
+                if(0 > log_payload_put(r, &v, sizeof(v)))
+                    return -1;
+                break;
+            }
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                double v;
+                if(LOG_SPEC_LEN_LD == s.length) {
+                    v = (double)va_arg(ap, long double);
+                } else {
+                    v = va_arg(ap, double);
+                }
+                if(0 > log_payload_put(r, &v, sizeof(v)))
+                    return -1;
+                break;
+            }
+            case 'p': {
+                uint64_t v = (uintptr_t)va_arg(ap, void*);
+                if(0 > log_payload_put(r, &v, sizeof(v)))
+                    return -1;
+                break;
+            }
+            case 's': {
+                const char* v = va_arg(ap, const char*);
+                size_t len;
+                unsigned char l;
+
+                if(NULL == v) {
+                    v = "(null)";
+                }
+
+                len = strlen(v);
+                if(len > 255) {
+                    len = 255;
+                }
+                if(r->len + 1 + len > LOG_RECORD_PAYLOAD_SIZE) {
+                    // keep as much of the string as possible
+                    if(r->len + 1 >= LOG_RECORD_PAYLOAD_SIZE) {
+                        return -1;
+                    }
+                    len = LOG_RECORD_PAYLOAD_SIZE - r->len - 1;
+                    l = len;
+                    log_payload_put(r, &l, 1);
+                    log_payload_put(r, v, len);
+                    return -1;
+                }
+                l = len;
+                log_payload_put(r, &l, 1);
+                log_payload_put(r, v, len);
+                break;
+            }
+            case 'n':
+                // never write through %n, just skip the argument
+                va_arg(ap, void*);
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Append formatted text to buf while keeping track of
+ * the used length
+ */
+static void log_text_append(char* buf, size_t len, size_t* used, const char* fmt, ...) {
+    va_list ap;
+    int ret;
+
+    if(*used + 1 >= len) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    ret = vsnprintf(buf + *used, len - *used, fmt, ap);
+    va_end(ap);
+
+    if(0 < ret) {
+        *used += ret;
+        if(*used >= len) {
+            *used = len - 1;
+        }
+    }
+}
+
+/*
+ * Format the message of one record as text
+ *
+ * Return value:
+ * Length of the text written to buf
+ */
+int log_record_format(const log_record_file* f, const log_record* r, char* buf, size_t len) {
+    const char* fmt;
+    const char* p;
+    size_t used = 0;
+    size_t pos = 0;
+    log_spec s;
+
+    if(0 == len) {
+        return 0;
+    }
+    buf[0] = '\0';
+
+    if(r->format_id >= f->header->format_count || r->format_id >= LOG_RECORD_MAX_FORMATS) {
+        log_text_append(buf, len, &used, "<unknown format %u>", r->format_id);
+        return used;
+    }
+
+    fmt = f->header->strings + f->header->format_offset[r->format_id];
+    p = fmt;
+    while(*p) {
+        const char* literal = p;
+        char spec[64];
+        int spec_len = 0;
+        int width = 0;
+        int precision = 0;
+
+        while(*p && '%' != *p) {
+            p++;
+        }
+        log_text_append(buf, len, &used, "%.*s", (int)(p - literal), literal);
+
+        if('\0' == *p) {
+            break;
+        }
+
+        p++;
+        if('%' == *p) {
+            log_text_append(buf, len, &used, "%%");
+            p++;
+            continue;
+        }
+
+        p = log_spec_parse(p, &s);
+
+        if((s.width_star && 0 > log_payload_get(r, &pos, &width, sizeof(width)))
+            || (s.precision_star && 0 > log_payload_get(r, &pos, &precision, sizeof(precision)))) {
+            log_text_append(buf, len, &used, "<truncated>");
+            return used;
+        }
+
+        // rebuild the conversion with explicit width and precision
+        spec_len = snprintf(spec, sizeof(spec), "%%%.*s", s.flags_len, s.flags);
+        if(s.width_star) {
+            spec_len += snprintf(spec + spec_len, sizeof(spec) - spec_len, "%d", width);
+        } else {
+            spec_len += snprintf(spec + spec_len, sizeof(spec) - spec_len, "%.*s", s.width_len, s.width);
+        }
+        if(s.has_precision) {
+            if(s.precision_star) {
+                spec_len += snprintf(spec + spec_len, sizeof(spec) - spec_len, ".%d", precision);
+            } else {
+                spec_len += snprintf(spec + spec_len, sizeof(spec) - spec_len, ".%.*s", s.precision_len, s.precision);
+            }
+        }
+        if(spec_len > (int)sizeof(spec) - 4) {
+            log_text_append(buf, len, &used, "<invalid>");
+            return used;
+        }
+
+        switch(s.conversion) {
+            case 'd':
+            case 'i': {
+                long long v;
+                if(0 > log_payload_get(r, &pos, &v, sizeof(v)))
+                    goto l_truncated;
+                snprintf(spec + spec_len, sizeof(spec) - spec_len, "ll%c", s.conversion);
+                log_text_append(buf, len, &used, spec, v);
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X': {
+                unsigned long long v;
+                if(0 > log_payload_get(r, &pos, &v, sizeof(v)))
+                    goto l_truncated;
+                snprintf(spec + spec_len, sizeof(spec) - spec_len, "ll%c", s.conversion);
+                log_text_append(buf, len, &used, spec, v);
+                break;
+            }
+            case 'c': {
+                int v;
+                if(0 > log_payload_get(r, &pos, &v, sizeof(v)))
+                    goto l_truncated;
+                snprintf(spec + spec_len, sizeof(spec) - spec_len, "c");
+                log_text_append(buf, len, &used, spec, v);
+                break;
+            }
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                double v;
+                if(0 > log_payload_get(r, &pos, &v, sizeof(v)))
+                    goto l_truncated;
+                snprintf(spec + spec_len, sizeof(spec) - spec_len, "%c", s.conversion);
+                log_text_append(buf, len, &used, spec, v);
+                break;
+            }
+            case 'p': {
+                uint64_t v;
+                if(0 > log_payload_get(r, &pos, &v, sizeof(v)))
+                    goto l_truncated;
+                snprintf(spec + spec_len, sizeof(spec) - spec_len, "p");
+                log_text_append(buf, len, &used, spec, (void*)(uintptr_t)v);
+                break;
+            }
+            case 's': {
+                unsigned char l;
+                char v[256];
+                if(0 > log_payload_get(r, &pos, &l, 1))
+                    goto l_truncated;
+                if(0 > log_payload_get(r, &pos, v, l))
+                    goto l_truncated;
+                v[l] = '\0';
+                snprintf(spec + spec_len, sizeof(spec) - spec_len, "s");
+                log_text_append(buf, len, &used, spec, v);
+                break;
+            }
+            case 'n':
+                break;
+            default:
+                goto l_truncated;
+        }
+    }
+
+    return used;
+
+l_truncated:
+    log_text_append(buf, len, &used, "<truncated>");
+    return used;
+}
+
+/*
+ * Below helpers format text with plain loops instead of
+ * stdio, so they can be used from fatal signal handlers.
+ * Output is truncated at len - 1 characters and always
+ * terminated.
+ */
+static void log_safe_put(char* buf, size_t len, size_t* used, const char* s, size_t n) {
+    while(0 < n-- && *used + 1 < len) {
+        buf[(*used)++] = *s++;
+    }
+    buf[*used] = '\0';
+}
+
+static void log_safe_pad(char* buf, size_t len, size_t* used, char c, int n) {
+    while(0 < n--) {
+        log_safe_put(buf, len, used, &c, 1);
+    }
+}
+
+/*
+ * Convert v to at least min_digits digits
+ *
+ * Return value:
+ * Number of digits written to digits
+ */
+static int log_safe_digits(char* digits, unsigned long long v, unsigned int base, int upper, int min_digits) {
+    const char* set = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[LOG_SAFE_DIGITS];
+    int n = 0;
+
+    while((0 < v || n < min_digits) && n < LOG_SAFE_DIGITS) {
+        tmp[n++] = set[v % base];
+        v /= base;
+    }
+
+    for(int i = 0; i < n; i++) {
+        digits[i] = tmp[n - 1 - i];
+    }
+    return n;
+}
+
+/*
+ * Write prefix and body padded to width according to the
+ * '-' and '0' flags
+ */
+static void log_safe_field(char* buf, size_t len, size_t* used, const char* flags, int width, const char* prefix, const char* body, size_t body_len) {
+    size_t prefix_len = strlen(prefix);
+    int pad = width - (int)(prefix_len + body_len);
+    int left = NULL != memchr(flags, '-', strlen(flags));
+    int zero = !left && NULL != memchr(flags, '0', strlen(flags));
+
+    if(!left && !zero) {
+        log_safe_pad(buf, len, used, ' ', pad);
+    }
+    log_safe_put(buf, len, used, prefix, prefix_len);
+    if(zero) {
+        log_safe_pad(buf, len, used, '0', pad);
+    }
+    log_safe_put(buf, len, used, body, body_len);
+    if(left) {
+        log_safe_pad(buf, len, used, ' ', pad);
+    }
+}
+
+/*
+ * Format v with precision fraction digits, or with an
+ * exponent when exp_form is set. Values that do not fit
+ * into 64 bit integers always use the exponent form.
+ *
+ * Return value:
+ * Number of characters written to out
+ */
+static int log_safe_double(char* out, double v, int precision, int exp_form, int upper) {
+    unsigned long long scale = 1;
+    unsigned long long ip, frac;
+    int n = 0;
+    int e = 0;
+
+    if(precision > 17) {
+        precision = 17;
+    }
+    for(int i = 0; i < precision; i++) {
+        scale *= 10;
+    }
+
+    if(exp_form || v >= 1e19) {
+        exp_form = 1;
+        while(v >= 10) {
+            v /= 10;
+            e++;
+        }
+        while(0 < v && v < 1) {
+            v *= 10;
+            e--;
+        }
+    }
+
+    ip = (unsigned long long)v;
+    frac = (unsigned long long)((v - ip) * scale + 0.5);
+    if(frac >= scale) {
+        ip++;
+        frac -= scale;
+    }
+    if(exp_form && 10 <= ip) {
+        ip = 1;
+        e++;
+    }
+
+    n += log_safe_digits(out + n, ip, 10, 0, 1);
+    if(0 < precision) {
+        out[n++] = '.';
+        n += log_safe_digits(out + n, frac, 10, 0, precision);
+    }
+
+    if(exp_form) {
+        out[n++] = upper ? 'E' : 'e';
+        out[n++] = 0 > e ? '-' : '+';
+        n += log_safe_digits(out + n, 0 > e ? -e : e, 10, 0, 2);
+    }
+
+    return n;
+}
+
+/*
+ * Same as log_record_format, but only uses the helpers
+ * above. Floating point values are printed with %f or 
+ * %e rules only (%g and %a fall back to them).
+ *
+ * Return value:
+ * Length of the text written to buf
+ */
+static int log_record_format_safe(const log_record_file* f, const log_record* r, char* buf, size_t len) {
+    const char* fmt;
+    const char* p;
+    size_t used = 0;
+    size_t pos = 0;
+    log_spec s;
+
+    if(0 == len) {
+        return 0;
+    }
+    buf[0] = '\0';
+
+    if(r->format_id >= f->header->format_count || r->format_id >= LOG_RECORD_MAX_FORMATS) {
+        log_safe_put(buf, len, &used, "<unknown format>", 16);
+        return used;
+    }
+
+    fmt = f->header->strings + f->header->format_offset[r->format_id];
+    p = fmt;
+    while(*p) {
+        const char* literal = p;
+        char flags[8];
+        char body[LOG_SAFE_BODY_SIZE];
+        const char* prefix = "";
+        int width = 0;
+        int precision = -1;
+        int n = 0;
+
+        while(*p && '%' != *p) {
+            p++;
+        }
+        log_safe_put(buf, len, &used, literal, p - literal);
+
+        if('\0' == *p) {
+            break;
+        }
+
+        p++;
+        if('%' == *p) {
+            log_safe_put(buf, len, &used, "%", 1);
+            p++;
+            continue;
+        }
+
+        p = log_spec_parse(p, &s);
+
+        if((s.width_star && 0 > log_payload_get(r, &pos, &width, sizeof(width)))
+            || (s.precision_star && 0 > log_payload_get(r, &pos, &precision, sizeof(precision)))) {
+            goto l_truncated;
+        }
+        if(!s.width_star) {
+            for(int i = 0; i < s.width_len; i++) {
+                width = width * 10 + s.width[i] - '0';
+            }
+        }
+        if(s.has_precision && !s.precision_star) {
+            precision = 0;
+            for(int i = 0; i < s.precision_len; i++) {
+                precision = precision * 10 + s.precision[i] - '0';
+            }
+        }
+        if(0 > width) {
+            width = 0;
+        }
+        if(width > LOG_SAFE_BODY_SIZE) {
+            width = LOG_SAFE_BODY_SIZE;
+        }
+        if(precision > LOG_SAFE_BODY_SIZE - 4) {
+            precision = LOG_SAFE_BODY_SIZE - 4;
+        }
+
+        n = s.flags_len < (int)sizeof(flags) - 1 ? s.flags_len : (int)sizeof(flags) - 1;
+        memcpy(flags, s.flags, n);
+        flags[n] = '\0';
+        n = 0;
+
+        switch(s.conversion) {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+            case 'p': {
+                unsigned long long v;
+                unsigned int base = 10;
+                if(0 > log_payload_get(r, &pos, &v, sizeof(v)))
+                    goto l_truncated;
+                if('d' == s.conversion || 'i' == s.conversion) {
+                    long long sv = (long long)v;
+                    if(0 > sv) {
+                        prefix = "-";
+                        v = 0ULL - v;
+                    } else if(memchr(flags, '+', strlen(flags))) {
+                        prefix = "+";
+                    } else if(memchr(flags, ' ', strlen(flags))) {
+                        prefix = " ";
+                    }
+                } else if('o' == s.conversion) {
+                    base = 8;
+                } else if('p' == s.conversion) {
+                    base = 16;
+                    prefix = "0x";
+                } else if('x' == s.conversion || 'X' == s.conversion) {
+                    base = 16;
+                    if(0 < v && memchr(flags, '#', strlen(flags))) {
+                        prefix = 'x' == s.conversion ? "0x" : "0X";
+                    }
+                }
+                if(0 <= precision) {
+                    // explicit precision disables zero padding
+                    flags[0] = '\0';
+                }
+                n = log_safe_digits(body, v, base, 'X' == s.conversion, 0 <= precision ? precision : 1);
+                log_safe_field(buf, len, &used, flags, width, prefix, body, n);
+                break;
+            }
+            case 'c': {
+                int v;
+                if(0 > log_payload_get(r, &pos, &v, sizeof(v)))
+                    goto l_truncated;
+                body[0] = (char)v;
+                log_safe_field(buf, len, &used, flags, width, prefix, body, 1);
+                break;
+            }
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                double v;
+                if(0 > log_payload_get(r, &pos, &v, sizeof(v)))
+                    goto l_truncated;
+                if(v != v) {
+                    log_safe_field(buf, len, &used, "", width, "", "nan", 3);
+                    break;
+                }
+                if(0 > v) {
+                    prefix = "-";
+                    v = -v;
+                } else if(memchr(flags, '+', strlen(flags))) {
+                    prefix = "+";
+                }
+                if(v > 1.7976931348623157e308) {
+                    log_safe_field(buf, len, &used, "", width, prefix, "inf", 3);
+                    break;
+                }
+                n = log_safe_double(body, v, 0 <= precision ? precision : 6,
+                    'e' == s.conversion || 'E' == s.conversion, 'E' == s.conversion);
+                log_safe_field(buf, len, &used, flags, width, prefix, body, n);
+                break;
+            }
+            case 's': {
+                unsigned char l;
+                char v[256];
+                if(0 > log_payload_get(r, &pos, &l, 1))
+                    goto l_truncated;
+                if(0 > log_payload_get(r, &pos, v, l))
+                    goto l_truncated;
+                n = l;
+                if(0 <= precision && precision < n) {
+                    n = precision;
+                }
+                // zero padding is not defined for strings
+                log_safe_field(buf, len, &used, memchr(flags, '-', strlen(flags)) ? "-" : "", width, prefix, v, n);
+                break;
+            }
+            case 'n':
+                break;
+            default:
+                goto l_truncated;
+        }
+    }
+
+    return used;
+
+l_truncated:
+    log_safe_put(buf, len, &used, "<truncated>", 11);
+    return used;
+}
+
+/*
+ * Find or add format string in the string table of the
+ * file. Called with the header lock held.
+ *
+ * Return value:
+ * Format id, or -1 when the table is full
+ */
+static int log_format_intern(log_record_file* f, const char* fmt) {
+    log_record_header* h = f->header;
+    size_t len;
+
+    for(uint32_t i = 0; i < h->format_count; i++) {
+        if(0 == strcmp(fmt, h->strings + h->format_offset[i])) {
+            return i;
+        }
+    }
+
+    len = strlen(fmt) + 1;
+    if(h->format_count >= LOG_RECORD_MAX_FORMATS || h->strings_used + len > LOG_RECORD_STRINGS_SIZE) {
+        return -1;
+    }
+
+    memcpy(h->strings + h->strings_used, fmt, len);
+    h->format_offset[h->format_count] = h->strings_used;
+    h->strings_used += len;
+
+    // publish the string before the new count
+    __atomic_store_n(&h->format_count, h->format_count + 1, __ATOMIC_RELEASE);
+    return h->format_count - 1;
+}
+
+/*
+ * Get id of a format string. The pointer is looked up in
+ * a per process cache first, so the string table is only
+ * searched the first time a format string is used. As
+ * the same pointer may point to different text over time
+ * (e.g. a reused buffer), a cached id is only used when
+ * its stored string still matches.
+ *
+ * Return value:
+ * Format id, or -1 when fmt is NULL or the table is full
+ */
+static int log_format_id(log_record_file* f, const char* fmt) {
+    const log_record_header* h = f->header;
+    unsigned int idx = ((uintptr_t)fmt >> 3) & (LOG_RECORD_CACHE_SIZE - 1);
+    int id;
+
+    // NULL marks empty cache slots and can not be stored
+    if(NULL == fmt) {
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < LOG_RECORD_CACHE_SIZE; i++) {
+        unsigned int cur = (idx + i) & (LOG_RECORD_CACHE_SIZE - 1);
+        const char* key = __atomic_load_n(&f->cache_key[cur], __ATOMIC_ACQUIRE);
+        if(key == fmt) {
+            id = __atomic_load_n(&f->cache_id[cur], __ATOMIC_ACQUIRE);
+            if(0 == strcmp(fmt, h->strings + h->format_offset[id])) {
+                return id;
+            }
+            // text behind the pointer changed, look it up again
+            break;
+        }
+        if(NULL == key) {
+            break;
+        }
+    }
+
+    while(__atomic_exchange_n(&f->header->lock, 1, __ATOMIC_ACQUIRE)) {
+        // rarely contended, only taken on first use of a format
+    }
+
+    id = log_format_intern(f, fmt);
+    if(0 <= id) {
+        for(unsigned int i = 0; i < LOG_RECORD_CACHE_SIZE; i++) {
+            unsigned int cur = (idx + i) & (LOG_RECORD_CACHE_SIZE - 1);
+            if(NULL == f->cache_key[cur]) {
+                f->cache_id[cur] = id;
+                __atomic_store_n(&f->cache_key[cur], fmt, __ATOMIC_RELEASE);
+                break;
+            }
+            if(fmt == f->cache_key[cur]) {
+                __atomic_store_n(&f->cache_id[cur], id, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+    }
+
+    __atomic_store_n(&f->header->lock, 0, __ATOMIC_RELEASE);
+    return id;
+}
+
+/*
+ * Store one record with format id id into the ring
+ */
+static void log_record_put(log_record_file* f, int id, int level, const char* fmt, va_list ap) {
+    struct timespec ts;
+    log_record* r;
+    uint64_t seq;
+    va_list aq;
+
+    seq = __atomic_add_fetch(&f->header->next_seq, 1, __ATOMIC_RELAXED);
+    r = &f->records[(seq - 1) % f->header->record_count];
+
+    // invalidate the slot while it is rewritten
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELEASE);
+
+    // a tick resolution is enough and much cheaper to read
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    r->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    r->format_id = id;
+    r->level = level & ~LOG_RECORD_TRUNCATED;
+    r->len = 0;
+
+    va_copy(aq, ap);
+    if(0 > log_payload_encode(r, fmt, aq)) {
+        r->level |= LOG_RECORD_TRUNCATED;
+    }
+    va_end(aq);
+
+    __atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * Store one record using LOG_RECORD_TEXT_FORMAT, the
+ * only argument is the already formatted text
+ */
+static void log_record_put_text(log_record_file* f, int id, int level, ...) {
+    va_list ap;
+
+    va_start(ap, level);
+    log_record_put(f, id, level, LOG_RECORD_TEXT_FORMAT, ap);
+    va_end(ap);
+}
+
+/*
+ * Append one message to the ring. Only the format id,
+ * timestamp and raw argument values are copied. When the
+ * string table is full, the message is formatted and
+ * stored as text instead, so new formats are not lost.
+ *
+ * Return value:
+ * LOG_RECORD_OK when successful, LOG_RECORD_ERROR_FORMAT
+ * when fmt is NULL, LOG_RECORD_ERROR_FULL when the 
+ * message could not be stored at all
+ */
+int log_record_write(log_record_file* f, int level, const char* fmt, va_list ap) {
+    char text[LOG_RECORD_PAYLOAD_SIZE];
+    va_list aq;
+    int id;
+
+    if(NULL == fmt) {
+        return LOG_RECORD_ERROR_FORMAT;
+    }
+
+    id = log_format_id(f, fmt);
+    if(0 <= id) {
+        log_record_put(f, id, level, fmt, ap);
+        return LOG_RECORD_OK;
+    }
+
+    id = log_format_id(f, LOG_RECORD_TEXT_FORMAT);
+    if(0 > id) {
+        return LOG_RECORD_ERROR_FULL;
+    }
+
+    va_copy(aq, ap);
+    vsnprintf(text, sizeof(text), fmt, aq);
+    va_end(aq);
+
+    log_record_put_text(f, id, level, text);
+    return LOG_RECORD_OK;
+}
+
+/*
+ * Same as log_record_write, the format id is cached in
+ * site so the format is looked up only once per call 
+ * site. A site must be used with one file only.
+ *
+ * Return value:
+ * Same as log_record_write
+ */
+int log_record_write_site(log_record_file* f, int* site, int level, const char* fmt, va_list ap) {
+    int id;
+
+    if(NULL == site || NULL == fmt) {
+        return log_record_write(f, level, fmt, ap);
+    }
+
+    id = __atomic_load_n(site, __ATOMIC_RELAXED);
+    if(0 > id) {
+        id = log_format_id(f, fmt);
+        if(0 > id) {
+            // table is full, stored as text
+            return log_record_write(f, level, fmt, ap);
+        }
+        __atomic_store_n(site, id, __ATOMIC_RELAXED);
+    }
+
+    log_record_put(f, id, level, fmt, ap);
+    return LOG_RECORD_OK;
+}
+
+/*
+ * Convert numerical level to the name used by
+ * log_set_level
+ */
+static const char* log_record_level_name(int level) {
+    switch(level & ~LOG_RECORD_TRUNCATED) {
+        case LOG_LEVEL_INFO:        return LOG_LEVEL_INFO_NAME;
+        case LOG_LEVEL_ERROR:       return LOG_LEVEL_ERROR_NAME;
+        case LOG_LEVEL_WARNING:     return LOG_LEVEL_WARNING_NAME;
+        case LOG_LEVEL_DEBUG:       return LOG_LEVEL_DEBUG_NAME;
+        case LOG_LEVEL_DETAILES:    return LOG_LEVEL_DETAILS_NAME;
+    }
+    return "unknown";
+}
+
+/*
+ * Print all records with sequence number greater than
+ * from_seq in order, one line per record including time
+ * and level.
+ *
+ * Return value:
+ * Sequence number of the last printed record, from_seq
+ * when nothing is printed
+ */
+uint64_t log_record_dump(const log_record_file* f, uint64_t from_seq, FILE* out) {
+    uint64_t last = __atomic_load_n(&f->header->next_seq, __ATOMIC_ACQUIRE);
+    uint64_t seq = from_seq + 1;
+    uint64_t printed = from_seq;
+    char text[1024];
+
+    if(last > f->header->record_count && seq <= last - f->header->record_count) {
+        seq = last - f->header->record_count + 1;
+    }
+
+    for(; seq <= last; seq++) {
+        const log_record* r = &f->records[(seq - 1) % f->header->record_count];
+        log_record copy;
+        struct tm tm;
+        time_t sec;
+
+        memcpy(&copy, r, sizeof(copy));
+        if(copy.seq != seq || __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq) {
+            // overwritten or being written
+            continue;
+        }
+
+        log_record_format(f, &copy, text, sizeof(text));
+
+        sec = copy.ts_ns / 1000000000ULL;
+        localtime_r(&sec, &tm);
+        fprintf(out, "%04d-%02d-%02d %02d:%02d:%02d.%06llu [%s] %s\r\n",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+            (unsigned long long)(copy.ts_ns % 1000000000ULL) / 1000,
+            log_record_level_name(copy.level), text);
+        printed = seq;
+    }
+
+    return printed;
+}
+
+/*
+ * Write all of buf to fd, errors are ignored as there is
+ * nobody left to report them to
+ */
+static void log_record_write_fd(int fd, const char* buf, size_t len) {
+    ssize_t ret;
+
+    while(0 < len) {
+        ret = write(fd, buf, len);
+        if(0 > ret) {
+            return;
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/*
+ * Same as log_record_dump but for fatal signal handlers,
+ * records are formatted by log_record_format_safe and 
+ * written with write(2), stdio is not used. Time is 
+ * printed as seconds since the epoch as localtime_r is
+ * not async signal safe.
+ *
+ * Return value:
+ * Sequence number of the last written record, from_seq
+ * when nothing is written
+ */
+uint64_t log_record_dump_fd(const log_record_file* f, uint64_t from_seq, int fd) {
+    uint64_t last = __atomic_load_n(&f->header->next_seq, __ATOMIC_ACQUIRE);
+    uint64_t seq = from_seq + 1;
+    uint64_t printed = from_seq;
+    char line[1100];
+    const char* level;
+    size_t used;
+    int n;
+
+    if(last > f->header->record_count && seq <= last - f->header->record_count) {
+        seq = last - f->header->record_count + 1;
+    }
+
+    for(; seq <= last; seq++) {
+        const log_record* r = &f->records[(seq - 1) % f->header->record_count];
+        log_record copy;
+
+        memcpy(&copy, r, sizeof(copy));
+        if(copy.seq != seq || __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq) {
+            continue;
+        }
+
+        // seconds.micro seconds [level] text
+        n = log_safe_digits(line, copy.ts_ns / 1000000000ULL, 10, 0, 1);
+        line[n++] = '.';
+        n += log_safe_digits(line + n, (copy.ts_ns % 1000000000ULL) / 1000, 10, 0, 6);
+        line[n++] = ' ';
+        line[n++] = '[';
+        used = n;
+        level = log_record_level_name(copy.level);
+        log_safe_put(line, sizeof(line), &used, level, strlen(level));
+        log_safe_put(line, sizeof(line), &used, "] ", 2);
+
+        // keep space for the line end
+        used += log_record_format_safe(f, &copy, line + used, sizeof(line) - used - 2);
+        line[used++] = '\r';
+        line[used++] = '\n';
+        log_record_write_fd(fd, line, used);
+        printed = seq;
+    }
+
+    return printed;
+}
+
+/*
+ * Open or create a record file and map it into memory.
+ * An existing file with the same layout is reused
+ * including its records, otherwise it is initialized.
+ *
+ * Return value:
+ * LOG_RECORD_OK when successful, otherwise error code
+ */
+int log_record_open(log_record_file* f, const char* path, uint32_t record_count, int read_only) {
+    struct stat st;
+    log_record_header* h;
+    void* map;
+    size_t size;
+    int fd;
+
+    memset(f, 0, sizeof(log_record_file));
+
+    fd = open(path, read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+    if(0 > fd) {
+        return LOG_RECORD_ERROR_OPEN;
+    }
+
+    if(0 > fstat(fd, &st)) {
+        close(fd);
+        return LOG_RECORD_ERROR_OPEN;
+    }
+
+    if(read_only) {
+        size = st.st_size;
+        if(size < sizeof(log_record_header)) {
+            close(fd);
+            return LOG_RECORD_ERROR_FORMAT;
+        }
+    } else {
+        size = sizeof(log_record_header) + (size_t)record_count * sizeof(log_record);
+        if((size_t)st.st_size != size && 0 > ftruncate(fd, size)) {
+            close(fd);
+            return LOG_RECORD_ERROR_OPEN;
+        }
+    }
+
+    map = mmap(NULL, size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(MAP_FAILED == map) {
+        return LOG_RECORD_ERROR_MAP;
+    }
+
+    h = (log_record_header*)map;
+    if(0 != memcmp(h->magic, LOG_RECORD_MAGIC, sizeof(h->magic))
+        || LOG_RECORD_VERSION != h->version
+        || sizeof(log_record) != h->record_size
+        || (!read_only && record_count != h->record_count)
+        || (read_only && size != sizeof(log_record_header) + (size_t)h->record_count * sizeof(log_record))) {
+        if(read_only) {
+            munmap(map, size);
+            return LOG_RECORD_ERROR_FORMAT;
+        }
+
+        memset(map, 0, size);
+        memcpy(h->magic, LOG_RECORD_MAGIC, sizeof(h->magic));
+        h->version = LOG_RECORD_VERSION;
+        h->record_size = sizeof(log_record);
+        h->record_count = record_count;
+    }
+
+    if(!read_only) {
+        // lock owner might be a crashed previous instance
+        h->lock = 0;
+
+        // reserve the text format used when the table is full
+        f->header = h;
+        log_format_intern(f, LOG_RECORD_TEXT_FORMAT);
+    }
+
+    f->header = h;
+    f->records = (log_record*)((char*)map + sizeof(log_record_header));
+    f->map_size = size;
+    return LOG_RECORD_OK;
+}
+
+/*
+ * Unmap the file opened by log_record_open
+ */
+void log_record_close(log_record_file* f) {
+    if(NULL != f->header) {
+        munmap(f->header, f->map_size);
+        f->header = NULL;
+        f->records = NULL;
+    }
+}
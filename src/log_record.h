@@ -0,0 +1,196 @@
+/*
+ * Copyright lzh88998 and distributed under Apache 2.0 license
+ *
+ * log_record stores log messages in binary format into a
+ * memory mapped file. Instead of formatting the message,
+ * only the format string id, a timestamp and the raw
+ * argument values are copied. The format string itself
+ * is stored once in the string table of the same file,
+ * so the file can be decoded later by ihome-logcat or by
+ * a restarted process.
+ *
+ * Records have a fixed size and are written in a ring,
+ * when the ring is full the oldest records are
+ * overwritten. Timestamps are taken from the coarse 
+ * realtime clock, so their resolution is one scheduler
+ * tick.
+ *
+ */
+
+#ifndef __LOG_RECORD_H__
+#define __LOG_RECORD_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+/*
+ * Return values of log_record functions
+ */
+#define LOG_RECORD_OK					0
+#define LOG_RECORD_ERROR_OPEN			-1
+#define LOG_RECORD_ERROR_MAP			-2
+#define LOG_RECORD_ERROR_FORMAT			-3
+#define LOG_RECORD_ERROR_FULL			-4
+
+/*
+ * File layout configuration. Changing any of these
+ * values changes the file format, so LOG_RECORD_VERSION
+ * need to be increased as well.
+ */
+#define LOG_RECORD_MAGIC				"IHLOGREC"
+#define LOG_RECORD_VERSION				2
+#define LOG_RECORD_SIZE					128
+#define LOG_RECORD_PAYLOAD_SIZE			(LOG_RECORD_SIZE - 20)
+#define LOG_RECORD_MAX_FORMATS			2048
+#define LOG_RECORD_STRINGS_SIZE			131072
+
+/*
+ * Set in flags of the header when the writing process
+ * exited normally
+ */
+#define LOG_RECORD_FLAG_CLEAN			0x01
+
+/*
+ * Set in level field of a record when not all arguments
+ * fit into the payload
+ */
+#define LOG_RECORD_TRUNCATED			0x80
+
+/*
+ * Format of records storing already formatted text, used
+ * when the string table has no space for a new format
+ */
+#define LOG_RECORD_TEXT_FORMAT			"%s"
+
+/*
+ * Size of the per process cache mapping format string
+ * pointers to ids, must be a power of 2
+ */
+#define LOG_RECORD_CACHE_SIZE			4096
+
+/*
+ * Header at the beginning of the file, followed by
+ * record_count records
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t record_count;
+    uint32_t format_count;
+    uint32_t strings_used;
+    uint32_t lock;
+    uint32_t flags;
+    uint64_t next_seq;
+    uint32_t format_offset[LOG_RECORD_MAX_FORMATS];
+    char strings[LOG_RECORD_STRINGS_SIZE];
+} log_record_header;
+
+/*
+ * One log message. seq is 0 for never written records
+ * and is stored last, so a record is only valid after
+ * seq is set.
+ */
+typedef struct {
+    uint64_t seq;
+    uint64_t ts_ns;
+    uint16_t format_id;
+    uint8_t level;
+    uint8_t len;
+    uint8_t payload[LOG_RECORD_PAYLOAD_SIZE];
+} log_record;
+
+/*
+ * An opened record file
+ */
+typedef struct {
+    log_record_header* header;
+    log_record* records;
+    size_t map_size;
+    const char* cache_key[LOG_RECORD_CACHE_SIZE];
+    uint16_t cache_id[LOG_RECORD_CACHE_SIZE];
+} log_record_file;
+
+/*
+ * Open or create a record file and map it into memory.
+ * An existing file with the same layout is reused
+ * including its records, otherwise it is initialized.
+ *
+ * Parameters:
+ * log_record_file* f       File object to initialize
+ * const char* path         Path of the file
+ * uint32_t record_count    Number of records in the ring,
+ *                          ignored when read_only is set
+ * int read_only            Open an existing file for
+ *                          decoding only
+ *
+ * Return value:
+ * LOG_RECORD_OK when successful, otherwise error code
+ * defined above
+ */
+int log_record_open(log_record_file* f, const char* path, uint32_t record_count, int read_only);
+
+/*
+ * Unmap the file opened by log_record_open
+ */
+void log_record_close(log_record_file* f);
+
+/*
+ * Append one message to the ring. Only the format id,
+ * timestamp and raw argument values are copied. When the
+ * string table is full, the message is formatted and
+ * stored as text with LOG_RECORD_TEXT_FORMAT instead.
+ *
+ * Return value:
+ * LOG_RECORD_OK when successful, LOG_RECORD_ERROR_FORMAT
+ * when fmt is NULL, LOG_RECORD_ERROR_FULL when the 
+ * message could not be stored at all
+ */
+int log_record_write(log_record_file* f, int level, const char* fmt, va_list ap);
+
+/*
+ * Same as log_record_write, the format id is cached in
+ * site so the format is looked up only once per call 
+ * site. *site is negative until the id is known. A site
+ * must be used with one file only and fmt must not 
+ * change, e.g. a string literal.
+ *
+ * Return value:
+ * Same as log_record_write
+ */
+int log_record_write_site(log_record_file* f, int* site, int level, const char* fmt, va_list ap);
+
+/*
+ * Format the message of one record as text
+ *
+ * Return value:
+ * Length of the text written to buf
+ */
+int log_record_format(const log_record_file* f, const log_record* r, char* buf, size_t len);
+
+/*
+ * Print all records with sequence number greater than
+ * from_seq in order, one line per record including time
+ * and level.
+ *
+ * Return value:
+ * Sequence number of the last printed record, from_seq
+ * when nothing is printed
+ */
+uint64_t log_record_dump(const log_record_file* f, uint64_t from_seq, FILE* out);
+
+/*
+ * Same as log_record_dump but written to a file 
+ * descriptor with write(2) only and formatted without
+ * stdio, so it can be called from a fatal signal 
+ * handler. Time is printed as seconds since the epoch, 
+ * floating point values with %f or %e rules only.
+ *
+ * Return value:
+ * Sequence number of the last written record, from_seq
+ * when nothing is written
+ */
+uint64_t log_record_dump_fd(const log_record_file* f, uint64_t from_seq, int fd);
+
+#endif
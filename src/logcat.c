@@ -0,0 +1,107 @@
+/*
+ * Copyright lzh88998 and distributed under Apache 2.0 license
+ * 
+ * ihome-logcat decodes binary log files written by micro
+ * services running in binary log mode (see log_open_binary
+ * in log.h) and prints them as text.
+ * 
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "log_record.h"
+
+/*
+ * Poll interval in micro seconds when following a file
+ */
+#define LOGCAT_FOLLOW_INTERVAL_US   200000
+
+/*
+ * When user input incorrect data, this tool will exit 
+ * immediately. And with this function, it can provide
+ * user a friendly hint for usage.
+ * 
+ * Parameters:
+ * int argc                 Number of input parameters, same function 
+ *                          with argc of main.
+ * char **argv              Actual input parameters, same function with
+ *                          argv of main.
+ * 
+ * Return value:
+ * There is no return value
+ */
+void print_usage(int argc, char **argv) {
+    if(0 >= argc) {
+        return;
+    }
+    
+    printf("Invalid input parameters!\n");
+    printf("Usage: (<optional parameters>)\n");
+    printf("%s <-f> binary_log_file\n", argv[0]);
+    printf("-f\tKeep printing new messages\n");
+    printf("E.g.:\n");
+    printf("%s /var/log/ihome/cargador_192.168.100.100.ilog\n\n", argv[0]);
+    printf("%s -f /var/log/ihome/cargador_192.168.100.100.ilog\n\n", argv[0]);
+}
+
+/*
+ * Main entry of the tool. Prints all records available
+ * in the file in order, and keeps polling for new ones
+ * when -f is given.
+ * 
+ * Parameters:
+ * int argc                 Number of input parameters, same function 
+ *                          with argc of main.
+ * char **argv              Actual input parameters, same function with
+ *                          argv of main.
+ * 
+ * Return value:
+ * 0 when successful, otherwise failed
+ */
+int main(int argc, char **argv) {
+    log_record_file file;
+    const char* path;
+    uint64_t seq = 0;
+    int follow = 0;
+    int ret;
+    
+    switch(argc) {
+        case 3:
+            if(0 != strcmp("-f", argv[1])) {
+                print_usage(argc, argv);
+                return -1;
+            }
+            follow = 1;
+            path = argv[2];
+            break;
+        case 2:
+            path = argv[1];
+            break;
+        default:
+            print_usage(argc, argv);
+            return -1;
+    }
+    
+    ret = log_record_open(&file, path, 0, 1);
+    if(LOG_RECORD_OK != ret) {
+        fprintf(stderr, "Failed to open %s, error %d\n", path, ret);
+        return -2;
+    }
+    
+    do {
+        seq = log_record_dump(&file, seq, stdout);
+        fflush(stdout);
+        if(follow) {
+            usleep(LOGCAT_FOLLOW_INTERVAL_US);
+        }
+    } while(follow);
+    
+    log_record_close(&file);
+    return 0;
+}
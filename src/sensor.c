@@ -4,6 +4,10 @@
  * sensor is a micro service receive sensor data from LCD I2C
  * bus and publish to redis
  * 
+ * One process serves all controllers given as a comma
+ * separated address list through one to_gateway epoll
+ * loop and one redis connection.
+ * 
  */
  
 #include <stdio.h>
@@ -23,6 +27,7 @@
 
 #include "log.h"
 #include "to_socket.h"
+#include "stats.h"
 
 #define REDIS_IP                "127.0.0.1"
 #define REDIS_PORT              6379
@@ -32,7 +37,58 @@
 
 #define SENSOR_COUNT            4
 
-static to_socket_ctx gs_socket = -1;
+/*
+ * Sensor frame: start byte, one byte per sensor and end
+ * byte
+ */
+#define SENSOR_FRAME_START      0xAA
+#define SENSOR_FRAME_END        0xFF
+#define SENSOR_FRAME_SIZE       (SENSOR_COUNT + 2)
+
+/*
+ * Maximum count of controllers served by one process and
+ * separator of the controller address list
+ */
+#define MAX_CONTROLLER_CNT      64
+#define CONTROLLER_SEPARATOR    ","
+
+/*
+ * Flags of all controllers are checked in this interval
+ * of milli seconds
+ */
+#define FLAG_CHECK_INTERVAL     100
+
+/*
+ * Return values of check_flags
+ */
+#define CHECK_FLAGS_OK          0
+#define CHECK_FLAGS_FAILED      -1
+
+/*
+ * Flags checked for every controller, in the order of
+ * the GET commands of check_flags
+ */
+#define CHECK_FLAGS_LOG_LEVEL   0
+#define CHECK_FLAGS_EXIT        1
+#define CHECK_FLAGS_RESET       2
+#define CHECK_FLAGS_COUNT       3
+
+/*
+ * State of one sensor controller
+ */
+typedef struct {
+    const char* ip;
+    redisReply* topics[SENSOR_COUNT];
+    unsigned long out_of_sync;
+    unsigned long out_of_sync_reported;
+    to_gateway_conn conn;
+} sensor_controller;
+
+static sensor_controller gs_controllers[MAX_CONTROLLER_CNT];
+static int gs_controller_cnt = 0;
+static int gs_serv_port = 0;
+
+static to_gateway gs_gateway;
 static redisContext *gs_sync_context = NULL;
 
 static int gs_exit = 0;
@@ -63,20 +119,295 @@ void print_usage(int argc, char **argv) {
     
     printf("Invalid input parameters!\n");
     printf("Usage: (<optional parameters>)\n");
-    printf("%s controller_ip controller_port <log_level> <redis_ip> <redis_port>\n", argv[0]);
+    printf("%s controller_ip[,controller_ip...] controller_port <log_level> <redis_ip> <redis_port>\n", argv[0]);
     printf("E.g.:\n");
     printf("%s 192.168.100.100 5000\n\n", argv[0]);
+    printf("%s 192.168.100.100,192.168.100.101 5000\n\n", argv[0]);
     printf("%s 192.168.100.100 5000 debug\n\n", argv[0]);
     printf("%s 192.168.100.100 5000 127.0.0.1 6379\n\n", argv[0]);
     printf("%s 192.168.100.100 5000 debug 127.0.0.1 6379\n\n", argv[0]);
 }
 
+/*
+ * Frame decoder for to_reader. Bytes before the start byte
+ * are dropped, including the initial byte sent by the
+ * controller after connect. A frame without the end byte
+ * at the expected position is counted as out of sync and
+ * only its start byte is dropped so the next frame can be 
+ * found.
+ * 
+ * Parameters:
+ * const unsigned char* data    Buffered bytes
+ * size_t len                   Count of buffered bytes
+ * void* arg                    Gateway connection of the
+ *                              controller
+ * 
+ * Return value:
+ * Frame size, 0 when more bytes are needed or negative
+ * count of bytes to drop
+ */
+int decode_sensor_frame(const unsigned char* data, size_t len, void* arg) {
+    sensor_controller* ctrl = (sensor_controller*)((to_gateway_conn*)arg)->arg;
+    size_t i;
+    
+    if(SENSOR_FRAME_START != data[0]) {
+        // skip other value items
+        for(i = 1; i < len && SENSOR_FRAME_START != data[i]; i++);
+        return -(int)i;
+    }
+    
+    if(len < SENSOR_FRAME_SIZE) {
+        return 0;
+    }
+    
+    if(SENSOR_FRAME_END != data[SENSOR_FRAME_SIZE - 1]) {
+        ctrl->out_of_sync++;
+        return -1;
+    }
+    
+    return SENSOR_FRAME_SIZE;
+}
+
+/*
+ * Called by the gateway for every sensor frame, publishes
+ * the sensor values and out of sync events to redis
+ * 
+ * Parameters:
+ * to_gateway_conn* conn        Connection of the controller
+ * const unsigned char* frame   Sensor frame
+ * int len                      Length of frame
+ * 
+ * Return value:
+ * 0 when successful, -1 when redis failed
+ */
+int process_frame(to_gateway_conn* conn, const unsigned char* frame, int len) {
+    sensor_controller* ctrl = (sensor_controller*)conn->arg;
+    redisReply* reply;
+    
+    UNUSED(len);
+    
+    if(ctrl->out_of_sync != ctrl->out_of_sync_reported) {
+        LOG_WARNING("Sensor %s frames out of sync %lu, dropped %lu bytes", ctrl->ip, ctrl->out_of_sync, conn->reader.skipped);
+        ctrl->out_of_sync_reported = ctrl->out_of_sync;
+        reply = redisCommand(gs_sync_context,"PUBLISH %s/%s/%d/sync %s", FLAG_KEY, ctrl->ip, gs_serv_port, "out of sync");
+        if(NULL == reply) {
+            LOG_ERROR("Failed to sync query redis %s\n", gs_sync_context->errstr);
+            return -1;
+        }
+        freeReplyObject(reply);
+    }
+    
+    // Temperature
+    // Move 1
+    // Move 2
+    // Light
+    LOG_DETAILS("Received %s %d %d %d %d", ctrl->ip, frame[1], frame[2], frame[3], frame[4]);
+    for(int i = 0; i < SENSOR_COUNT; i++) {
+        if(NULL != ctrl->topics[i]->str) {
+            reply = redisCommand(gs_sync_context,"PUBLISH %s %d", ctrl->topics[i]->str, frame[i + 1]);
+            if(NULL == reply) {
+                LOG_ERROR("Failed to sync query redis %s\n", gs_sync_context->errstr);
+                return -1;
+            }
+            freeReplyObject(reply);
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Called by the gateway when a controller is connected
+ * or the connection is lost, the gateway reconnects by
+ * itself so other controllers are not affected
+ * 
+ * Parameters:
+ * to_gateway_conn* conn        Connection of the controller
+ * int error                    TO_SOCKET_OK when connected,
+ *                              otherwise the error code
+ * 
+ * Return value:
+ * There is no return value
+ */
+void connection_state(to_gateway_conn* conn, int error) {
+    if(TO_SOCKET_OK == error) {
+        LOG_INFO("Connected to sensor %s:%d", conn->addr, conn->port);
+    } else {
+        LOG_ERROR("Sensor %s:%d disconnected %d", conn->addr, conn->port, error);
+    }
+}
+
+/*
+ * Load the topics of one controller from hash 
+ * sensor/<ip>/<port> in DB 0 with one round trip, the 
+ * sync connection stays in DB 1
+ * 
+ * Parameters:
+ * sensor_controller* ctrl      Controller
+ * 
+ * Return value:
+ * 0 when successful, -1 when redis failed
+ */
+int load_topics(sensor_controller* ctrl) {
+    redisReply* topics[SENSOR_COUNT] = { NULL };
+    redisReply* reply = NULL;
+    int ret = -1;
+    
+    redisAppendCommand(gs_sync_context, "SELECT 0");
+    for(int i = 0; i < SENSOR_COUNT; i++) {
+        redisAppendCommand(gs_sync_context, "HGET %s/%s/%d %s%d", FLAG_KEY, ctrl->ip, gs_serv_port, SENSOR_KEY, i);
+    }
+    redisAppendCommand(gs_sync_context, "SELECT 1");
+    
+    if(REDIS_OK != redisGetReply(gs_sync_context, (void**)&reply)) {
+        goto l_redis_failed;
+    }
+    freeReplyObject(reply);
+    
+    for(int i = 0; i < SENSOR_COUNT; i++) {
+        if(REDIS_OK != redisGetReply(gs_sync_context, (void**)&topics[i])) {
+            goto l_redis_failed;
+        }
+        LOG_DETAILS("Topic %s %d: %s", ctrl->ip, i, topics[i]->str);
+    }
+    
+    if(REDIS_OK != redisGetReply(gs_sync_context, (void**)&reply)) {
+        goto l_redis_failed;
+    }
+    freeReplyObject(reply);
+    
+    for(int i = 0; i < SENSOR_COUNT; i++) {
+        if(NULL != ctrl->topics[i]) {
+            freeReplyObject(ctrl->topics[i]);
+        }
+        ctrl->topics[i] = topics[i];
+        topics[i] = NULL;
+    }
+    
+    ret = 0;
+    goto l_free_topics;
+    
+l_redis_failed:
+    LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
+    
+l_free_topics:
+    for(int i = 0; i < SENSOR_COUNT; i++) {
+        if(NULL != topics[i]) {
+            freeReplyObject(topics[i]);
+        }
+    }
+    
+    return ret;
+}
+
+/*
+ * Reload the topics of one controller and restart its
+ * connection, the other controllers are not affected
+ * 
+ * Parameters:
+ * sensor_controller* ctrl      Controller
+ * 
+ * Return value:
+ * 0 when successful, -1 when redis failed
+ */
+int reset_controller(sensor_controller* ctrl) {
+    LOG_INFO("Reset sensor %s", ctrl->ip);
+    
+    if(0 > load_topics(ctrl)) {
+        return -1;
+    }
+    
+    ctrl->out_of_sync = 0;
+    ctrl->out_of_sync_reported = 0;
+    to_gateway_reset(&gs_gateway, &ctrl->conn);
+    
+    return 0;
+}
+
+/*
+ * Check log level, exit and reset flags of all controllers
+ * with one pipelined round trip. Flags found are deleted
+ * in a second round trip, a reset only restarts the
+ * connection of its controller.
+ * 
+ * Return value:
+ * CHECK_FLAGS_OK, or CHECK_FLAGS_FAILED when redis failed
+ */
+int check_flags(void) {
+    static const char* flags[] = { LOG_LEVEL_FLAG_VALUE, EXIT_FLAG_VALUE, RESET_FLAG_VALUE };
+    int reset[MAX_CONTROLLER_CNT];
+    redisReply* reply;
+    sensor_controller* ctrl;
+    int dels = 0;
+    
+    LOG_DEBUG("Check flags of %d sensors", gs_controller_cnt);
+    for(int c = 0; c < gs_controller_cnt; c++) {
+        for(int f = 0; f < CHECK_FLAGS_COUNT; f++) {
+            redisAppendCommand(gs_sync_context, "GET %s/%s/%d/%s", FLAG_KEY, gs_controllers[c].ip, gs_serv_port, flags[f]);
+        }
+    }
+    
+    for(int c = 0; c < gs_controller_cnt; c++) {
+        ctrl = &gs_controllers[c];
+        reset[c] = 0;
+        
+        for(int f = 0; f < CHECK_FLAGS_COUNT; f++) {
+            if(REDIS_OK != redisGetReply(gs_sync_context, (void**)&reply)) {
+                LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
+                return CHECK_FLAGS_FAILED;
+            }
+            
+            if(NULL == reply->str) {
+                freeReplyObject(reply);
+                continue;
+            }
+            
+            LOG_DETAILS("Flag %s of %s: %s", flags[f], ctrl->ip, reply->str);
+            if(CHECK_FLAGS_LOG_LEVEL == f) {
+                if(0 > log_set_level(reply->str)) {
+                    // kept so the invalid value can be seen
+                    LOG_ERROR("Invalid log option: %s", reply->str);
+                    freeReplyObject(reply);
+                    continue;
+                }
+            } else if(0 == strcmp(flags[f], reply->str)) {
+                if(CHECK_FLAGS_EXIT == f) {
+                    gs_exit = 1;
+                } else {
+                    reset[c] = 1;
+                }
+            }
+            freeReplyObject(reply);
+            
+            // delete the flag ensure not find it next check
+            redisAppendCommand(gs_sync_context, "DEL %s/%s/%d/%s", FLAG_KEY, ctrl->ip, gs_serv_port, flags[f]);
+            dels++;
+        }
+    }
+    
+    for(int i = 0; i < dels; i++) {
+        if(REDIS_OK != redisGetReply(gs_sync_context, (void**)&reply)) {
+            LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
+            return CHECK_FLAGS_FAILED;
+        }
+        freeReplyObject(reply);
+    }
+    
+    for(int c = 0; c < gs_controller_cnt; c++) {
+        if(reset[c] && 0 > reset_controller(&gs_controllers[c])) {
+            return CHECK_FLAGS_FAILED;
+        }
+    }
+    
+    return CHECK_FLAGS_OK;
+}
+
 /*
  * Main entry of the service. It will first connect
- * to LCD sensor port, and then connect to redis
- * through a sync connection. When received message
- * from LCD sensor the data will be sent to redis
- * through the sync connectoin
+ * to redis through a sync connection, and then connect
+ * to the sensor port of all controllers through one
+ * gateway. When received message from LCD sensor the
+ * data will be sent to redis through the sync connectoin
  * 
  * Parameters:
  * int argc                 Number of input parameters, same function 
@@ -100,24 +431,16 @@ int main (int argc, char **argv) {
     
     struct timeval timeout = { 0, 100000};
     
-    unsigned char temp = 0;
-    unsigned char buffer[4];
-    int buffer_state = 0;
+    int ret;
+    int gateway_open = 0;
+    uint64_t last_check = 0;
     
-    const char* serv_ip;
+    char* serv_ips;
     const char* redis_ip;
     
-    redisReply* topics[SENSOR_COUNT];
+    int redis_port;
     
-    int serv_port, redis_port;
-    
-    int topic_index = 0;
-    
-    memset(buffer, 0, 4);
-    
-    for(int i = 0; i < SENSOR_COUNT; i++) {
-        topics[i] = NULL;
-    }
+    char instance[64];
     
     LOG_INFO("=================== Service start! ===================");
     LOG_INFO("Parsing parameters!");
@@ -129,28 +452,28 @@ int main (int argc, char **argv) {
             }
             redis_port = atoi(argv[5]);
             redis_ip = argv[4];
-            serv_port = atoi(argv[2]);
-            serv_ip = argv[1];
+            gs_serv_port = atoi(argv[2]);
+            serv_ips = argv[1];
             break;
         case 5:
             redis_port = atoi(argv[4]);
             redis_ip = argv[3];
-            serv_port = atoi(argv[2]);
-            serv_ip = argv[1];
+            gs_serv_port = atoi(argv[2]);
+            serv_ips = argv[1];
             break;
         case 4:
             if(0 > log_set_level(argv[3])) {
                 print_usage(argc, argv);
                 return -3;
             }
-            serv_ip = argv[1];
-            serv_port = atoi(argv[2]);
+            serv_ips = argv[1];
+            gs_serv_port = atoi(argv[2]);
             redis_ip = REDIS_IP;
             redis_port = REDIS_PORT;
             break;
         case 3:
-            serv_ip = argv[1];
-            serv_port = atoi(argv[2]);
+            serv_ips = argv[1];
+            gs_serv_port = atoi(argv[2]);
             redis_ip = REDIS_IP;
             redis_port = REDIS_PORT;
             break;
@@ -159,26 +482,36 @@ int main (int argc, char **argv) {
             return -1;
     }
     
-l_start:
-    LOG_INFO("Connecting to sensor!");
-    gs_socket = to_connect(serv_ip, serv_port);
-    if(-1 == gs_socket) {
-        LOG_ERROR("Error connecting to sensor!\n");
-        goto l_exit;
+    snprintf(instance, sizeof(instance), "%s_%d", serv_ips, gs_serv_port);
+    
+    // split the address list in place, argv stays valid
+    for(char* ip = strtok(serv_ips, CONTROLLER_SEPARATOR); NULL != ip; ip = strtok(NULL, CONTROLLER_SEPARATOR)) {
+        if(MAX_CONTROLLER_CNT <= gs_controller_cnt) {
+            LOG_ERROR("Too many controllers, at most %d allowed!", MAX_CONTROLLER_CNT);
+            return -4;
+        }
+        gs_controllers[gs_controller_cnt].ip = ip;
+        for(int i = 0; i < SENSOR_COUNT; i++) {
+            gs_controllers[gs_controller_cnt].topics[i] = NULL;
+        }
+        gs_controller_cnt++;
     }
     
-    if(0 > to_recv(gs_socket, &temp, 1, 0)) {
-        LOG_ERROR("Error receiving initial data! %s\n", strerror(errno));
-        goto l_socket_cleanup;
+    if(0 == gs_controller_cnt) {
+        print_usage(argc, argv);
+        return -1;
     }
     
-    LOG_INFO("Connected to sensor, remote socket: %d\n", temp);
-
+    if(LOG_RECORDER_OK != log_recorder_open(FLAG_KEY, instance)) {
+        LOG_WARNING("Failed to open flight recorder!");
+    }
+    
+l_start:
     LOG_INFO("Connecting to Redis...");
     gs_sync_context = redisConnectWithTimeout(redis_ip, redis_port, timeout);
     if(NULL == gs_sync_context) {
         LOG_ERROR("Connection error: can't allocate redis context\n");
-        goto l_socket_cleanup;
+        goto l_exit;
     }
     
     if(gs_sync_context->err) {
@@ -196,19 +529,6 @@ l_start:
     
     LOG_INFO("Connected to Redis!");
 
-    LOG_INFO("Loading config!");
-    topic_index = 0;
-    while(topic_index < SENSOR_COUNT) {
-        topics[topic_index] = redisCommand(gs_sync_context,"HGET %s/%s/%d %s%d", FLAG_KEY, serv_ip, serv_port, SENSOR_KEY, topic_index);
-        if(NULL == topics[topic_index]) {
-            topic_index++;
-            LOG_ERROR("Failed to sync query redis %s\n", gs_sync_context->errstr);
-            goto l_free_topics;
-        }
-        LOG_DETAILS("Topic %d: %s", topic_index, topics[topic_index]->str);
-        topic_index++;
-    }
-    
     LOG_INFO("Switch to DB 1!");
     reply = redisCommand(gs_sync_context,"SELECT 1");
     if(NULL == reply) {
@@ -217,168 +537,82 @@ l_start:
     }
     freeReplyObject(reply);
     
+    LOG_INFO("Loading config!");
+    for(int c = 0; c < gs_controller_cnt; c++) {
+        if(0 > load_topics(&gs_controllers[c])) {
+            goto l_free_topics;
+        }
+    }
+    
+    // connections are kept when only redis failed
+    if(!gateway_open) {
+        LOG_INFO("Connecting to %d sensors!", gs_controller_cnt);
+        if(TO_SOCKET_OK != to_gateway_init(&gs_gateway)) {
+            LOG_ERROR("Error creating gateway!");
+            goto l_free_topics;
+        }
+        gateway_open = 1;
+        
+        for(int c = 0; c < gs_controller_cnt; c++) {
+            sensor_controller* ctrl = &gs_controllers[c];
+            ctrl->out_of_sync = 0;
+            ctrl->out_of_sync_reported = 0;
+            to_gateway_add(&gs_gateway, &ctrl->conn, ctrl->ip, gs_serv_port, NULL, decode_sensor_frame, process_frame, connection_state, ctrl);
+        }
+    }
+    
     while(!gs_exit) {
-        if(-1 == to_recv(gs_socket, &temp, 1, 0)) {
-            LOG_DEBUG("Receive returned -1, %s", strerror(errno));
-            if(EAGAIN == errno || EWOULDBLOCK == errno) {
-                // Check log level
-                LOG_DEBUG("Check log level")
-                reply = redisCommand(gs_sync_context,"GET %s/%s/%d/%s", FLAG_KEY, serv_ip, serv_port, LOG_LEVEL_FLAG_VALUE);
-                if(NULL == reply) {
-                    LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
-                    goto l_free_topics;
-                }
-                LOG_DETAILS("Get log level returned")
-                if(NULL != reply->str) {
-                    LOG_DETAILS("%s", reply->str);
-                    if(0 > log_set_level(reply->str)) {
-                        LOG_ERROR("Invalid log option: %s", reply->str);
-                    } else {
-                        freeReplyObject(reply);
-
-                        // delete the flag ensure not find it next start
-                        reply = redisCommand(gs_sync_context,"DEL %s/%s/%d/%s", FLAG_KEY, serv_ip, serv_port, LOG_LEVEL_FLAG_VALUE);
-                        if(NULL == reply) {
-                            LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
-                            goto l_free_topics;
-                        }
-                        if(NULL != reply->str) {
-                            LOG_DETAILS("%s", reply->str);
-                        }
-                    }
-                }
-                
-                freeReplyObject(reply);
-
-                // Check exit flag
-                LOG_DEBUG("Check exit flag")
-                reply = redisCommand(gs_sync_context,"GET %s/%s/%d/%s", FLAG_KEY, serv_ip, serv_port, EXIT_FLAG_VALUE);
-                if(NULL == reply) {
-                    LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
-                    goto l_free_topics;
-                }
-                if(NULL != reply->str) {
-                    LOG_DETAILS("Exit received %s", reply->str);
-                    if(0 == strcmp(EXIT_FLAG_VALUE, reply->str)) {
-                        gs_exit = 1;
-                    }
-
-                    freeReplyObject(reply);
-                    
-                    // delete the flag ensure not find it next start
-                    reply = redisCommand(gs_sync_context,"DEL %s/%s/%d/%s", FLAG_KEY, serv_ip, serv_port, EXIT_FLAG_VALUE);
-                    if(NULL == reply) {
-                        LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
-                        goto l_free_topics;
-                    }
-                    if(NULL != reply->str) {
-                        LOG_DETAILS("Del exit reply%s", reply->str);
-                    }
-                }
-                
-                freeReplyObject(reply);
-
-                // Check reset flag
-                LOG_DEBUG("Check reset flag")
-                reply = redisCommand(gs_sync_context,"GET %s/%s/%d/%s", FLAG_KEY, serv_ip, serv_port, RESET_FLAG_VALUE);
-                if(NULL == reply) {
-                    LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
-                    goto l_free_topics;
-                }
-                
-                if(NULL != reply->str) {
-                    LOG_DETAILS("Reset received %s", reply->str);
-                    if(0 == strcmp(RESET_FLAG_VALUE, reply->str)) {
-                        freeReplyObject(reply);
-                        
-                        // delete the flag ensure not find it next start
-                        reply = redisCommand(gs_sync_context,"DEL %s/%s/%d/%s", FLAG_KEY, serv_ip, serv_port, RESET_FLAG_VALUE);
-                        if(NULL == reply) {
-                            LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
-                            goto l_free_topics;
-                        }
-                        if(NULL != reply->str) {
-                            LOG_DETAILS("Del reset reply %s", reply->str);
-                        }
-
-                        freeReplyObject(reply);
-                        goto l_free_topics;
-                    }
-
-                    freeReplyObject(reply);
-                    
-                    // delete the flag ensure not find it next start
-                    reply = redisCommand(gs_sync_context,"DEL %s/%s/%d/%s", FLAG_KEY, serv_ip, serv_port, RESET_FLAG_VALUE);
-                    if(NULL == reply) {
-                        LOG_ERROR("Failed to sync query redis %s", gs_sync_context->errstr);
-                        goto l_free_topics;
-                    }
-                    if(NULL != reply->str) {
-                        LOG_DETAILS("Del reset reply %s", reply->str);
-                    }
-                }
-                
-                freeReplyObject(reply);
-            } else {
-                goto l_free_topics;
-            }
-        } else { //
-            LOG_DETAILS("Received 0x%x\n", temp);
-            switch(buffer_state) {
-                case 0: // first 0xAA
-                    if(0xAA == temp) {
-                        buffer_state++;
-                    } // skip other value items
-                    break;
-                case SENSOR_COUNT + 1: // last 0xFF
-                    if(0xFF == temp) {
-                        for(int i = 0; i < SENSOR_COUNT; i++) {
-                            if(NULL != topics[i]->str) {
-                                redisReply* reply = redisCommand(gs_sync_context,"PUBLISH %s %d", topics[i]->str, buffer[i]);
-                                if(NULL == reply) {
-                                    LOG_ERROR("Failed to sync query redis %s\n", gs_sync_context->errstr);
-                                    goto l_free_topics;
-                                }
-                                freeReplyObject(reply);
-                            }
-                        }
-                    } else { // out of sync
-                        redisCommand(gs_sync_context,"PUBLISH %s/%s/%d/sync %s", FLAG_KEY, serv_ip, serv_port, "out of sync");
-                    }
-                    buffer_state = 0;
-                    break;
-                default: // 1-4
-                    // Temperature
-                    // Move 1
-                    // Move 2
-                    // Light
-                    buffer[buffer_state -1] = temp;
-                    buffer_state++;
-                    break;
-            }
+        ret = to_gateway_run(&gs_gateway, FLAG_CHECK_INTERVAL);
+        if(TO_SOCKET_ERROR_EVENT == ret) {
+            LOG_ERROR("Gateway failed!");
+            goto l_gateway_cleanup;
+        }
+        
+        // process_frame failed, redis is reconnected
+        if(0 > ret) {
+            goto l_free_topics;
+        }
+        
+        if(stats_now() - last_check < FLAG_CHECK_INTERVAL * 1000000ULL) {
+            continue;
+        }
+        
+        last_check = stats_now();
+        if(CHECK_FLAGS_OK != check_flags()) {
+            goto l_free_topics;
         }
     }
 
+l_gateway_cleanup:
+    to_gateway_close(&gs_gateway);
+    gateway_open = 0;
+
 l_free_topics:
-    while(--topic_index >= 0) {
-        freeReplyObject(topics[topic_index]);
-        topics[topic_index] = NULL;
+    for(int c = 0; c < gs_controller_cnt; c++) {
+        for(int i = 0; i < SENSOR_COUNT; i++) {
+            if(NULL != gs_controllers[c].topics[i]) {
+                freeReplyObject(gs_controllers[c].topics[i]);
+                gs_controllers[c].topics[i] = NULL;
+            }
+        }
     }
     
 l_free_redis:
     redisFree(gs_sync_context);
-    
-l_socket_cleanup:
-    close(gs_socket);
-    gs_socket = -1;
+    gs_sync_context = NULL;
 
 l_exit:
     if(!gs_exit) {    
         printf("Monitor execution failed retry!\n");
+        log_recorder_dump();
         sleep(1);
         goto l_start;
     }
     
+    if(gateway_open) {
+        to_gateway_close(&gs_gateway);
+    }
+    
     printf("exit!\n");
     return 0;
 }
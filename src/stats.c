@@ -0,0 +1,158 @@
+/*
+ * Copyright lzh88998 and distributed under Apache 2.0 license
+ *
+ * Latency histograms for micro services, see stats.h
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <time.h>
+#include "stats.h"
+
+/*
+ * Index of the bucket containing value. Values below
+ * STATS_SUB_BUCKET_COUNT have their own bucket, larger
+ * values use the top STATS_SUB_BUCKET_BITS + 1 bits.
+ */
+static inline unsigned int stats_bucket(uint64_t value) {
+    unsigned int shift;
+
+    if(value < STATS_SUB_BUCKET_COUNT) {
+	return (unsigned int)value;
+    }
+
+    shift = 63 - __builtin_clzll(value) - STATS_SUB_BUCKET_BITS;
+    return (shift + 1) * STATS_SUB_BUCKET_COUNT + (unsigned int)((value >> shift) & (STATS_SUB_BUCKET_COUNT - 1));
+}
+
+/*
+ * Middle value of the range covered by a bucket
+ */
+static uint64_t stats_bucket_value(unsigned int idx) {
+    unsigned int shift;
+    uint64_t lower;
+
+    if(idx < STATS_SUB_BUCKET_COUNT) {
+	return idx;
+    }
+
+    shift = idx / STATS_SUB_BUCKET_COUNT - 1;
+    lower = (uint64_t)(STATS_SUB_BUCKET_COUNT + idx % STATS_SUB_BUCKET_COUNT) << shift;
+    return lower + (((uint64_t)1 << shift) >> 1);
+}
+
+/*
+ * Current time of the monotonic clock in nano seconds
+ */
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Add one value to the histogram, only relaxed atomic
+ * increments are used so no lock is taken.
+ */
+void stats_record(stats_histogram* h, uint64_t value) {
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[stats_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+    while(value > max) {
+	if(__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	    break;
+	}
+    }
+}
+
+/*
+ * Get the value at given percentile. The total is summed
+ * from the buckets, so a concurrent stats_record can not
+ * move the result out of the recorded range.
+ */
+uint64_t stats_percentile(const stats_histogram* h, double percentile) {
+    uint64_t total = 0;
+    uint64_t target, seen = 0;
+    unsigned int i;
+
+    for(i = 0; i < STATS_BUCKET_COUNT; i++) {
+	total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    }
+
+    if(0 == total) {
+	return 0;
+    }
+
+    if(percentile >= 100.0) {
+	return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    }
+
+    target = (uint64_t)(percentile / 100.0 * (double)total);
+    if(target >= total) {
+	target = total - 1;
+    }
+
+    for(i = 0; i < STATS_BUCKET_COUNT; i++) {
+	seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+	if(seen > target) {
+	    return stats_bucket_value(i);
+	}
+    }
+
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+/*
+ * Format the main percentiles in micro seconds
+ */
+int stats_format(const stats_histogram* h, char* buf, size_t len) {
+    int ret = snprintf(buf, len, "count=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu",
+	    (unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED),
+	    (unsigned long long)(stats_percentile(h, 50.0) / 1000),
+	    (unsigned long long)(stats_percentile(h, 90.0) / 1000),
+	    (unsigned long long)(stats_percentile(h, 99.0) / 1000),
+	    (unsigned long long)(stats_percentile(h, 99.9) / 1000),
+	    (unsigned long long)(__atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1000));
+
+    if(0 > ret || (size_t)ret >= len) {
+	return STATS_ERROR;
+    }
+
+    return ret;
+}
+
+/*
+ * Clear all values
+ */
+void stats_reset(stats_histogram* h) {
+    unsigned int i;
+
+    for(i = 0; i < STATS_BUCKET_COUNT; i++) {
+	__atomic_store_n(&h->buckets[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Build the redis key stats/<service>/<instance>
+ */
+int stats_key(char* buf, size_t len, const char* service, const char* instance) {
+    int ret;
+
+    if(NULL == instance) {
+	ret = snprintf(buf, len, "%s/%s", STATS_KEY_PREFIX, service);
+    } else {
+	ret = snprintf(buf, len, "%s/%s/%s", STATS_KEY_PREFIX, service, instance);
+    }
+
+    if(0 > ret || (size_t)ret >= len) {
+	return STATS_ERROR;
+    }
+
+    return STATS_OK;
+}
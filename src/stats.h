@@ -0,0 +1,132 @@
+/*
+ * Copyright lzh88998 and distributed under Apache 2.0 license
+ *
+ * stats keeps latency histograms for the critical paths of
+ * micro services. Values are recorded in nano seconds into
+ * log linear buckets (HDR style): each power of 2 range is
+ * split into STATS_SUB_BUCKET_COUNT linear sub buckets, so
+ * the relative error of a percentile is below
+ * 1 / STATS_SUB_BUCKET_COUNT for any value.
+ *
+ * Recording is lock free and only increments counters, it
+ * can be called from any thread. Micro services publish
+ * the percentiles periodically to the redis hash
+ * stats/<service>/<instance>.
+ *
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Return values of stats functions
+ */
+#define STATS_OK						0
+#define STATS_ERROR						-1
+
+/*
+ * Bucket layout, STATS_SUB_BUCKET_BITS of 4 gives 16 sub
+ * buckets per power of 2 and covers the whole uint64_t
+ * range in 976 buckets.
+ */
+#define STATS_SUB_BUCKET_BITS			4
+#define STATS_SUB_BUCKET_COUNT			(1 << STATS_SUB_BUCKET_BITS)
+#define STATS_BUCKET_COUNT				((64 - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKET_COUNT)
+
+/*
+ * Redis key prefix and publish interval in seconds used
+ * by micro services
+ */
+#define STATS_KEY_PREFIX				"stats"
+#define STATS_PUBLISH_INTERVAL			10
+
+/*
+ * Buffer sizes for stats_key and stats_format
+ */
+#define STATS_KEY_SIZE					128
+#define STATS_TEXT_SIZE					160
+
+/*
+ * One histogram. Define it with STATS_HISTOGRAM_INIT as
+ * a static variable, no other initialization is needed.
+ */
+typedef struct {
+    const char* name;
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKET_COUNT];
+} stats_histogram;
+
+#define STATS_HISTOGRAM_INIT(name)		{ name, 0, 0, { 0 } }
+
+/*
+ * Current time of the monotonic clock in nano seconds,
+ * read through vDSO so it does not enter the kernel.
+ */
+uint64_t stats_now(void);
+
+/*
+ * Add one value to the histogram.
+ *
+ * Parameters:
+ * stats_histogram* h       Histogram to update
+ * uint64_t value           Value in nano seconds
+ */
+void stats_record(stats_histogram* h, uint64_t value);
+
+/*
+ * Add the time elapsed since start, start is a value
+ * returned by stats_now
+ */
+#define stats_record_since(h, start)	stats_record(h, stats_now() - (start))
+
+/*
+ * Get the value at given percentile
+ *
+ * Parameters:
+ * const stats_histogram* h Histogram to query
+ * double percentile        Percentile from 0 to 100
+ *
+ * Return value:
+ * Value in nano seconds, 0 when the histogram is empty
+ */
+uint64_t stats_percentile(const stats_histogram* h, double percentile);
+
+/*
+ * Format count, p50, p90, p99, p99.9 and max of the
+ * histogram as text, latency values are in micro seconds.
+ * E.g.: "count=120 p50=35 p90=60 p99=180 p999=400 max=420"
+ *
+ * Return value:
+ * Length of the text, or STATS_ERROR when buf is too small
+ */
+int stats_format(const stats_histogram* h, char* buf, size_t len);
+
+/*
+ * Clear all values, used after the percentiles are
+ * published so every publish covers one interval. Values
+ * recorded concurrently by other threads may be lost.
+ */
+void stats_reset(stats_histogram* h);
+
+/*
+ * Build the redis key stats/<service>/<instance>
+ *
+ * Parameters:
+ * char* buf                Output buffer
+ * size_t len               Size of the output buffer
+ * const char* service      Name of the micro service
+ * const char* instance     Instance name, e.g. controller
+ *                          IP address, NULL when there is
+ *                          only one instance
+ *
+ * Return value:
+ * STATS_OK when successful, STATS_ERROR when buf is too
+ * small
+ */
+int stats_key(char* buf, size_t len, const char* service, const char* instance);
+
+#endif
@@ -128,6 +128,10 @@ int main (int argc, char **argv) {
         redis_port = REDIS_PORT;
     }
 
+    if(LOG_RECORDER_OK != log_recorder_open(FLAG_KEY, NULL)) {
+        LOG_WARNING("Failed to open flight recorder!");
+    }
+
 l_start:
     LOG_DEBUG("Connect to Redis!");
     gs_sync_context = redisConnectWithTimeout(redis_ip, redis_port, timeout);
@@ -236,6 +240,7 @@ l_free_sync_redis:
 l_exit:
     if(!gs_exit) {    
         LOG_ERROR("Godown_keeper execution failed retry!");
+        log_recorder_dump();
         sleep(1);
         goto l_start;
     }
@@ -10,6 +10,9 @@
  * 
  */
  
+#define _GNU_SOURCE
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
@@ -18,40 +21,163 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <errno.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <event2/event.h>
+
+#define LOG_DEFAULT_MODULE          LOG_MODULE_SOCKET
 #include "log.h"
 #include "to_socket.h"
 
 
 /*
- * Initiatelize a socket descriptor with timeout configuration
- * specified for local network response time
+ * Default options, see TO_SOCKET_OPTIONS_DEFAULT
+ */
+static const to_socket_options gs_default_options = TO_SOCKET_OPTIONS_DEFAULT;
+
+/*
+ * Fill options with the default values
+ */
+void to_socket_default_options(to_socket_options* options) {
+    *options = gs_default_options;
+}
+
+/*
+ * Convert a timeout to milli seconds, rounding up so a 
+ * short timeout does not become 0
+ */
+static int to_timeval_ms(const struct timeval* tv) {
+    return (int)(tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000);
+}
+
+/*
+ * Current time of the monotonic clock in milli seconds
+ */
+static uint64_t to_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * Current time of the monotonic clock in micro seconds
+ */
+static uint64_t to_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Convert a timeval to micro seconds
+ */
+static uint64_t to_timeval_us(const struct timeval* tv) {
+    return (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+}
+
+/*
+ * Set one integer socket option
+ */
+static int to_set_int_option(to_socket_ctx socket_ctx, int level, int name, const char* desc, int value) {
+    if(0 > setsockopt(socket_ctx, level, name, &value, sizeof(value))) {
+        LOG_ERROR("Error setting %s to %d (%s)", desc, value, strerror(errno));
+        return TO_SOCKET_ERROR_SET_OPTIONS;
+    }
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Let close send RST and release the socket immediately
+ */
+static int to_set_linger_reset(to_socket_ctx socket_ctx) {
+    struct linger linger = { 1, 0 };
+    
+    if(0 > setsockopt(socket_ctx, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger))) {
+        LOG_ERROR("Error setting SO_LINGER (%s)", strerror(errno));
+        return TO_SOCKET_ERROR_SET_OPTIONS;
+    }
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Apply timeouts, keep alive and latency options to the
+ * socket. Zero values keep the system default.
+ */
+static int to_apply_options(to_socket_ctx socket_ctx, const to_socket_options* options) {
+    // set send & recv timeout
+    if(0 > setsockopt(socket_ctx, SOL_SOCKET, SO_SNDTIMEO, &options->send_timeout, sizeof(struct timeval))) {
+        LOG_ERROR("Error setting send timeout (%s)", strerror(errno));
+        return TO_SOCKET_ERROR_SET_OPTIONS;
+    }
+    
+    if(0 > setsockopt(socket_ctx, SOL_SOCKET, SO_RCVTIMEO, &options->recv_timeout, sizeof(struct timeval))) {
+        LOG_ERROR("Error setting receive timeout (%s)", strerror(errno));
+        return TO_SOCKET_ERROR_SET_OPTIONS;
+    }
+    
+    // keep alive is tuned per socket so the system wide 
+    // settings used by other connections are not touched
+    if(options->keepalive) {
+        if(TO_SOCKET_OK != to_set_int_option(socket_ctx, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1)) {
+            return TO_SOCKET_ERROR_SET_OPTIONS;
+        }
+        
+        if(0 < options->keepidle && TO_SOCKET_OK != to_set_int_option(socket_ctx, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", options->keepidle)) {
+            return TO_SOCKET_ERROR_SET_OPTIONS;
+        }
+        
+        if(0 < options->keepintvl && TO_SOCKET_OK != to_set_int_option(socket_ctx, IPPROTO_TCP, TCP_KEEPINTVL, "TCP_KEEPINTVL", options->keepintvl)) {
+            return TO_SOCKET_ERROR_SET_OPTIONS;
+        }
+        
+        if(0 < options->keepcnt && TO_SOCKET_OK != to_set_int_option(socket_ctx, IPPROTO_TCP, TCP_KEEPCNT, "TCP_KEEPCNT", options->keepcnt)) {
+            return TO_SOCKET_ERROR_SET_OPTIONS;
+        }
+    }
+    
+    if(0 < options->user_timeout && TO_SOCKET_OK != to_set_int_option(socket_ctx, IPPROTO_TCP, TCP_USER_TIMEOUT, "TCP_USER_TIMEOUT", options->user_timeout)) {
+        return TO_SOCKET_ERROR_SET_OPTIONS;
+    }
+    
+    if(options->nodelay && TO_SOCKET_OK != to_set_int_option(socket_ctx, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1)) {
+        return TO_SOCKET_ERROR_SET_OPTIONS;
+    }
+    
+    if(options->reset_on_close && TO_SOCKET_OK != to_set_linger_reset(socket_ctx)) {
+        return TO_SOCKET_ERROR_SET_OPTIONS;
+    }
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Create a non-blocking socket with given options and
+ * start connecting to given address.
  * 
  * Parameters:
- * const char* addr		IP address in character format. E.g.: 
- * 						"192.168.100.100"
+ * const char* addr		IP address in character format
  * int port				Port number for target address
+ * const to_socket_options* options	Options to apply
+ * int* in_progress		Set to 1 when the connection is not
+ * 						finished yet, otherwise 0
  * 
- * Return Value:		Socket descriptor if successful which
- * 						will be greater than 0. Otherwiese 
- * 						return error code defined in above 
- * 						section.
- * 
- * Note current timeout is set to 100ms.
+ * Return Value:		Socket descriptor if successful,
+ * 						otherwise error code
  */
- 
-to_socket_ctx to_connect(const char* addr, int port) {
-    // for 100ms
-    struct timeval timeout = { 0, 100000}; 
+static to_socket_ctx to_connect_start(const char* addr, int port, const to_socket_options* options, int* in_progress) {
     struct sockaddr_in target_addr;
     to_socket_ctx ret, socket_ctx;
     
-    fd_set myset;
-    int valopt; 
-    socklen_t lon; 
+    *in_progress = 0;
     
 	// initialize address struct
     memset(&target_addr, 0, sizeof(target_addr));
@@ -74,74 +200,149 @@ to_socket_ctx to_connect(const char* addr, int port) {
     LOG_DETAILS("Socket Family: %d", target_addr.sin_family);
     LOG_DETAILS("Socket Port: %d", target_addr.sin_port);
     
-    // set send & recv timeout
-    setsockopt(socket_ctx, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(struct timeval));
-    setsockopt(socket_ctx, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
-
-	// enable keep alive
-    setsockopt(socket_ctx, SOL_SOCKET, SO_KEEPALIVE, &ret, sizeof(ret));
+    if(TO_SOCKET_OK != (ret = to_apply_options(socket_ctx, options))) {
+        goto l_socket_cleanup;
+    }
     
     // Set non-blocking 
-    if( (ret = fcntl(socket_ctx, F_GETFL, NULL)) < 0) { 
-        LOG_ERROR("Error fcntl(..., F_GETFL) (%s)", strerror(errno)); 
-        ret = TO_SOCKET_ERROR_GET_OPTIONS;
-        goto l_socket_cleanup;
-    } 
-    ret |= O_NONBLOCK; 
-    if( fcntl(socket_ctx, F_SETFL, ret) < 0) { 
-        LOG_ERROR("Error fcntl(..., F_SETFL) (%s)", strerror(errno)); 
-        ret = TO_SOCKET_ERROR_SET_NONBLOCK;
+    if(TO_SOCKET_OK != (ret = to_set_nonblock(socket_ctx, 1))) { 
         goto l_socket_cleanup;
     } 
-    // Trying to connect with timeout 
+    
+    // Trying to connect
     ret = connect(socket_ctx, (struct sockaddr *)&target_addr, sizeof(target_addr)); 
     if (0 > ret) { 
-        if (EINPROGRESS == errno) { 
-            LOG_DEBUG("EINPROGRESS in connect() - selecting"); 
-			FD_ZERO(&myset); 
-			FD_SET(socket_ctx, &myset); 
-			ret = select(socket_ctx+1, NULL, &myset, NULL, &timeout); 
-			if (ret < 0 && EINTR != errno) { 
-				LOG_ERROR("Error connecting %d - %s", errno, strerror(errno)); 
-				ret = TO_SOCKET_ERROR_CONNECT;
-				goto l_socket_cleanup;
-			} 
-			else if (ret > 0) { 
-				// Socket selected for write 
-				lon = sizeof(int); 
-				if (getsockopt(socket_ctx, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) { 
-					LOG_ERROR("Error in getsockopt() %d - %s", errno, strerror(errno)); 
-					ret = TO_SOCKET_ERROR_GET_SOCKET_ERROR;
-					goto l_socket_cleanup;
-				} 
-				// Check the value returned... 
-				if (valopt) { 
-					LOG_ERROR("Error in delayed connection() %d - %s", valopt, strerror(valopt)); 
-					ret = TO_SOCKET_ERROR_SOCKET_ERROR;
-					goto l_socket_cleanup;
-				} 
-			} 
-			else { // ret <= 0 && EINTR == errno
-				LOG_ERROR("Timeout in select() - Cancelling!"); 
-				ret = TO_SOCKET_ERROR_CONNECT_TIMEOUT;
-				goto l_socket_cleanup;
-			} 
-        } 
-        else { 
+        if (EINPROGRESS != errno) { 
             LOG_ERROR("Error connecting %d - %s", errno, strerror(errno)); 
 			ret = TO_SOCKET_ERROR_CONNECT;
             goto l_socket_cleanup;
         } 
+        
+        *in_progress = 1;
     } // otherwise means connect successful
     
-    // Set to blocking mode again... 
-    if( (ret = fcntl(socket_ctx, F_GETFL, NULL)) < 0) { 
+    return socket_ctx;
+
+l_socket_cleanup:
+    if(0 > close(socket_ctx)) {
+	    LOG_ERROR("Error closing socket! Error no: %s", strerror(errno));
+    }
+    
+    return ret;
+}
+
+/*
+ * Check the result of a connection that finished in the
+ * background
+ * 
+ * Return Value:		TO_SOCKET_OK if connected, otherwise
+ * 						error code
+ */
+static int to_connect_result(to_socket_ctx socket_ctx) {
+    int valopt; 
+    socklen_t lon = sizeof(int); 
+    
+    if (getsockopt(socket_ctx, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) { 
+	LOG_ERROR("Error in getsockopt() %d - %s", errno, strerror(errno)); 
+	return TO_SOCKET_ERROR_GET_SOCKET_ERROR;
+    } 
+    
+    // Check the value returned... 
+    if (valopt) { 
+	LOG_ERROR("Error in delayed connection() %d - %s", valopt, strerror(valopt)); 
+	return TO_SOCKET_ERROR_SOCKET_ERROR;
+    } 
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Switch socket between blocking and non-blocking mode
+ */
+int to_set_nonblock(to_socket_ctx socket, int nonblock) {
+    int flags;
+    
+    if( (flags = fcntl(socket, F_GETFL, NULL)) < 0) { 
         LOG_ERROR("Error fcntl(..., F_GETFL) (%s)", strerror(errno)); 
-        goto l_socket_disconnect;
+        return TO_SOCKET_ERROR_GET_OPTIONS;
     } 
-    ret &= (~O_NONBLOCK); 
-    if( fcntl(socket_ctx, F_SETFL, ret) < 0) { 
+    
+    if(nonblock) {
+	flags |= O_NONBLOCK; 
+    } else {
+	flags &= (~O_NONBLOCK); 
+    }
+    
+    if( fcntl(socket, F_SETFL, flags) < 0) { 
         LOG_ERROR("Error fcntl(..., F_SETFL) (%s)", strerror(errno)); 
+        return TO_SOCKET_ERROR_SET_NONBLOCK;
+    } 
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Initiatelize a socket descriptor with timeout configuration
+ * specified for local network response time
+ * 
+ * Parameters:
+ * const char* addr		IP address in character format. E.g.: 
+ * 						"192.168.100.100"
+ * int port				Port number for target address
+ * const to_socket_options* options
+ * 						Socket options, NULL for the default
+ * 						options
+ * 
+ * Return Value:		Socket descriptor if successful which
+ * 						will be greater than 0. Otherwiese 
+ * 						return error code defined in above 
+ * 						section.
+ * 
+ * Note default timeout is 100ms.
+ */
+ 
+to_socket_ctx to_connect(const char* addr, int port, const to_socket_options* options) {
+    struct pollfd pfd;
+    to_socket_ctx ret, socket_ctx;
+    int in_progress;
+    
+    if(NULL == options) {
+	options = &gs_default_options;
+    }
+    
+    socket_ctx = to_connect_start(addr, port, options, &in_progress);
+    if(0 > socket_ctx) {
+	return socket_ctx;
+    }
+    
+    // Waiting for connection with timeout 
+    if (in_progress) { 
+	// poll has no FD_SETSIZE limit on the descriptor value
+	LOG_DEBUG("EINPROGRESS in connect() - polling"); 
+	pfd.fd = socket_ctx;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	ret = poll(&pfd, 1, to_timeval_ms(&options->connect_timeout)); 
+	if (ret < 0 && EINTR != errno) { 
+	    LOG_ERROR("Error connecting %d - %s", errno, strerror(errno)); 
+	    ret = TO_SOCKET_ERROR_CONNECT;
+	    goto l_socket_cleanup;
+	} 
+	else if (ret > 0) { 
+	    // Socket writable 
+	    if(TO_SOCKET_OK != (ret = to_connect_result(socket_ctx))) {
+		goto l_socket_cleanup;
+	    }
+	} 
+	else { // ret <= 0 && EINTR == errno
+	    LOG_ERROR("Timeout in poll() - Cancelling!"); 
+	    ret = TO_SOCKET_ERROR_CONNECT_TIMEOUT;
+	    goto l_socket_cleanup;
+	} 
+    } 
+    
+    // Set to blocking mode again... 
+    if(TO_SOCKET_OK != (ret = to_set_nonblock(socket_ctx, 0))) { 
         goto l_socket_disconnect;
     } 
     
@@ -153,9 +354,1356 @@ l_socket_disconnect:
     }
 
 l_socket_cleanup:
-    if(0 > close(socket_ctx)) {
-	    LOG_ERROR("Error closing socket! Error no: %s", strerror(errno));
-    }
+    to_abort(socket_ctx);
     
     return ret;
 }
+
+/*
+ * Called by libevent when the connecting socket becomes
+ * writable or the connect timeout expires
+ */
+static void to_connect_event(evutil_socket_t fd, short events, void* arg) {
+    to_connect_request* req = (to_connect_request*)arg;
+    to_connect_callback cb = req->cb;
+    void* cb_arg = req->arg;
+    to_socket_ctx ret = fd;
+    
+    event_free(req->ev);
+    req->ev = NULL;
+    req->socket = -1;
+    
+    if(events & EV_TIMEOUT) {
+	LOG_ERROR("Timeout in async connect() - Cancelling!"); 
+	ret = TO_SOCKET_ERROR_CONNECT_TIMEOUT;
+    } else {
+	ret = to_connect_result(fd);
+    }
+    
+    if(TO_SOCKET_OK != ret) {
+	to_abort(fd);
+	cb(ret, cb_arg);
+	return;
+    }
+    
+    LOG_DEBUG("Async connect finished, socket: %d", fd);
+    cb(fd, cb_arg);
+}
+
+/*
+ * Start connecting in the background and complete through
+ * given callback from the event loop
+ */
+int to_connect_async(to_connect_request* req, struct event_base* base, const char* addr, int port, const to_socket_options* options, to_connect_callback cb, void* arg) {
+    int in_progress;
+    
+    if(NULL == options) {
+	options = &gs_default_options;
+    }
+    
+    req->ev = NULL;
+    req->cb = cb;
+    req->arg = arg;
+    req->socket = to_connect_start(addr, port, options, &in_progress);
+    if(0 > req->socket) {
+	return req->socket;
+    }
+    
+    // even when already connected, complete from the event
+    // loop so the callback never runs inside this call
+    UNUSED(in_progress);
+    req->ev = event_new(base, req->socket, EV_WRITE, to_connect_event, req);
+    if(NULL == req->ev || 0 != event_add(req->ev, &options->connect_timeout)) {
+	LOG_ERROR("Error registering async connect event!");
+	to_connect_cancel(req);
+	return TO_SOCKET_ERROR_EVENT;
+    }
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Stop a pending async connect, the callback will not be
+ * called
+ */
+void to_connect_cancel(to_connect_request* req) {
+    if(NULL != req->ev) {
+	event_free(req->ev);
+	req->ev = NULL;
+    }
+    
+    if(0 <= req->socket) {
+	to_abort(req->socket);
+	req->socket = -1;
+    }
+}
+
+/*
+ * Receive the slot index sent by the controller after
+ * accept
+ */
+int to_recv_slot(to_socket_ctx socket) {
+    unsigned char slot;
+    ssize_t received;
+    
+    do {
+	received = recv(socket, &slot, 1, 0);
+    } while(0 > received && EINTR == errno);
+    
+    if(1 == received) {
+	return slot;
+    }
+    
+    if(0 == received) {
+	LOG_ERROR("Connection closed by peer before slot index!");
+	return TO_SOCKET_ERROR_CLOSED;
+    }
+    
+    if(EAGAIN == errno || EWOULDBLOCK == errno) {
+	LOG_ERROR("Timeout receiving slot index!");
+	return TO_SOCKET_ERROR_TIMEOUT;
+    }
+    
+    LOG_ERROR("Error receiving slot index %d - %s", errno, strerror(errno));
+    return TO_SOCKET_ERROR_RECV;
+}
+
+/*
+ * Build the key slots/<addr>/<port>
+ */
+int to_slot_key(char* buf, size_t len, const char* addr, int port) {
+    int ret = snprintf(buf, len, "%s/%s/%d", TO_SLOT_KEY_PREFIX, addr, port);
+    
+    if(0 > ret || (size_t)ret >= len) {
+	return TO_SOCKET_ERROR_ADDRESS;
+    }
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Close with RST
+ */
+void to_abort(to_socket_ctx socket) {
+    if(0 > socket) {
+	return;
+    }
+    
+    to_set_linger_reset(socket);
+    if(0 > close(socket)) {
+	LOG_ERROR("Error closing socket! Error no: %s", strerror(errno));
+    }
+}
+
+/*
+ * Initialize a reader on a connected socket
+ */
+void to_reader_init(to_reader* reader, to_socket_ctx socket, to_frame_decoder decoder, void* arg) {
+    reader->socket = socket;
+    reader->decoder = decoder;
+    reader->arg = arg;
+    reader->start = 0;
+    reader->end = 0;
+    reader->frames = 0;
+    reader->reads = 0;
+    reader->resyncs = 0;
+    reader->skipped = 0;
+}
+
+/*
+ * Decode the next buffered frame, when there is none make
+ * space at the end of the buffer for the next chunk
+ */
+int to_reader_frame(to_reader* reader, const unsigned char** frame) {
+    size_t available;
+    int ret;
+    
+    while(1) {
+	while(reader->start < reader->end) {
+	    available = reader->end - reader->start;
+	    ret = reader->decoder(reader->buffer + reader->start, available, reader->arg);
+	    if(0 < ret) {
+		*frame = reader->buffer + reader->start;
+		reader->start += ret;
+		reader->frames++;
+		return ret;
+	    }
+	    
+	    if(0 == ret) {
+		break;
+	    }
+	    
+	    if((size_t)-ret > available) {
+		ret = -(int)available;
+	    }
+	    
+	    LOG_DEBUG("Reader dropped %d bytes to resync", -ret);
+	    reader->start += -ret;
+	    reader->resyncs++;
+	    reader->skipped += -ret;
+	}
+	
+	// make space for the next chunk
+	if(reader->start == reader->end) {
+	    reader->start = 0;
+	    reader->end = 0;
+	} else if(TO_READER_BUFFER_SIZE == reader->end) {
+	    if(0 == reader->start) {
+		// buffer full without a whole frame
+		LOG_WARNING("Reader buffer full without frame, dropping 1 byte!");
+		reader->start = 1;
+		reader->resyncs++;
+		reader->skipped++;
+		continue;
+	    }
+	    
+	    memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+	    reader->end -= reader->start;
+	    reader->start = 0;
+	}
+	
+	return 0;
+    }
+}
+
+/*
+ * Get the next whole frame, receiving more bytes only when
+ * the buffer does not contain one
+ */
+int to_reader_next(to_reader* reader, const unsigned char** frame) {
+    ssize_t received;
+    int ret;
+    
+    while(1) {
+	// decode buffered bytes first
+	if(0 != (ret = to_reader_frame(reader, frame))) {
+	    return ret;
+	}
+	
+	received = recv(reader->socket, reader->buffer + reader->end, TO_READER_BUFFER_SIZE - reader->end, 0);
+	if(0 < received) {
+	    reader->end += received;
+	    reader->reads++;
+	    continue;
+	}
+	
+	if(0 == received) {
+	    LOG_ERROR("Connection closed by peer!");
+	    return TO_SOCKET_ERROR_CLOSED;
+	}
+	
+	if(EAGAIN == errno || EWOULDBLOCK == errno) {
+	    return TO_SOCKET_ERROR_TIMEOUT;
+	}
+	
+	if(EINTR == errno) {
+	    continue;
+	}
+	
+	LOG_ERROR("Error receiving data %d - %s", errno, strerror(errno));
+	return TO_SOCKET_ERROR_RECV;
+    }
+}
+
+/*
+ * Drop buffered bytes and everything the socket already
+ * received
+ */
+int to_reader_drain(to_reader* reader) {
+    ssize_t received;
+    int dropped = (int)(reader->end - reader->start);
+    
+    reader->start = 0;
+    reader->end = 0;
+    
+    while(1) {
+	received = recv(reader->socket, reader->buffer, TO_READER_BUFFER_SIZE, MSG_DONTWAIT);
+	if(0 < received) {
+	    dropped += received;
+	    continue;
+	}
+	
+	if(0 == received) {
+	    LOG_ERROR("Connection closed by peer!");
+	    return TO_SOCKET_ERROR_CLOSED;
+	}
+	
+	if(EAGAIN == errno || EWOULDBLOCK == errno) {
+	    break;
+	}
+	
+	if(EINTR == errno) {
+	    continue;
+	}
+	
+	LOG_ERROR("Error receiving data %d - %s", errno, strerror(errno));
+	return TO_SOCKET_ERROR_RECV;
+    }
+    
+    if(0 < dropped) {
+	LOG_DEBUG("Reader drained %d bytes", dropped);
+	reader->skipped += dropped;
+    }
+    
+    return dropped;
+}
+
+/*
+ * Send all data described by iov, partial writes advance
+ * iov to the first byte not sent yet
+ */
+int to_sendv(to_socket_ctx socket, struct iovec* iov, int count) {
+    ssize_t sent;
+    int total = 0;
+    
+    while(0 < count) {
+	sent = writev(socket, iov, count);
+	if(0 > sent) {
+	    if(EINTR == errno) {
+		continue;
+	    }
+	    
+	    LOG_ERROR("Error sending data %d - %s", errno, strerror(errno));
+	    return TO_SOCKET_ERROR_SEND;
+	}
+	
+	total += sent;
+	
+	// skip entries sent completely
+	while(0 < count && (size_t)sent >= iov->iov_len) {
+	    sent -= iov->iov_len;
+	    iov++;
+	    count--;
+	}
+	
+	if(0 < count) {
+	    LOG_DEBUG("Partial send, %d bytes sent", total);
+	    iov->iov_base = (char*)iov->iov_base + sent;
+	    iov->iov_len -= sent;
+	}
+    }
+    
+    return total;
+}
+
+/*
+ * Initialize a writer on a connected socket
+ */
+void to_writer_init(to_writer* writer, to_socket_ctx socket) {
+    writer->socket = socket;
+    writer->len = 0;
+    writer->flushes = 0;
+}
+
+/*
+ * Append one command to the writer
+ */
+int to_writer_write(to_writer* writer, const void* data, size_t len) {
+    struct iovec iov[2];
+    int ret;
+    
+    if(TO_WRITER_BUFFER_SIZE - writer->len >= len) {
+	memcpy(writer->buffer + writer->len, data, len);
+	writer->len += len;
+	return (int)len;
+    }
+    
+    if(TO_WRITER_BUFFER_SIZE >= len) {
+	if(0 > to_writer_flush(writer)) {
+	    return TO_SOCKET_ERROR_SEND;
+	}
+	
+	memcpy(writer->buffer, data, len);
+	writer->len = len;
+	return (int)len;
+    }
+    
+    // too large for the buffer, send buffered commands and
+    // this one together
+    iov[0].iov_base = writer->buffer;
+    iov[0].iov_len = writer->len;
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    writer->len = 0;
+    writer->flushes++;
+    
+    ret = to_sendv(writer->socket, iov, 2);
+    if(0 > ret) {
+	return ret;
+    }
+    
+    return (int)len;
+}
+
+/*
+ * Send all buffered commands with one system call when
+ * the socket accepts them at once
+ */
+int to_writer_flush(to_writer* writer) {
+    struct iovec iov;
+    
+    if(0 == writer->len) {
+	return 0;
+    }
+    
+    iov.iov_base = writer->buffer;
+    iov.iov_len = writer->len;
+    writer->len = 0;
+    writer->flushes++;
+    
+    return to_sendv(writer->socket, &iov, 1);
+}
+
+#if TO_IO_URING
+/*
+ * Kind of io_uring request of a gateway connection, stored
+ * in the low bits of user_data next to the connection 
+ * pointer. user_data 0 is the wait timeout.
+ */
+#define TO_GATEWAY_OP_READ			1
+#define TO_GATEWAY_OP_POLL			2
+#define TO_GATEWAY_OP_CANCEL		3
+#define TO_GATEWAY_OP_MASK			3
+
+/*
+ * Create the ring of a gateway, the reader buffers are
+ * registered by the first run
+ */
+static int to_gateway_ring_init(to_gateway* gw) {
+    gw->use_ring = 0;
+    gw->buffers_registered = 0;
+    
+    if(TO_URING_OK != to_uring_init(&gw->ring, TO_GATEWAY_URING_ENTRIES)) {
+	return TO_SOCKET_ERROR_EVENT;
+    }
+    
+    gw->use_ring = 1;
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Register the reader buffers of the connections, so the
+ * kernel receives into them with IORING_OP_READ_FIXED 
+ * without mapping the pages for every read and without
+ * copy. Done once, before any read is queued, as the
+ * registered buffers cannot be changed while requests 
+ * use them. Without registered buffers IORING_OP_RECV is
+ * used.
+ */
+static void to_gateway_register_buffers(to_gateway* gw) {
+    struct iovec iov[TO_GATEWAY_URING_BUFFERS];
+    to_gateway_conn* conn;
+    int count = 0;
+    
+    gw->buffers_registered = 1;
+    for(conn = gw->conns; NULL != conn && TO_GATEWAY_URING_BUFFERS > count; conn = conn->next) {
+	iov[count].iov_base = conn->reader.buffer;
+	iov[count].iov_len = TO_READER_BUFFER_SIZE;
+	count++;
+    }
+    
+    if(0 == count || TO_URING_OK != to_uring_register_buffers(&gw->ring, iov, count)) {
+	return;
+    }
+    
+    count = 0;
+    for(conn = gw->conns; NULL != conn && TO_GATEWAY_URING_BUFFERS > count; conn = conn->next) {
+	conn->buffer = count++;
+    }
+}
+
+/*
+ * Queue one request of a connection, it is submitted by 
+ * the next wait of the ring
+ */
+static int to_gateway_queue(to_gateway* gw, to_gateway_conn* conn, int op) {
+    struct io_uring_sqe* sqe = to_uring_sqe(&gw->ring);
+    
+    if(NULL == sqe) {
+	LOG_ERROR("Failed to queue io_uring request!");
+	return TO_SOCKET_ERROR_EVENT;
+    }
+    
+    sqe->user_data = (uintptr_t)conn | op;
+    
+    switch(op) {
+	case TO_GATEWAY_OP_READ:
+	    // to_reader_frame made space at the end of the buffer
+	    sqe->fd = conn->socket;
+	    sqe->addr = (uintptr_t)(conn->reader.buffer + conn->reader.end);
+	    sqe->len = to_reader_space(&conn->reader);
+	    if(0 <= conn->buffer) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = conn->buffer;
+	    } else {
+		sqe->opcode = IORING_OP_RECV;
+	    }
+	    break;
+	case TO_GATEWAY_OP_POLL:
+	    sqe->opcode = IORING_OP_POLL_ADD;
+	    sqe->fd = conn->socket;
+	    sqe->poll32_events = POLLOUT;
+	    break;
+	default:
+	    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	    sqe->fd = -1;
+	    sqe->addr = (uintptr_t)conn | conn->pending;
+	    return TO_SOCKET_OK;
+    }
+    
+    conn->pending = op;
+    return TO_SOCKET_OK;
+}
+#endif
+
+/*
+ * Create the epoll instance of a gateway, or the ring when
+ * built with io_uring and the kernel supports it
+ */
+int to_gateway_init(to_gateway* gw) {
+    gw->conns = NULL;
+    
+#if TO_IO_URING
+    if(TO_SOCKET_OK == to_gateway_ring_init(gw)) {
+	LOG_INFO("Gateway uses io_uring");
+	gw->epfd = -1;
+	return TO_SOCKET_OK;
+    }
+    LOG_WARNING("io_uring not available, fallback to epoll!");
+#endif
+    
+    gw->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(0 > gw->epfd) {
+	LOG_ERROR("Error creating epoll instance %d - %s", errno, strerror(errno));
+	return TO_SOCKET_ERROR_EVENT;
+    }
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Add one connection, it is started by the next run
+ */
+void to_gateway_add(to_gateway* gw, to_gateway_conn* conn, const char* addr, int port, const to_socket_options* options, to_frame_decoder decoder, to_gateway_frame_callback on_frame, to_gateway_state_callback on_state, void* arg) {
+    conn->addr = addr;
+    conn->port = port;
+    conn->options = (NULL == options) ? gs_default_options : *options;
+    conn->state = TO_GATEWAY_STATE_IDLE;
+    conn->socket = -1;
+    conn->deadline = 0;
+    conn->connects = 0;
+    conn->on_frame = on_frame;
+    conn->on_state = on_state;
+    conn->arg = arg;
+    to_reader_init(&conn->reader, -1, decoder, conn);
+    
+#if TO_IO_URING
+    conn->pending = 0;
+    conn->buffer = -1;
+#endif
+    
+    conn->next = gw->conns;
+    gw->conns = conn;
+}
+
+/*
+ * Close the socket of a connection and schedule the retry
+ */
+static void to_gateway_drop(to_gateway* gw, to_gateway_conn* conn, int error) {
+    LOG_WARNING("Connection to %s:%d lost (%d), retry in %dms", conn->addr, conn->port, error, TO_GATEWAY_RETRY_INTERVAL);
+    
+    if(0 <= gw->epfd && 0 > epoll_ctl(gw->epfd, EPOLL_CTL_DEL, conn->socket, NULL)) {
+	LOG_ERROR("Error removing socket from epoll %d - %s", errno, strerror(errno));
+    }
+    
+#if TO_IO_URING
+    // the request keeps the socket open until it completes
+    if(0 != conn->pending) {
+	to_gateway_queue(gw, conn, TO_GATEWAY_OP_CANCEL);
+    }
+#endif
+    
+    to_abort(conn->socket);
+    
+    conn->socket = -1;
+    conn->state = TO_GATEWAY_STATE_IDLE;
+    conn->deadline = to_now_ms() + TO_GATEWAY_RETRY_INTERVAL;
+    
+    if(NULL != conn->on_state) {
+	conn->on_state(conn, error);
+    }
+}
+
+/*
+ * Restart one connection right away
+ */
+void to_gateway_reset(to_gateway* gw, to_gateway_conn* conn) {
+    LOG_INFO("Restarting connection to %s:%d", conn->addr, conn->port);
+    
+    if(TO_GATEWAY_STATE_IDLE != conn->state) {
+	to_gateway_drop(gw, conn, TO_SOCKET_ERROR_CLOSED);
+    }
+    
+    conn->deadline = to_now_ms();
+}
+
+/*
+ * Switch a connection to connected state, waiting for 
+ * readable from now on
+ */
+static int to_gateway_connected(to_gateway* gw, to_gateway_conn* conn) {
+    struct epoll_event ev;
+    
+    to_reader_init(&conn->reader, conn->socket, conn->reader.decoder, conn);
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if(0 <= gw->epfd && 0 > epoll_ctl(gw->epfd, EPOLL_CTL_MOD, conn->socket, &ev)) {
+	LOG_ERROR("Error modifying epoll socket %d - %s", errno, strerror(errno));
+	return TO_SOCKET_ERROR_EVENT;
+    }
+    
+#if TO_IO_URING
+    if(gw->use_ring && TO_SOCKET_OK != to_gateway_queue(gw, conn, TO_GATEWAY_OP_READ)) {
+	return TO_SOCKET_ERROR_EVENT;
+    }
+#endif
+    
+    LOG_INFO("Connected to %s:%d, socket: %d", conn->addr, conn->port, conn->socket);
+    conn->state = TO_GATEWAY_STATE_CONNECTED;
+    conn->deadline = 0;
+    conn->connects++;
+    
+    if(NULL != conn->on_state) {
+	conn->on_state(conn, TO_SOCKET_OK);
+    }
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Start the non-blocking connect of an idle connection
+ */
+static void to_gateway_start(to_gateway* gw, to_gateway_conn* conn) {
+    struct epoll_event ev;
+    int in_progress, ret;
+    
+    LOG_DEBUG("Connecting to %s:%d", conn->addr, conn->port);
+    conn->socket = to_connect_start(conn->addr, conn->port, &conn->options, &in_progress);
+    if(0 > conn->socket) {
+	ret = conn->socket;
+	conn->socket = -1;
+	conn->deadline = to_now_ms() + TO_GATEWAY_RETRY_INTERVAL;
+	if(NULL != conn->on_state) {
+	    conn->on_state(conn, ret);
+	}
+	return;
+    }
+    
+    // also registered when connected immediately, so
+    // to_gateway_connected only needs to modify it
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    if(0 <= gw->epfd) {
+	ret = epoll_ctl(gw->epfd, EPOLL_CTL_ADD, conn->socket, &ev);
+	if(0 > ret) {
+	    LOG_ERROR("Error adding socket to epoll %d - %s", errno, strerror(errno));
+	}
+    } else {
+	ret = TO_SOCKET_OK;
+#if TO_IO_URING
+	if(in_progress) {
+	    ret = to_gateway_queue(gw, conn, TO_GATEWAY_OP_POLL);
+	}
+#endif
+    }
+    
+    if(0 > ret) {
+	to_abort(conn->socket);
+	conn->socket = -1;
+	conn->deadline = to_now_ms() + TO_GATEWAY_RETRY_INTERVAL;
+	return;
+    }
+    
+    conn->state = TO_GATEWAY_STATE_CONNECTING;
+    conn->deadline = to_now_ms() + to_timeval_ms(&conn->options.connect_timeout);
+    
+    if(!in_progress && TO_SOCKET_OK != (ret = to_gateway_connected(gw, conn))) {
+	to_gateway_drop(gw, conn, ret);
+    }
+}
+
+/*
+ * Read all available data of a connection and dispatch the
+ * frames
+ * 
+ * Return Value:		Count of frames dispatched, or the
+ * 						negative value returned by on_frame
+ */
+static int to_gateway_read(to_gateway* gw, to_gateway_conn* conn) {
+    const unsigned char* frame;
+    int ret, count = 0;
+    
+    while(0 < (ret = to_reader_next(&conn->reader, &frame))) {
+	count++;
+	if(0 > (ret = conn->on_frame(conn, frame, ret))) {
+	    return ret;
+	}
+    }
+    
+    // timeout means the non-blocking socket is drained
+    if(TO_SOCKET_ERROR_TIMEOUT != ret) {
+	to_gateway_drop(gw, conn, ret);
+    }
+    
+    return count;
+}
+
+/*
+ * Wait for epoll events and dispatch them
+ * 
+ * Return Value:		Count of frames dispatched, or the
+ * 						negative value returned by on_frame
+ * 						or TO_SOCKET_ERROR_EVENT
+ */
+static int to_gateway_wait_epoll(to_gateway* gw, int timeout) {
+    struct epoll_event events[TO_GATEWAY_MAX_EVENTS];
+    to_gateway_conn* conn;
+    int i, n, ret, count = 0;
+    
+    n = epoll_wait(gw->epfd, events, TO_GATEWAY_MAX_EVENTS, timeout);
+    if(0 > n) {
+	if(EINTR == errno) {
+	    return 0;
+	}
+	
+	LOG_ERROR("Error in epoll_wait %d - %s", errno, strerror(errno));
+	return TO_SOCKET_ERROR_EVENT;
+    }
+    
+    for(i = 0; i < n; i++) {
+	conn = (to_gateway_conn*)events[i].data.ptr;
+	
+	if(TO_GATEWAY_STATE_CONNECTING == conn->state) {
+	    if(TO_SOCKET_OK != (ret = to_connect_result(conn->socket)) 
+		|| TO_SOCKET_OK != (ret = to_gateway_connected(gw, conn))) {
+		to_gateway_drop(gw, conn, ret);
+	    }
+	    continue;
+	}
+	
+	// errors and hang up are reported by recv
+	if(0 > (ret = to_gateway_read(gw, conn))) {
+	    return ret;
+	}
+	count += ret;
+    }
+    
+    return count;
+}
+
+#if TO_IO_URING
+/*
+ * Process one completion of the ring
+ * 
+ * Return Value:		Count of frames dispatched, or the
+ * 						negative value returned by on_frame
+ */
+static int to_gateway_complete(to_gateway* gw, uint64_t user_data, int res) {
+    to_gateway_conn* conn = (to_gateway_conn*)(uintptr_t)(user_data & ~(uint64_t)TO_GATEWAY_OP_MASK);
+    int op = (int)(user_data & TO_GATEWAY_OP_MASK);
+    const unsigned char* frame;
+    int ret = 0, count = 0;
+    
+    // wait timeout and cancel requests
+    if(NULL == conn || TO_GATEWAY_OP_CANCEL == op) {
+	return 0;
+    }
+    
+    conn->pending = 0;
+    
+    if(TO_GATEWAY_OP_POLL == op) {
+	// a connect timeout dropped the connection already
+	if(TO_GATEWAY_STATE_CONNECTING != conn->state) {
+	    return 0;
+	}
+	
+	if(TO_SOCKET_OK != (ret = to_connect_result(conn->socket)) 
+	    || TO_SOCKET_OK != (ret = to_gateway_connected(gw, conn))) {
+	    to_gateway_drop(gw, conn, ret);
+	}
+	return 0;
+    }
+    
+    if(TO_GATEWAY_STATE_CONNECTED != conn->state) {
+	return 0;
+    }
+    
+    if(0 == res) {
+	LOG_ERROR("Connection closed by peer!");
+	to_gateway_drop(gw, conn, TO_SOCKET_ERROR_CLOSED);
+	return 0;
+    }
+    
+    if(0 > res && -EINTR != res && -EAGAIN != res) {
+	LOG_ERROR("Error receiving data %d - %s", -res, strerror(-res));
+	to_gateway_drop(gw, conn, TO_SOCKET_ERROR_RECV);
+	return 0;
+    }
+    
+    if(0 < res) {
+	// received in place at the end of the reader buffer
+	conn->reader.end += res;
+	conn->reader.reads++;
+	
+	while(0 < (ret = to_reader_frame(&conn->reader, &frame))) {
+	    count++;
+	    if(0 > (ret = conn->on_frame(conn, frame, ret))) {
+		break;
+	    }
+	}
+    }
+    
+    // after an on_frame error the buffer may still be full
+    if(0 < to_reader_space(&conn->reader) && TO_SOCKET_OK != to_gateway_queue(gw, conn, TO_GATEWAY_OP_READ)) {
+	to_gateway_drop(gw, conn, TO_SOCKET_ERROR_EVENT);
+    }
+    
+    return (0 > ret) ? ret : count;
+}
+
+/*
+ * Submit the queued requests and wait for completions with
+ * one system call, then dispatch all completions
+ * 
+ * Return Value:		Count of frames dispatched, or the
+ * 						negative value returned by on_frame
+ * 						or TO_SOCKET_ERROR_EVENT
+ */
+static int to_gateway_wait_ring(to_gateway* gw, int timeout) {
+    struct io_uring_sqe* sqe;
+    struct io_uring_cqe* cqe;
+    uint64_t user_data;
+    int res, ret, count = 0;
+    
+    // ends with the first completion or after timeout
+    if(0 < timeout) {
+	sqe = to_uring_sqe(&gw->ring);
+	if(NULL == sqe) {
+	    return TO_SOCKET_ERROR_EVENT;
+	}
+	
+	gw->timeout.tv_sec = timeout / 1000;
+	gw->timeout.tv_nsec = (timeout % 1000) * 1000000LL;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)&gw->timeout;
+	sqe->len = 1;
+	sqe->off = 1;
+	sqe->user_data = 0;
+    }
+    
+    if(0 > to_uring_enter(&gw->ring, 0 == timeout ? 0 : 1)) {
+	return TO_SOCKET_ERROR_EVENT;
+    }
+    
+    while(NULL != (cqe = to_uring_cqe(&gw->ring))) {
+	user_data = cqe->user_data;
+	res = cqe->res;
+	to_uring_cqe_seen(&gw->ring);
+	
+	if(0 > (ret = to_gateway_complete(gw, user_data, res))) {
+	    return ret;
+	}
+	count += ret;
+    }
+    
+    return count;
+}
+#endif
+
+/*
+ * Wait for socket events and advance the state machines
+ */
+int to_gateway_run(to_gateway* gw, int timeout) {
+    to_gateway_conn* conn;
+    uint64_t now;
+    int count;
+    
+#if TO_IO_URING
+    if(gw->use_ring && !gw->buffers_registered) {
+	to_gateway_register_buffers(gw);
+    }
+#endif
+    
+    // wake up for the nearest connect timeout or retry
+    now = to_now_ms();
+    for(conn = gw->conns; NULL != conn; conn = conn->next) {
+	if(TO_GATEWAY_STATE_CONNECTED == conn->state) {
+	    continue;
+	}
+	
+	if(conn->deadline <= now) {
+	    timeout = 0;
+	    break;
+	}
+	
+	if(0 > timeout || conn->deadline - now < (uint64_t)timeout) {
+	    timeout = (int)(conn->deadline - now);
+	}
+    }
+    
+#if TO_IO_URING
+    count = gw->use_ring ? to_gateway_wait_ring(gw, timeout) : to_gateway_wait_epoll(gw, timeout);
+#else
+    count = to_gateway_wait_epoll(gw, timeout);
+#endif
+    if(0 > count) {
+	return count;
+    }
+    
+    // expire connect timeouts and start retries
+    now = to_now_ms();
+    for(conn = gw->conns; NULL != conn; conn = conn->next) {
+	if(TO_GATEWAY_STATE_CONNECTED == conn->state || conn->deadline > now) {
+	    continue;
+	}
+	
+#if TO_IO_URING
+	// wait until the cancelled request released the socket
+	if(TO_GATEWAY_STATE_IDLE == conn->state && 0 != conn->pending) {
+	    continue;
+	}
+#endif
+	
+	if(TO_GATEWAY_STATE_CONNECTING == conn->state) {
+	    LOG_ERROR("Timeout connecting to %s:%d", conn->addr, conn->port);
+	    to_gateway_drop(gw, conn, TO_SOCKET_ERROR_CONNECT_TIMEOUT);
+	} else {
+	    to_gateway_start(gw, conn);
+	}
+    }
+    
+    return count;
+}
+
+/*
+ * Close all connections and the epoll instance or ring
+ */
+void to_gateway_close(to_gateway* gw) {
+    to_gateway_conn* conn;
+    
+    for(conn = gw->conns; NULL != conn; conn = conn->next) {
+	to_abort(conn->socket);
+	conn->socket = -1;
+	conn->state = TO_GATEWAY_STATE_IDLE;
+    }
+    
+#if TO_IO_URING
+    // closing the ring cancels the running requests
+    if(gw->use_ring) {
+	LOG_INFO("io_uring enters: %lu, requests: %lu", gw->ring.enters, gw->ring.submitted);
+	to_uring_close(&gw->ring);
+	gw->use_ring = 0;
+    }
+#endif
+    
+    if(0 <= gw->epfd && 0 > close(gw->epfd)) {
+	LOG_ERROR("Error closing epoll instance! Error no: %s", strerror(errno));
+    }
+    gw->epfd = -1;
+    gw->conns = NULL;
+}
+
+/*
+ * Keep the timeout in the configured bounds
+ */
+static void to_rtt_clamp(to_rtt* rtt) {
+    if(rtt->timeout < rtt->min_timeout) {
+	rtt->timeout = rtt->min_timeout;
+    }
+    
+    if(rtt->timeout > rtt->max_timeout) {
+	rtt->timeout = rtt->max_timeout;
+    }
+}
+
+/*
+ * Initialize an estimate with the timeout of options
+ */
+void to_rtt_init(to_rtt* rtt, const to_socket_options* options) {
+    if(NULL == options) {
+	options = &gs_default_options;
+    }
+    
+    rtt->srtt = 0;
+    rtt->rttvar = 0;
+    rtt->timeout = to_timeval_us(&options->recv_timeout);
+    rtt->min_timeout = to_timeval_us(&options->min_timeout);
+    rtt->max_timeout = to_timeval_us(&options->max_timeout);
+    rtt->start = 0;
+    rtt->applied = 0;
+    rtt->samples = 0;
+    rtt->backoffs = 0;
+    to_rtt_clamp(rtt);
+}
+
+/*
+ * Update smoothed round trip time and variance, then 
+ * derive the timeout
+ */
+void to_rtt_sample(to_rtt* rtt, uint64_t sample) {
+    uint64_t delta, var;
+    
+    if(0 == rtt->samples) {
+	rtt->srtt = sample;
+	rtt->rttvar = sample / 2;
+    } else {
+	delta = (rtt->srtt > sample) ? rtt->srtt - sample : sample - rtt->srtt;
+	rtt->rttvar = (3 * rtt->rttvar + delta) / 4;
+	rtt->srtt = (7 * rtt->srtt + sample) / 8;
+    }
+    
+    rtt->samples++;
+    var = 4 * rtt->rttvar;
+    rtt->timeout = rtt->srtt + (var > TO_RTT_GRANULARITY ? var : TO_RTT_GRANULARITY);
+    to_rtt_clamp(rtt);
+    
+    LOG_DETAILS("RTT sample %lluus srtt %lluus rttvar %lluus timeout %lluus", 
+	(unsigned long long)sample, (unsigned long long)rtt->srtt, 
+	(unsigned long long)rtt->rttvar, (unsigned long long)rtt->timeout);
+}
+
+/*
+ * Start measuring a round trip
+ */
+void to_rtt_start(to_rtt* rtt) {
+    rtt->start = to_now_us();
+}
+
+/*
+ * Sample the round trip started by to_rtt_start
+ */
+void to_rtt_stop(to_rtt* rtt) {
+    if(0 == rtt->start) {
+	return;
+    }
+    
+    to_rtt_sample(rtt, to_now_us() - rtt->start);
+    rtt->start = 0;
+}
+
+/*
+ * Double the timeout after a timed out round trip
+ */
+void to_rtt_backoff(to_rtt* rtt) {
+    rtt->start = 0;
+    rtt->backoffs++;
+    rtt->timeout *= 2;
+    to_rtt_clamp(rtt);
+    
+    LOG_WARNING("RTT timeout backed off to %lluus", (unsigned long long)rtt->timeout);
+}
+
+/*
+ * Current timeout as timeval
+ */
+void to_rtt_timeval(const to_rtt* rtt, struct timeval* tv) {
+    tv->tv_sec = rtt->timeout / 1000000;
+    tv->tv_usec = rtt->timeout % 1000000;
+}
+
+/*
+ * Copy the timeout into options used by to_connect, the
+ * socket created with them already has it applied
+ */
+void to_rtt_options(to_rtt* rtt, to_socket_options* options) {
+    to_rtt_timeval(rtt, &options->connect_timeout);
+    options->send_timeout = options->connect_timeout;
+    options->recv_timeout = options->connect_timeout;
+    rtt->applied = rtt->timeout;
+}
+
+/*
+ * Set the timeout on the socket when it changed
+ */
+int to_rtt_apply(to_rtt* rtt, to_socket_ctx socket) {
+    struct timeval tv;
+    
+    if(rtt->timeout == rtt->applied) {
+	return TO_SOCKET_OK;
+    }
+    
+    to_rtt_timeval(rtt, &tv);
+    if(0 > setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+	LOG_ERROR("Error setting receive timeout (%s)", strerror(errno));
+	return TO_SOCKET_ERROR_SET_OPTIONS;
+    }
+    
+    if(0 > setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+	LOG_ERROR("Error setting send timeout (%s)", strerror(errno));
+	return TO_SOCKET_ERROR_SET_OPTIONS;
+    }
+    
+    rtt->applied = rtt->timeout;
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Called by libevent every heartbeat interval
+ */
+static void to_heartbeat_event(evutil_socket_t fd, short events, void* arg) {
+    to_heartbeat* hb = (to_heartbeat*)arg;
+    int ret;
+    
+    UNUSED(fd);
+    UNUSED(events);
+    
+    if(hb->active) {
+	hb->active = 0;
+	hb->misses = 0;
+	return;
+    }
+    
+    hb->probes++;
+    ret = hb->probe(hb->arg);
+    if(0 <= ret) {
+	hb->misses = 0;
+	return;
+    }
+    
+    hb->missed++;
+    hb->misses++;
+    LOG_WARNING("Heartbeat missed %d of %d (%d)", hb->misses, hb->max_misses, ret);
+    if(hb->misses < hb->max_misses) {
+	return;
+    }
+    
+    LOG_ERROR("Heartbeat failed, device considered dead!");
+    event_del(hb->ev);
+    hb->on_failure(hb->arg);
+}
+
+/*
+ * Start the heartbeat timer
+ */
+int to_heartbeat_start(to_heartbeat* hb, struct event_base* base, const struct timeval* interval, int max_misses, to_heartbeat_probe probe, to_heartbeat_callback on_failure, void* arg) {
+    hb->interval = *interval;
+    hb->probe = probe;
+    hb->on_failure = on_failure;
+    hb->arg = arg;
+    hb->max_misses = max_misses;
+    hb->misses = 0;
+    hb->active = 0;
+    hb->probes = 0;
+    hb->missed = 0;
+    
+    hb->ev = event_new(base, -1, EV_PERSIST, to_heartbeat_event, hb);
+    if(NULL == hb->ev || 0 != event_add(hb->ev, interval)) {
+	LOG_ERROR("Error registering heartbeat timer!");
+	to_heartbeat_stop(hb);
+	return TO_SOCKET_ERROR_EVENT;
+    }
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Start the stopped timer again
+ */
+int to_heartbeat_resume(to_heartbeat* hb) {
+    hb->misses = 0;
+    hb->active = 0;
+    
+    if(NULL == hb->ev || 0 != event_add(hb->ev, &hb->interval)) {
+	LOG_ERROR("Error resuming heartbeat timer!");
+	return TO_SOCKET_ERROR_EVENT;
+    }
+    
+    return TO_SOCKET_OK;
+}
+
+/*
+ * Stop and free the heartbeat timer
+ */
+void to_heartbeat_stop(to_heartbeat* hb) {
+    if(NULL != hb->ev) {
+	event_free(hb->ev);
+	hb->ev = NULL;
+    }
+}
+
+static void to_standby_connect(to_standby* sb);
+
+/*
+ * Retry timer of the standby connection
+ */
+static void to_standby_timer(evutil_socket_t fd, short events, void* arg) {
+    to_standby* sb = (to_standby*)arg;
+    
+    UNUSED(fd);
+    UNUSED(events);
+    
+    event_free(sb->ev);
+    sb->ev = NULL;
+    to_standby_connect(sb);
+}
+
+/*
+ * Build the standby connection again after
+ * TO_STANDBY_RETRY_INTERVAL
+ */
+static void to_standby_retry(to_standby* sb) {
+    struct timeval interval = { TO_STANDBY_RETRY_INTERVAL, 0 };
+    
+    sb->ev = evtimer_new(sb->base, to_standby_timer, sb);
+    if(NULL == sb->ev || 0 != evtimer_add(sb->ev, &interval)) {
+	LOG_ERROR("Error registering standby retry timer, no standby for %s:%d!", sb->addr, sb->port);
+	if(NULL != sb->ev) {
+	    event_free(sb->ev);
+	    sb->ev = NULL;
+	}
+    }
+}
+
+/*
+ * Close a standby socket that is not usable any more
+ */
+static void to_standby_drop(to_standby* sb) {
+    if(NULL != sb->ev) {
+	event_free(sb->ev);
+	sb->ev = NULL;
+    }
+    
+    to_abort(sb->socket);
+    
+    sb->socket = -1;
+    sb->slot = -1;
+}
+
+/*
+ * Called when the idle standby socket is readable, the 
+ * first byte is the slot index, end of file means the 
+ * controller closed it
+ */
+static void to_standby_readable(evutil_socket_t fd, short events, void* arg) {
+    to_standby* sb = (to_standby*)arg;
+    unsigned char buffer[16];
+    ssize_t received;
+    
+    UNUSED(events);
+    
+    received = recv(fd, buffer, sizeof(buffer), 0);
+    if(0 < received) {
+	if(0 > sb->slot) {
+	    sb->slot = buffer[0];
+	    LOG_INFO("Standby connection to %s:%d ready, slot: %d", sb->addr, sb->port, sb->slot);
+	} else {
+	    LOG_WARNING("Standby connection to %s:%d dropped %d unexpected bytes", sb->addr, sb->port, (int)received);
+	}
+	return;
+    }
+    
+    if(0 > received && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) {
+	return;
+    }
+    
+    LOG_WARNING("Standby connection to %s:%d lost, rebuilding!", sb->addr, sb->port);
+    to_standby_drop(sb);
+    to_standby_retry(sb);
+}
+
+/*
+ * Called when the async connect of the standby finished
+ */
+static void to_standby_connected(to_socket_ctx socket, void* arg) {
+    to_standby* sb = (to_standby*)arg;
+    
+    if(0 > socket) {
+	LOG_WARNING("Standby connect to %s:%d failed %d, retry later!", sb->addr, sb->port, socket);
+	to_standby_retry(sb);
+	return;
+    }
+    
+    sb->socket = socket;
+    sb->slot = -1;
+    sb->ev = event_new(sb->base, socket, EV_READ | EV_PERSIST, to_standby_readable, sb);
+    if(NULL == sb->ev || 0 != event_add(sb->ev, NULL)) {
+	LOG_ERROR("Error registering standby read event!");
+	to_standby_drop(sb);
+	to_standby_retry(sb);
+    }
+}
+
+/*
+ * Start the async connect of a new standby
+ */
+static void to_standby_connect(to_standby* sb) {
+    LOG_DEBUG("Building standby connection to %s:%d", sb->addr, sb->port);
+    if(TO_SOCKET_OK != to_connect_async(&sb->req, sb->base, sb->addr, sb->port, &sb->options, to_standby_connected, sb)) {
+	to_standby_retry(sb);
+    }
+}
+
+/*
+ * Start building a standby connection in the background
+ */
+void to_standby_start(to_standby* sb, struct event_base* base, const char* addr, int port, const to_socket_options* options) {
+    sb->base = base;
+    sb->addr = addr;
+    sb->port = port;
+    sb->options = (NULL == options) ? gs_default_options : *options;
+    sb->req.ev = NULL;
+    sb->req.socket = -1;
+    sb->ev = NULL;
+    sb->socket = -1;
+    sb->slot = -1;
+    sb->takeovers = 0;
+    
+    to_standby_connect(sb);
+}
+
+/*
+ * Hand the ready standby socket over and build the next
+ * one
+ */
+to_socket_ctx to_standby_takeover(to_standby* sb) {
+    to_socket_ctx socket;
+    int ret;
+    
+    if(!to_standby_ready(sb)) {
+	LOG_WARNING("No standby connection to %s:%d ready!", sb->addr, sb->port);
+	return TO_SOCKET_ERROR_NO_STANDBY;
+    }
+    
+    event_free(sb->ev);
+    sb->ev = NULL;
+    socket = sb->socket;
+    sb->socket = -1;
+    sb->slot = -1;
+    
+    to_standby_connect(sb);
+    
+    if(TO_SOCKET_OK != (ret = to_set_nonblock(socket, 0))) {
+	to_abort(socket);
+	return ret;
+    }
+    
+    sb->takeovers++;
+    LOG_INFO("Switched to standby connection to %s:%d, socket: %d", sb->addr, sb->port, socket);
+    return socket;
+}
+
+/*
+ * Close the standby and cancel everything pending
+ */
+void to_standby_stop(to_standby* sb) {
+    // zero initialized, never started
+    if(NULL == sb->base) {
+	return;
+    }
+    
+    to_connect_cancel(&sb->req);
+    to_standby_drop(sb);
+    sb->base = NULL;
+}
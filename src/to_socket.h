@@ -8,12 +8,22 @@
  * intranet use especially when all devices are in the same
  * subnet.
  * 
+ * to_gateway drives the sockets of many controllers from
+ * one epoll loop, so one process can serve every device
+ * of the same type. When built with TO_IO_URING=1 the
+ * gateway uses io_uring instead, see to_uring.h.
+ * 
  */
  
 #ifndef __TO_SOCKET_H__
 #define __TO_SOCKET_H__
 
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+#include "to_uring.h"
 
 /*
  * Define return values of to_socket functions
@@ -28,9 +38,100 @@
 #define TO_SOCKET_ERROR_GET_SOCKET_ERROR	-6
 #define TO_SOCKET_ERROR_SOCKET_ERROR		-7
 #define TO_SOCKET_ERROR_CONNECT_TIMEOUT		-8
+#define TO_SOCKET_ERROR_EVENT				-9
+#define TO_SOCKET_ERROR_SET_OPTIONS			-10
+#define TO_SOCKET_ERROR_TIMEOUT				-11
+#define TO_SOCKET_ERROR_RECV				-12
+#define TO_SOCKET_ERROR_CLOSED				-13
+#define TO_SOCKET_ERROR_SEND				-14
+#define TO_SOCKET_ERROR_NO_STANDBY			-15
 
 typedef int to_socket_ctx;
 
+/*
+ * Per socket options applied by to_connect. Keep alive is
+ * tuned on the controller socket only, so the system wide
+ * net.ipv4.tcp_keepalive_* settings are not needed.
+ * Integer values of 0 keep the system default.
+ * 
+ * keepalive			Enable SO_KEEPALIVE
+ * keepidle				Idle seconds before the first probe
+ * keepintvl			Seconds between probes
+ * keepcnt				Unanswered probes before the 
+ * 						connection is dropped
+ * user_timeout			Milli seconds sent data may stay
+ * 						unacknowledged before the connection
+ * 						is dropped (TCP_USER_TIMEOUT)
+ * nodelay				Disable Nagle algorithm, for small
+ * 						request/response commands
+ * reset_on_close		Close with RST (SO_LINGER 0) instead 
+ * 						of FIN, so a closed or killed 
+ * 						service does not leave the socket in
+ * 						FIN_WAIT1 holding a controller slot
+ * connect_timeout		Timeout of to_connect
+ * send_timeout			Timeout of blocking to_send
+ * recv_timeout			Timeout of blocking to_recv, also
+ * 						the initial timeout of to_rtt
+ * min_timeout			Lower and upper bound of the 
+ * max_timeout			timeout computed by to_rtt
+ */
+typedef struct {
+    int keepalive;
+    int keepidle;
+    int keepintvl;
+    int keepcnt;
+    int user_timeout;
+    int nodelay;
+    int reset_on_close;
+    struct timeval connect_timeout;
+    struct timeval send_timeout;
+    struct timeval recv_timeout;
+    struct timeval min_timeout;
+    struct timeval max_timeout;
+} to_socket_options;
+
+/*
+ * Default options: 100ms timeouts and a dead peer is 
+ * detected after about 10 seconds idle, same as the
+ * sysctl values previously suggested in README. Adaptive
+ * timeouts stay between 50ms and 2s. Sockets are reset on
+ * close.
+ */
+#define TO_SOCKET_OPTIONS_DEFAULT			{ 1, 5, 5, 1, 0, 0, 1, { 0, 100000 }, { 0, 100000 }, { 0, 100000 }, { 0, 50000 }, { 2, 0 } }
+
+/*
+ * Fill options with TO_SOCKET_OPTIONS_DEFAULT, services
+ * then change the values they want to tune
+ */
+void to_socket_default_options(to_socket_options* options);
+
+/*
+ * libevent types used by the async functions, declared
+ * here so users of the sync functions do not depend on
+ * libevent headers
+ */
+struct event;
+struct event_base;
+
+/*
+ * Called when an async connect finished. socket is the
+ * connected non-blocking socket descriptor, or a negative
+ * error code defined above when failed.
+ */
+typedef void (*to_connect_callback)(to_socket_ctx socket, void* arg);
+
+/*
+ * State of one pending async connect, owned by the caller
+ * and must stay valid until the callback is called or 
+ * to_connect_cancel is called.
+ */
+typedef struct {
+    struct event* ev;
+    to_socket_ctx socket;
+    to_connect_callback cb;
+    void* arg;
+} to_connect_request;
+
 /*
  * Initiatelize a socket descriptor with timeout configuration
  * specified for local network response time
@@ -39,15 +140,686 @@ typedef int to_socket_ctx;
  * const char* addr		IP address in character format. E.g.: 
  * 						"192.168.100.100"
  * int port				Port number for target address
+ * const to_socket_options* options
+ * 						Socket options, NULL for the default
+ * 						options
  * 
  * Return Value:		Socket descriptor if successful which
  * 						will be greater than 0. Otherwiese 
  * 						return error code defined in above 
  * 						section.
  * 
- * Note current timeout is set to 100ms.
+ * Note default timeout is 100ms.
+ */
+to_socket_ctx to_connect(const char* addr, int port, const to_socket_options* options);
+
+/*
+ * Asynchronous version of to_connect. The connecting socket
+ * is registered with the event base of the caller, so the
+ * event loop keeps running while the connection is being
+ * established. The result is passed to cb from the event
+ * loop, also when the connection finished immediately.
+ * 
+ * The connected socket stays in non-blocking mode, the
+ * caller is expected to register it with libevent for
+ * read/write readiness instead of blocking in to_recv.
+ * 
+ * Parameters:
+ * to_connect_request* req	Request state owned by caller
+ * struct event_base* base	Event base of the caller
+ * const char* addr		IP address in character format
+ * int port				Port number for target address
+ * const to_socket_options* options
+ * 						Socket options, NULL for default
+ * to_connect_callback cb	Called when connected or failed
+ * void* arg			Passed to cb
+ * 
+ * Return Value:		TO_SOCKET_OK when the connection is
+ * 						started, cb is not called when an
+ * 						error code is returned.
+ */
+int to_connect_async(to_connect_request* req, struct event_base* base, const char* addr, int port, const to_socket_options* options, to_connect_callback cb, void* arg);
+
+/*
+ * Cancel a pending async connect and close its socket,
+ * the callback is not called afterwards. Safe to call 
+ * after the callback was called.
+ */
+void to_connect_cancel(to_connect_request* req);
+
+/*
+ * Switch socket between blocking and non-blocking mode
+ * 
+ * Parameters:
+ * to_socket_ctx socket	Socket descriptor
+ * int nonblock			1 for non-blocking, 0 for blocking
+ * 
+ * Return Value:		TO_SOCKET_OK if successful, otherwise
+ * 						error code defined above
+ */
+int to_set_nonblock(to_socket_ctx socket, int nonblock);
+
+/*
+ * Controllers accept TO_SLOT_COUNT sockets and send the
+ * index of the slot used as first byte after accept.
+ * Services register the slots they hold in the redis hash
+ * slots/<controller ip>/<port> of DB 1, field is the slot
+ * index and value the owning service.
+ */
+#define TO_SLOT_COUNT						8
+#define TO_SLOT_KEY_PREFIX					"slots"
+#define TO_SLOT_KEY_SIZE					64
+
+/*
+ * Receive the slot index the controller sends right after
+ * accept, waits at most the receive timeout of the socket
+ * 
+ * Return Value:		Slot index from 0 to 255 if 
+ * 						successful, TO_SOCKET_ERROR_TIMEOUT,
+ * 						TO_SOCKET_ERROR_CLOSED or 
+ * 						TO_SOCKET_ERROR_RECV otherwise
+ */
+int to_recv_slot(to_socket_ctx socket);
+
+/*
+ * Build the redis key of the slot registry of a controller
+ * 
+ * Return Value:		TO_SOCKET_OK if successful, 
+ * 						TO_SOCKET_ERROR_ADDRESS when buf is
+ * 						too small
+ */
+int to_slot_key(char* buf, size_t len, const char* addr, int port);
+
+/*
+ * Close the socket with RST right away, used on failure
+ * paths where the peer may not answer a FIN any more
+ */
+void to_abort(to_socket_ctx socket);
+
+/*
+ * Size of the receive buffer of to_reader, the longest
+ * frame must fit into it
+ */
+#define TO_READER_BUFFER_SIZE				512
+
+/*
+ * Frame decoder used by to_reader. It is called with all
+ * buffered bytes not consumed yet.
+ * 
+ * Return value:
+ * Length of the frame at the beginning of data when a 
+ * whole frame is available, 0 when more bytes are needed,
+ * or -n to drop n bytes that can not start a frame.
+ */
+typedef int (*to_frame_decoder)(const unsigned char* data, size_t len, void* arg);
+
+/*
+ * Buffered reader returning whole frames from a byte 
+ * stream. Bytes are received in chunks, so frames already
+ * buffered are returned without another system call.
+ * 
+ * frames				Count of frames returned
+ * reads				Count of recv calls returning data
+ * resyncs				Count of times the decoder dropped 
+ * 						bytes to find the next frame
+ * skipped				Count of bytes dropped
+ */
+typedef struct {
+    to_socket_ctx socket;
+    to_frame_decoder decoder;
+    void* arg;
+    size_t start;
+    size_t end;
+    unsigned long frames;
+    unsigned long reads;
+    unsigned long resyncs;
+    unsigned long skipped;
+    unsigned char buffer[TO_READER_BUFFER_SIZE];
+} to_reader;
+
+/*
+ * Initialize a reader on a connected socket
+ * 
+ * Parameters:
+ * to_reader* reader	Reader to initialize
+ * to_socket_ctx socket	Connected socket
+ * to_frame_decoder decoder
+ * 						Decoder finding frame boundaries
+ * void* arg			Passed to decoder
+ */
+void to_reader_init(to_reader* reader, to_socket_ctx socket, to_frame_decoder decoder, void* arg);
+
+/*
+ * Get the next whole frame. When no complete frame is 
+ * buffered, receives once into the free buffer space,
+ * which waits at most the receive timeout of the socket.
+ * 
+ * Parameters:
+ * to_reader* reader	Reader
+ * const unsigned char** frame
+ * 						Set to the frame, valid until the
+ * 						next call
+ * 
+ * Return Value:		Length of the frame when successful.
+ * 						TO_SOCKET_ERROR_TIMEOUT when no frame
+ * 						is received before timeout or the 
+ * 						non-blocking socket has no more data,
+ * 						TO_SOCKET_ERROR_CLOSED when the peer
+ * 						closed the connection, otherwise 
+ * 						TO_SOCKET_ERROR_RECV.
+ */
+int to_reader_next(to_reader* reader, const unsigned char** frame);
+
+/*
+ * Count of bytes received but not returned yet
+ */
+#define to_reader_buffered(reader)			((reader)->end - (reader)->start)
+
+/*
+ * Get the next whole frame from the buffered bytes only,
+ * used when the bytes are received by the caller. When
+ * there is no whole frame, the buffered bytes are moved to
+ * the beginning so to_reader_space bytes can be received
+ * at buffer + end by the caller, which then adds them to
+ * end.
+ * 
+ * Return Value:		Length of the frame, 0 when more 
+ * 						bytes are needed
+ */
+int to_reader_frame(to_reader* reader, const unsigned char** frame);
+
+/*
+ * Free space at the end of the buffer after 
+ * to_reader_frame returned 0
+ */
+#define to_reader_space(reader)				(TO_READER_BUFFER_SIZE - (reader)->end)
+
+/*
+ * Drop all buffered bytes and all bytes already received
+ * by the socket without waiting, e.g. late answers of a 
+ * request that timed out.
+ * 
+ * Return Value:		Count of bytes dropped, or 
+ * 						TO_SOCKET_ERROR_CLOSED / 
+ * 						TO_SOCKET_ERROR_RECV
+ */
+int to_reader_drain(to_reader* reader);
+
+/*
+ * Size of the send buffer of to_writer, commands written
+ * between two flushes are sent together when they fit
+ */
+#define TO_WRITER_BUFFER_SIZE				4096
+
+/*
+ * Send buffer collecting several small device commands so
+ * they are sent with one system call and as few TCP 
+ * segments as possible
+ */
+typedef struct {
+    to_socket_ctx socket;
+    size_t len;
+    unsigned long flushes;
+    unsigned char buffer[TO_WRITER_BUFFER_SIZE];
+} to_writer;
+
+/*
+ * Send all data described by iov with writev, continuing
+ * after partial writes and interrupts.
+ * 
+ * Parameters:
+ * to_socket_ctx socket	Connected socket
+ * struct iovec* iov	Data to send, modified while sending
+ * int count			Count of iov entries
+ * 
+ * Return Value:		Count of bytes sent if successful,
+ * 						otherwise TO_SOCKET_ERROR_SEND, 
+ * 						errno is kept from writev.
+ */
+int to_sendv(to_socket_ctx socket, struct iovec* iov, int count);
+
+/*
+ * Initialize a writer on a connected socket
+ */
+void to_writer_init(to_writer* writer, to_socket_ctx socket);
+
+/*
+ * Append one command to the writer. Nothing is sent until
+ * to_writer_flush is called, except when the buffer is 
+ * full, then the buffered commands are flushed first. 
+ * Commands larger than the buffer are sent directly.
+ * 
+ * Return Value:		len if successful, otherwise 
+ * 						TO_SOCKET_ERROR_SEND
+ */
+int to_writer_write(to_writer* writer, const void* data, size_t len);
+
+/*
+ * Send all buffered commands. The buffer is emptied also
+ * when sending failed.
+ * 
+ * Return Value:		Count of bytes sent if successful,
+ * 						otherwise TO_SOCKET_ERROR_SEND
+ */
+int to_writer_flush(to_writer* writer);
+
+/*
+ * Count of bytes waiting for to_writer_flush
+ */
+#define to_writer_pending(writer)			((writer)->len)
+
+/*
+ * Gateway configuration. Connections failed or closed are
+ * retried after TO_GATEWAY_RETRY_INTERVAL milli seconds,
+ * at most TO_GATEWAY_MAX_EVENTS sockets are handled per
+ * epoll_wait call.
+ */
+#define TO_GATEWAY_RETRY_INTERVAL			1000
+#define TO_GATEWAY_MAX_EVENTS				64
+
+/*
+ * io_uring backend: size of the submission ring and count
+ * of reader buffers registered. The reader buffers of the
+ * connections added before the first to_gateway_run are
+ * registered, later connections receive without 
+ * registered buffer.
+ */
+#define TO_GATEWAY_URING_ENTRIES			256
+#define TO_GATEWAY_URING_BUFFERS			64
+
+/*
+ * States of a gateway connection
+ * 
+ * TO_GATEWAY_STATE_IDLE		Waiting for the next retry
+ * TO_GATEWAY_STATE_CONNECTING	Non-blocking connect running,
+ * 								waiting for writable
+ * TO_GATEWAY_STATE_CONNECTED	Waiting for readable
+ */
+#define TO_GATEWAY_STATE_IDLE				0
+#define TO_GATEWAY_STATE_CONNECTING			1
+#define TO_GATEWAY_STATE_CONNECTED			2
+
+struct to_gateway_conn;
+
+/*
+ * Called for every frame received on a connection. A
+ * negative return value stops to_gateway_run and is 
+ * returned by it, e.g. when redis failed.
+ */
+typedef int (*to_gateway_frame_callback)(struct to_gateway_conn* conn, const unsigned char* frame, int len);
+
+/*
+ * Called when a connection is established (error is 
+ * TO_SOCKET_OK), failed to connect or is lost (error is
+ * the negative error code). Lost connections are retried.
+ */
+typedef void (*to_gateway_state_callback)(struct to_gateway_conn* conn, int error);
+
+/*
+ * One controller connection of a gateway, owned by the 
+ * caller and must stay valid until to_gateway_close.
+ * 
+ * deadline				Monotonic time in milli seconds of
+ * 						the connect timeout or the next
+ * 						retry, 0 when connected
+ * connects				Count of successful connects
+ * buffer				io_uring backend: index of the 
+ * 						reader buffer in the registered
+ * 						buffers, -1 when it is not 
+ * 						registered
+ * pending				io_uring backend: kind of the 
+ * 						request not completed yet, 0 when 
+ * 						there is none. The connection is only
+ * 						restarted when there is none.
+ */
+typedef struct to_gateway_conn {
+    const char* addr;
+    int port;
+    to_socket_options options;
+    int state;
+    to_socket_ctx socket;
+    uint64_t deadline;
+    unsigned long connects;
+    to_gateway_frame_callback on_frame;
+    to_gateway_state_callback on_state;
+    void* arg;
+    struct to_gateway_conn* next;
+#if TO_IO_URING
+    int buffer;
+    int pending;
+#endif
+    to_reader reader;
+} to_gateway_conn;
+
+/*
+ * epoll loop serving a list of connections. With the 
+ * io_uring backend epfd is -1 while the ring is used, it 
+ * falls back to epoll when the kernel has no io_uring.
+ */
+typedef struct {
+    int epfd;
+    to_gateway_conn* conns;
+#if TO_IO_URING
+    int use_ring;
+    int buffers_registered;
+    struct __kernel_timespec timeout;
+    to_uring ring;
+#endif
+} to_gateway;
+
+/*
+ * Create the epoll instance or io_uring ring of a gateway
+ * 
+ * Return Value:		TO_SOCKET_OK if successful, otherwise
+ * 						TO_SOCKET_ERROR_EVENT
+ */
+int to_gateway_init(to_gateway* gw);
+
+/*
+ * Add one controller connection to the gateway. The 
+ * connection is started by the next to_gateway_run.
+ * 
+ * Parameters:
+ * to_gateway* gw		Gateway
+ * to_gateway_conn* conn	Connection state owned by caller
+ * const char* addr		IP address in character format, must
+ * 						stay valid
+ * int port				Port number for target address
+ * const to_socket_options* options
+ * 						Socket options, NULL for the default,
+ * 						copied into conn
+ * to_frame_decoder decoder
+ * 						Decoder finding frame boundaries, 
+ * 						called with conn as argument
+ * to_gateway_frame_callback on_frame
+ * 						Called for every frame
+ * to_gateway_state_callback on_state
+ * 						Called on connect and disconnect, 
+ * 						may be NULL
+ * void* arg			Stored in conn->arg for the callbacks
+ */
+void to_gateway_add(to_gateway* gw, to_gateway_conn* conn, const char* addr, int port, const to_socket_options* options, to_frame_decoder decoder, to_gateway_frame_callback on_frame, to_gateway_state_callback on_state, void* arg);
+
+/*
+ * Close one connection and connect it again by the next 
+ * to_gateway_run, e.g. when its controller was reset. The 
+ * other connections are not affected.
+ * 
+ * Parameters:
+ * to_gateway* gw		Gateway
+ * to_gateway_conn* conn	Connection added with to_gateway_add
+ */
+void to_gateway_reset(to_gateway* gw, to_gateway_conn* conn);
+
+/*
+ * Wait up to timeout milli seconds for socket events, then
+ * advance the state machine of every connection: finish
+ * connects, read and dispatch frames, expire connect 
+ * timeouts and start retries.
+ * 
+ * Return Value:		Count of frames dispatched, or the
+ * 						negative value returned by on_frame,
+ * 						or TO_SOCKET_ERROR_EVENT when 
+ * 						epoll failed.
+ */
+int to_gateway_run(to_gateway* gw, int timeout);
+
+/*
+ * Close all connections and the epoll instance or ring
+ */
+void to_gateway_close(to_gateway* gw);
+
+/*
+ * Clock granularity in micro seconds used by to_rtt, the
+ * variance term of the timeout is at least this value
+ */
+#define TO_RTT_GRANULARITY					1000
+
+/*
+ * Round trip time estimate of one controller link, used
+ * to derive its timeout the same way TCP computes the
+ * retransmission timeout (RFC 6298):
+ * 
+ * srtt = 7/8 * srtt + 1/8 * sample
+ * rttvar = 3/4 * rttvar + 1/4 * |srtt - sample|
+ * timeout = srtt + max(TO_RTT_GRANULARITY, 4 * rttvar)
+ * 
+ * clamped to min_timeout and max_timeout of the options.
+ * All values are in micro seconds. Keep it across
+ * reconnects so a restarted link starts with what was 
+ * learned before.
+ * 
+ * samples				Count of measured round trips
+ * backoffs				Count of timeouts reported
+ * applied				Timeout last set on a socket
+ */
+typedef struct {
+    uint64_t srtt;
+    uint64_t rttvar;
+    uint64_t timeout;
+    uint64_t min_timeout;
+    uint64_t max_timeout;
+    uint64_t start;
+    uint64_t applied;
+    unsigned long samples;
+    unsigned long backoffs;
+} to_rtt;
+
+/*
+ * Initialize an estimate, the timeout starts at 
+ * recv_timeout of options until the first sample
+ * 
+ * Parameters:
+ * to_rtt* rtt			Estimate to initialize
+ * const to_socket_options* options
+ * 						Initial timeout and bounds, NULL for
+ * 						the default options
+ */
+void to_rtt_init(to_rtt* rtt, const to_socket_options* options);
+
+/*
+ * Add one measured round trip time in micro seconds
+ */
+void to_rtt_sample(to_rtt* rtt, uint64_t sample);
+
+/*
+ * Start measuring a round trip, e.g. before sending a 
+ * command
+ */
+void to_rtt_start(to_rtt* rtt);
+
+/*
+ * Finish the round trip started by to_rtt_start and add
+ * it as sample, e.g. after the answer is received
+ */
+void to_rtt_stop(to_rtt* rtt);
+
+/*
+ * Double the timeout after a round trip timed out. The
+ * timed out round trip is not sampled (Karn's algorithm),
+ * the next sample replaces the backed off value.
+ */
+void to_rtt_backoff(to_rtt* rtt);
+
+/*
+ * Current timeout as timeval, e.g. to set connect_timeout
+ * and recv_timeout of options before to_connect
+ */
+void to_rtt_timeval(const to_rtt* rtt, struct timeval* tv);
+
+/*
+ * Use the current timeout as connect, send and receive 
+ * timeout of options, call before each to_connect so a
+ * reconnect waits as long as the link needs
+ */
+void to_rtt_options(to_rtt* rtt, to_socket_options* options);
+
+/*
+ * Set the current timeout as send and receive timeout of
+ * the socket. Nothing is done when the timeout did not
+ * change since the last call.
+ * 
+ * Return Value:		TO_SOCKET_OK if successful, otherwise
+ * 						TO_SOCKET_ERROR_SET_OPTIONS
+ */
+int to_rtt_apply(to_rtt* rtt, to_socket_ctx socket);
+
+/*
+ * Sends a probe to the device. Return TO_SOCKET_OK (or any
+ * value not less than 0) when the device answered or the
+ * probe was sent, otherwise a negative error code.
+ */
+typedef int (*to_heartbeat_probe)(void* arg);
+
+/*
+ * Called once when max_misses probes in a row failed
+ */
+typedef void (*to_heartbeat_callback)(void* arg);
+
+/*
+ * Application level heartbeat of one device link, driven
+ * by a libevent timer so idle links are checked as well.
+ * The probe is skipped for an interval in which the 
+ * service reported traffic with to_heartbeat_alive, so a
+ * busy link is not loaded with extra requests.
+ * 
+ * A failed device is detected within about
+ * interval * (max_misses + 1) plus the probe timeouts.
+ * 
+ * probes				Count of probes sent
+ * missed				Count of probes failed
+ */
+typedef struct {
+    struct event* ev;
+    struct timeval interval;
+    to_heartbeat_probe probe;
+    to_heartbeat_callback on_failure;
+    void* arg;
+    int max_misses;
+    int misses;
+    int active;
+    unsigned long probes;
+    unsigned long missed;
+} to_heartbeat;
+
+/*
+ * Start the heartbeat timer
+ * 
+ * Parameters:
+ * to_heartbeat* hb		Heartbeat state owned by caller
+ * struct event_base* base	Event base of the caller
+ * const struct timeval* interval
+ * 						Time between two probes
+ * int max_misses		Failed probes in a row before 
+ * 						on_failure is called
+ * to_heartbeat_probe probe	Sends one probe
+ * to_heartbeat_callback on_failure
+ * 						Called when the device is considered
+ * 						dead, the timer is stopped before
+ * void* arg			Passed to probe and on_failure
+ * 
+ * Return Value:		TO_SOCKET_OK if successful, otherwise
+ * 						TO_SOCKET_ERROR_EVENT
+ */
+int to_heartbeat_start(to_heartbeat* hb, struct event_base* base, const struct timeval* interval, int max_misses, to_heartbeat_probe probe, to_heartbeat_callback on_failure, void* arg);
+
+/*
+ * Start probing again after on_failure was called, e.g. 
+ * when the service switched to another connection
+ * 
+ * Return Value:		TO_SOCKET_OK if successful, otherwise
+ * 						TO_SOCKET_ERROR_EVENT
+ */
+int to_heartbeat_resume(to_heartbeat* hb);
+
+/*
+ * Stop the heartbeat timer and free it, safe to call when
+ * not started or already stopped
+ */
+void to_heartbeat_stop(to_heartbeat* hb);
+
+/*
+ * Report traffic answered by the device, the next probe
+ * is skipped
+ */
+#define to_heartbeat_alive(hb)				((hb)->active = 1)
+
+/*
+ * Time to wait before building a standby connection again
+ * after it failed
+ */
+#define TO_STANDBY_RETRY_INTERVAL			1
+
+/*
+ * Warm standby connection to a controller. A second socket
+ * is connected in the background and kept idle, so when 
+ * the active connection fails the service can switch to
+ * it immediately instead of reconnecting from scratch.
+ * After a takeover the next standby is built in the 
+ * background again.
+ * 
+ * The controller reports its slot index right after 
+ * accept, a standby is only ready after this byte is
+ * received. A standby closed by the controller is rebuilt.
+ * 
+ * socket				Ready standby socket, -1 when none
+ * slot					Slot index reported by controller,
+ * 						-1 until received
+ * ev					Read event of the standby socket or
+ * 						retry timer
+ * takeovers			Count of successful takeovers
+ */
+typedef struct {
+    struct event_base* base;
+    const char* addr;
+    int port;
+    to_socket_options options;
+    to_connect_request req;
+    struct event* ev;
+    to_socket_ctx socket;
+    int slot;
+    unsigned long takeovers;
+} to_standby;
+
+/*
+ * Start building a standby connection in the background
+ * 
+ * Parameters:
+ * to_standby* sb		Standby state owned by caller
+ * struct event_base* base	Event base of the caller
+ * const char* addr		IP address of the controller, must
+ * 						stay valid
+ * int port				Port number of the controller
+ * const to_socket_options* options
+ * 						Options of the standby socket, NULL
+ * 						for default, copied into sb
+ */
+void to_standby_start(to_standby* sb, struct event_base* base, const char* addr, int port, const to_socket_options* options);
+
+/*
+ * Take the ready standby socket as new active connection.
+ * The socket is switched to blocking mode with the 
+ * timeouts of options, the slot byte is already consumed.
+ * A new standby is started in the background.
+ * 
+ * Return Value:		Socket descriptor if successful,
+ * 						TO_SOCKET_ERROR_NO_STANDBY when no
+ * 						standby is ready, otherwise error 
+ * 						code defined above
+ */
+to_socket_ctx to_standby_takeover(to_standby* sb);
+
+/*
+ * Close the standby socket and cancel pending connects and
+ * timers, safe to call on a zero initialized standby or
+ * when already stopped
+ */
+void to_standby_stop(to_standby* sb);
+
+/*
+ * 1 when a standby socket is ready for takeover
  */
-to_socket_ctx to_connect(const char* addr, int port);
+#define to_standby_ready(sb)				(0 <= (sb)->socket && 0 <= (sb)->slot)
 
 #define to_send(socket, buf, len, flags)	send(socket, buf, len, flags)
 #define to_recv(socket, buf, len, flags)	recv(socket, buf, len, flags)
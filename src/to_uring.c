@@ -0,0 +1,195 @@
+/*
+ * Copyright lzh88998 and distributed under Apache 2.0 license
+ *
+ * Minimal io_uring ring, see to_uring.h
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "to_uring.h"
+
+#if TO_IO_URING
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define LOG_DEFAULT_MODULE          LOG_MODULE_SOCKET
+#include "log.h"
+
+/*
+ * Create a ring and map the submission ring, completion
+ * ring and submission entries
+ */
+int to_uring_init(to_uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    char* sq;
+    char* cq;
+
+    memset(ring, 0, sizeof(to_uring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if(0 > ring->fd) {
+	LOG_WARNING("Error creating io_uring %d - %s", errno, strerror(errno));
+	return TO_URING_ERROR_SETUP;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == ring->sq_ring) {
+	ring->sq_ring = NULL;
+	goto l_map_failed;
+    }
+
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if(MAP_FAILED == ring->cq_ring) {
+	ring->cq_ring = NULL;
+	goto l_map_failed;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(MAP_FAILED == ring->sqes) {
+	ring->sqes = NULL;
+	goto l_map_failed;
+    }
+
+    sq = (char*)ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local = *ring->sq_tail;
+
+    cq = (char*)ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return TO_URING_OK;
+
+l_map_failed:
+    LOG_ERROR("Error mapping io_uring %d - %s", errno, strerror(errno));
+    to_uring_close(ring);
+    return TO_URING_ERROR_MAP;
+}
+
+/*
+ * Register buffers for IORING_OP_READ_FIXED
+ */
+int to_uring_register_buffers(to_uring* ring, const struct iovec* iov, unsigned count) {
+    if(0 > syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count)) {
+	LOG_WARNING("Error registering io_uring buffers %d - %s", errno, strerror(errno));
+	return TO_URING_ERROR_REGISTER;
+    }
+
+    return TO_URING_OK;
+}
+
+/*
+ * Get a cleared submission entry, submits queued requests
+ * first when the ring is full
+ */
+struct io_uring_sqe* to_uring_sqe(to_uring* ring) {
+    struct io_uring_sqe* sqe;
+    unsigned idx;
+
+    if(ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+	if(0 >= to_uring_enter(ring, 0)) {
+	    return NULL;
+	}
+    }
+
+    idx = ring->sq_local & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_local++;
+
+    return sqe;
+}
+
+/*
+ * Publish queued requests to the kernel, submit them and
+ * wait for completions with one system call
+ */
+int to_uring_enter(to_uring* ring, unsigned wait) {
+    unsigned submit;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    submit = ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if(0 == submit && 0 == wait) {
+	return 0;
+    }
+
+    ring->enters++;
+    ret = (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait, 0 < wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(0 > ret) {
+	if(EINTR == errno || EAGAIN == errno || EBUSY == errno) {
+	    return 0;
+	}
+
+	LOG_ERROR("Error in io_uring_enter %d - %s", errno, strerror(errno));
+	return TO_URING_ERROR_ENTER;
+    }
+
+    ring->submitted += ret;
+    return ret;
+}
+
+/*
+ * Get the next completion without waiting
+ */
+struct io_uring_cqe* to_uring_cqe(to_uring* ring) {
+    unsigned head = *ring->cq_head;
+
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+	return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/*
+ * Release the completion returned by to_uring_cqe
+ */
+void to_uring_cqe_seen(to_uring* ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Unmap and close the ring
+ */
+void to_uring_close(to_uring* ring) {
+    if(NULL != ring->sqes) {
+	munmap(ring->sqes, ring->sqes_size);
+	ring->sqes = NULL;
+    }
+
+    if(NULL != ring->cq_ring) {
+	munmap(ring->cq_ring, ring->cq_ring_size);
+	ring->cq_ring = NULL;
+    }
+
+    if(NULL != ring->sq_ring) {
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	ring->sq_ring = NULL;
+    }
+
+    if(0 <= ring->fd && 0 > close(ring->fd)) {
+	LOG_ERROR("Error closing io_uring! Error no: %s", strerror(errno));
+    }
+    ring->fd = -1;
+}
+
+#endif
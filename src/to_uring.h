@@ -0,0 +1,133 @@
+/*
+ * Copyright lzh88998 and distributed under Apache 2.0 license
+ *
+ * to_uring is a minimal io_uring ring used as optional
+ * backend of to_gateway. Requests are queued in the
+ * submission ring and submitted together with waiting for
+ * completions in one system call, completions are read
+ * from the shared memory ring without system call.
+ *
+ * The system calls are used directly, so only the kernel
+ * headers are needed and not liburing. The backend is
+ * built with make TO_IO_URING=1, otherwise this header is
+ * empty and to_gateway uses epoll.
+ *
+ */
+
+#ifndef __TO_URING_H__
+#define __TO_URING_H__
+
+#ifndef TO_IO_URING
+#define TO_IO_URING							0
+#endif
+
+#if TO_IO_URING
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * Return values of to_uring functions
+ */
+#define TO_URING_OK							0
+#define TO_URING_ERROR_SETUP				-1
+#define TO_URING_ERROR_MAP					-2
+#define TO_URING_ERROR_REGISTER				-3
+#define TO_URING_ERROR_ENTER				-4
+
+/*
+ * Mapped submission and completion rings
+ *
+ * sq_local				Tail of the submission ring including
+ * 						requests not published to the kernel
+ * 						yet
+ * enters				Count of io_uring_enter calls
+ * submitted			Count of requests submitted
+ */
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned sq_local;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned long enters;
+    unsigned long submitted;
+} to_uring;
+
+/*
+ * Create a ring and map it into memory
+ *
+ * Parameters:
+ * to_uring* ring		Ring to initialize
+ * unsigned entries		Size of the submission ring, the
+ * 						completion ring is twice as large
+ *
+ * Return Value:		TO_URING_OK if successful, otherwise
+ * 						TO_URING_ERROR_SETUP when io_uring is
+ * 						not supported or TO_URING_ERROR_MAP
+ */
+int to_uring_init(to_uring* ring, unsigned entries);
+
+/*
+ * Register buffers for IORING_OP_READ_FIXED, so the kernel
+ * does not map the pages for every read
+ *
+ * Return Value:		TO_URING_OK if successful, otherwise
+ * 						TO_URING_ERROR_REGISTER
+ */
+int to_uring_register_buffers(to_uring* ring, const struct iovec* iov, unsigned count);
+
+/*
+ * Get a cleared submission entry, it is submitted by the
+ * next to_uring_enter. When the ring is full the queued
+ * requests are submitted first.
+ *
+ * Return Value:		Submission entry, NULL when the
+ * 						requests could not be submitted
+ */
+struct io_uring_sqe* to_uring_sqe(to_uring* ring);
+
+/*
+ * Submit all queued requests and wait until at least wait
+ * completions are available
+ *
+ * Return Value:		Count of requests submitted, 0 when
+ * 						interrupted by a signal before any
+ * 						request was submitted, otherwise
+ * 						TO_URING_ERROR_ENTER
+ */
+int to_uring_enter(to_uring* ring, unsigned wait);
+
+/*
+ * Get the next completion without waiting, NULL when there
+ * is none. Call to_uring_cqe_seen after it is processed.
+ */
+struct io_uring_cqe* to_uring_cqe(to_uring* ring);
+
+/*
+ * Release the completion returned by to_uring_cqe
+ */
+void to_uring_cqe_seen(to_uring* ring);
+
+/*
+ * Unmap and close the ring, requests still running are
+ * cancelled by the kernel
+ */
+void to_uring_close(to_uring* ring);
+
+#endif
+
+#endif
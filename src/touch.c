@@ -35,6 +35,7 @@
 
 #include "log.h"
 #include "to_socket.h"
+#include "stats.h"
 
 #define REDIS_IP                "127.0.0.1"
 #define REDIS_PORT              6379
@@ -46,16 +47,19 @@
 #define SWITCH_TOPIC            "sw"
 #define TARGET_TEMP_TOPIC       "target_temp"
 
-#define RECEIVE_STATE_CMD       0
-#define RECEIVE_STATE_X_FIRST   1
-#define RECEIVE_STATE_X_SECOND  2
-#define RECEIVE_STATE_Y_FIRST   3
-#define RECEIVE_STATE_Y_SECOND  4
-#define RECEIVE_STATE_FINISHED  5
+#define FRAME_CMD               0
+#define FRAME_X_FIRST           1
+#define FRAME_X_SECOND          2
+#define FRAME_Y_FIRST           3
+#define FRAME_Y_SECOND          4
+#define FRAME_SIZE              5
 
 #define PROCESS_CLICK_OK        0
 #define PROCESS_CLICK_FAILED    -1
 
+#define PUBLISH_STATS_OK        0
+#define PUBLISH_STATS_FAILED    -1
+
 #define TOUCH_MAX_SW_CNT        6
 
 #define LCD_ACTIVE_BACKLIGHT    0
@@ -71,6 +75,19 @@ static redisReply *gs_sw_config = NULL;
 static redisReply *gs_sw_topics[TOUCH_MAX_SW_CNT];
 static redisReply *gs_temp_topic = NULL;
 
+static stats_histogram gs_click_stats = STATS_HISTOGRAM_INIT("process_click");
+static char gs_stats_key[STATS_KEY_SIZE];
+
+/*
+ * Controller slot held by gs_socket, registered in redis
+ * hash gs_slot_key while the service is running
+ */
+static int gs_slot = -1;
+static int gs_slot_registered = 0;
+static char gs_slot_key[TO_SLOT_KEY_SIZE];
+
+static to_reader gs_reader;
+
 #define EXEC_REDIS_CMD(reply, goto_label, cmd, ...)		LOG_DEBUG(cmd, ##__VA_ARGS__);\
                                                         reply = redisCommand(gs_sync_context, cmd, ##__VA_ARGS__);\
                                                         if(NULL == reply) {\
@@ -289,6 +306,108 @@ l_process_click_failed:
     return PROCESS_CLICK_FAILED;
 }
 
+/*
+ * Frame decoder for to_reader, the touch controller sends
+ * fixed size frames of command byte followed by x and y 
+ * coordinates in big endian
+ * 
+ * Parameters:
+ * const unsigned char* data    Buffered bytes
+ * size_t len                   Count of buffered bytes
+ * void* arg                    Not used
+ * 
+ * Return value:
+ * FRAME_SIZE when a whole frame is buffered, otherwise 0
+ */
+int decode_touch_frame(const unsigned char* data, size_t len, void* arg) {
+    UNUSED(data);
+    UNUSED(arg);
+    
+    return len >= FRAME_SIZE ? FRAME_SIZE : 0;
+}
+
+/*
+ * Publish latency percentiles of process_click in the
+ * last interval to redis hash stats/touch/<ip>
+ * 
+ * Parameters:
+ * There is no input parameter
+ * 
+ * Return value:
+ * 0                        Execution Successful
+ * Others                   Failed
+ */
+int publish_stats(void) {
+    redisReply* reply = NULL;
+    char text[STATS_TEXT_SIZE];
+    
+    if(0 > stats_format(&gs_click_stats, text, sizeof(text))) {
+        LOG_WARNING("Failed to format %s stats!", gs_click_stats.name);
+        return PUBLISH_STATS_OK;
+    }
+    
+    EXEC_REDIS_CMD(reply, l_publish_stats_failed, "HSET %s %s %s", gs_stats_key, gs_click_stats.name, text);
+    freeReplyObject(reply);
+    stats_reset(&gs_click_stats);
+    
+    return PUBLISH_STATS_OK;
+
+l_publish_stats_failed:
+    return PUBLISH_STATS_FAILED;
+}
+
+/*
+ * Register gs_slot in the slot registry of the controller,
+ * warns when all slots of the controller are registered.
+ * Failures are only logged.
+ * 
+ * Parameters:
+ * There is no input parameter
+ * 
+ * Return value:
+ * There is no return value
+ */
+void register_slot(void) {
+    redisReply* reply = NULL;
+    
+    EXEC_REDIS_CMD(reply, l_register_slot_failed, "HSET %s %d touch:%d", gs_slot_key, gs_slot, (int)getpid());
+    freeReplyObject(reply);
+    gs_slot_registered = 1;
+    
+    EXEC_REDIS_CMD(reply, l_register_slot_failed, "HLEN %s", gs_slot_key);
+    if(REDIS_REPLY_INTEGER == reply->type && TO_SLOT_COUNT <= reply->integer) {
+        LOG_WARNING("All %d slots of controller %s are registered!", TO_SLOT_COUNT, gs_slot_key);
+    }
+    freeReplyObject(reply);
+    
+l_register_slot_failed:
+    return;
+}
+
+/*
+ * Remove gs_slot from the slot registry of the controller
+ * 
+ * Parameters:
+ * There is no input parameter
+ * 
+ * Return value:
+ * There is no return value
+ */
+void release_slot(void) {
+    redisReply* reply = NULL;
+    
+    if(!gs_slot_registered) {
+        return;
+    }
+    gs_slot_registered = 0;
+    
+    EXEC_REDIS_CMD(reply, l_release_slot_failed, "HDEL %s %d", gs_slot_key, gs_slot);
+    freeReplyObject(reply);
+    
+l_release_slot_failed:
+    return;
+}
+
 /*
  * Main entry of the service. It will first connect
  * to touch controller, and then connect to redis
@@ -316,14 +435,18 @@ l_process_click_failed:
     signal(SIGPIPE, SIG_IGN);
 #endif
 
-    unsigned char temp, cur_state = 0;
+    unsigned char temp;
     unsigned char cmd = 0;//, active = 0, inactive_cnt = 0;
     unsigned int  x = 0, y = 0;
+    const unsigned char* frame;
+    int ret;
     
     int serv_port = 0;
     const char* redis_ip;
     int redis_port = REDIS_PORT;
     
+    uint64_t click_start, stats_published = 0;
+    
     struct timeval timeout = { 0, 100000 }; 
 
     LOG_INFO("=================== Service start! ===================");
@@ -367,13 +490,26 @@ l_process_click_failed:
             return -1;
     }
         
+    if(LOG_RECORDER_OK != log_recorder_open("touch", serv_ip)) {
+        LOG_WARNING("Failed to open flight recorder!");
+    }
+
+    if(STATS_OK != stats_key(gs_stats_key, sizeof(gs_stats_key), "touch", serv_ip)) {
+        LOG_ERROR("Controller address too long %s!", serv_ip);
+        return -4;
+    }
+
+    if(TO_SOCKET_OK != to_slot_key(gs_slot_key, sizeof(gs_slot_key), serv_ip, serv_port)) {
+        LOG_ERROR("Controller address too long %s!", serv_ip);
+        return -4;
+    }
+
     // initialize sw topics
     for(int i = 0; i < TOUCH_MAX_SW_CNT; i++) {
         gs_sw_topics[i] = NULL;
     }
     
 l_start:
-    cur_state = 0;
     x = 0;
     y = 0;
     cmd = 0;
@@ -381,19 +517,20 @@ l_start:
 //    inactive_cnt = 0;
     
     LOG_DETAILS("Connecting to touch controller %s %d!", serv_ip, serv_port);
-    gs_socket = to_connect(serv_ip, serv_port);
+    gs_socket = to_connect(serv_ip, serv_port, NULL);
     if(0 > gs_socket) {
         LOG_ERROR("Error creating socket!");
         goto l_exit;
     }
     
-    // Receive initial bytes to activate W5500 keep alive
-    if(0 > to_recv(gs_socket, &temp, 1, 0)) {
-        LOG_ERROR("Error receiving initial data! %s", strerror(errno));
+    // Receive slot index to activate W5500 keep alive
+    gs_slot = to_recv_slot(gs_socket);
+    if(0 > gs_slot) {
         goto l_socket_cleanup;
     }
 
-    LOG_DETAILS("Connected to touch controller, remote socket: %d", temp);
+    LOG_DETAILS("Connected to touch controller, remote socket: %d", gs_slot);
+    to_reader_init(&gs_reader, gs_socket, decode_touch_frame, NULL);
 
     LOG_DETAILS("Connecting to redis %s %d!", redis_ip, redis_port);
     gs_sync_context = redisConnectWithTimeout(redis_ip, redis_port, timeout);
@@ -439,6 +576,8 @@ l_start:
     freeReplyObject(reply);
     reply = NULL;
     
+    register_slot();
+    
     EXEC_REDIS_CMD(reply, l_free_redis_reply, "GET %s", gs_temp_topic->str);
     
     if(reply->str) {
@@ -472,12 +611,21 @@ l_start:
     LOG_DETAILS("Start loop!");
     
     // main loop
+    stats_published = stats_now();
     while(!gs_exit) {
+        if(stats_now() - stats_published >= STATS_PUBLISH_INTERVAL * 1000000000ULL) {
+            stats_published = stats_now();
+            if(PUBLISH_STATS_OK != publish_stats()) {
+                goto l_free_redis_reply;
+            }
+        }
+        
         LOG_DETAILS("Start Receiving");
-        if(0 > to_recv(gs_socket, &temp, 1, 0)) {
-            if(EAGAIN != errno && EWOULDBLOCK != errno) {
+        ret = to_reader_next(&gs_reader, &frame);
+        if(0 > ret) {
+            if(TO_SOCKET_ERROR_TIMEOUT != ret) {
                 // recv error
-                LOG_ERROR("Error receive bytes %s", strerror(errno));
+                LOG_ERROR("Error receive frame %d", ret);
                 goto l_free_redis_reply;
             } 
             
@@ -528,45 +676,27 @@ l_start:
 //            }
         } else {
             LOG_DETAILS("Receiving data!");
-            switch(cur_state) {
-                case RECEIVE_STATE_CMD:
-                    cmd = temp;
-                    break;
-                case RECEIVE_STATE_X_FIRST:
-                    x = temp;
-                    break;
-                case RECEIVE_STATE_X_SECOND:
-                    x *= 256;
-                    x += temp;
-                    break;
-                case RECEIVE_STATE_Y_FIRST:
-                    y = temp;
-                    break;
-                case RECEIVE_STATE_Y_SECOND:
-                    y *= 256;
-                    y += temp;
-                    break;
-            }
+            cmd = frame[FRAME_CMD];
+            x = frame[FRAME_X_FIRST] * 256 + frame[FRAME_X_SECOND];
+            y = frame[FRAME_Y_FIRST] * 256 + frame[FRAME_Y_SECOND];
             
-            cur_state++;
-            if(RECEIVE_STATE_FINISHED == cur_state) {
-                cur_state = RECEIVE_STATE_CMD;
-                
-                // May need to change to publish switch or increase/decrease target temperature
-                LOG_DETAILS("Input %#X %d %d", cmd, x, y);
-                if(0xB1 == cmd) {
-//                    inactive_cnt = 0;
-//                    if(active) {
-                        LOG_DETAILS("Processing %#X %d %d", cmd, x, y);
-                        process_click(x, y);
-//                    } else {
-//                        LOG_DETAILS("LCD backlight is off, update backlight!");
-//                        EXEC_REDIS_CMD(reply, l_free_redis_reply, "PUBLISH %s/%s/%s %d", FLAG_KEY, serv_ip, BRIGHTNESS_TOPIC, LCD_ACTIVE_BACKLIGHT);
-//                        freeReplyObject(reply);
-//                        reply = NULL;
-//                        active = 1;
-//                    }
-                }
+            // May need to change to publish switch or increase/decrease target temperature
+            LOG_DETAILS("Input %#X %d %d", cmd, x, y);
+            if(0xB1 == cmd) {
+//                inactive_cnt = 0;
+//                if(active) {
+                    LOG_DETAILS("Processing %#X %d %d", cmd, x, y);
+                    click_start = stats_now();
+                    if(PROCESS_CLICK_OK == process_click(x, y)) {
+                        stats_record_since(&gs_click_stats, click_start);
+                    }
+//                } else {
+//                    LOG_DETAILS("LCD backlight is off, update backlight!");
+//                    EXEC_REDIS_CMD(reply, l_free_redis_reply, "PUBLISH %s/%s/%s %d", FLAG_KEY, serv_ip, BRIGHTNESS_TOPIC, LCD_ACTIVE_BACKLIGHT);
+//                    freeReplyObject(reply);
+//                    reply = NULL;
+//                    active = 1;
+//                }
             }
         }
     }
@@ -595,6 +725,7 @@ l_free_redis_reply:
     }
 
 l_free_redis:
+    release_slot();
     redisFree(gs_sync_context);
     
 l_socket_cleanup:
@@ -604,6 +735,7 @@ l_socket_cleanup:
 l_exit:
     if(!gs_exit) {    
         LOG_ERROR("Monitor execution failed retry!");
+        log_recorder_dump();
         sleep(1);
         goto l_start;
     }